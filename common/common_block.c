@@ -34,6 +34,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "global.h"
 #include "common_block.h"
+#include "simd.h"
+#include "common_kernels.h"
 
 int zigzag16[16] = {
     0, 1, 5, 6, 
@@ -135,22 +137,23 @@ void dequantize (int16_t *coeff, int16_t *rcoeff, int qp, int size, qmtx_t * wt_
   const int64_t scale = gdequant_table[qp % 6];
   const int64_t add = lshift < rshift ? (1<<(rshift-lshift-1)) : 0;
 
+  if (use_simd) {
+    dequantize_simd(coeff, rcoeff, qp, size, wt_matrix, ws);
+    return;
+  }
+
   if (lshift >= rshift) {
     for (int i = 0; i < size ; i++){
       for (int j = 0; j < size; j++){
-        int c = coeff[i*size+j];
-        if (wt_matrix)
-          c = c*wt_matrix[i*ws+j];
-        rcoeff[i*size+j] = (c * scale) << (lshift-rshift);// needs clipping?
+        int64_t c = coeff[i*size+j] * (wt_matrix ? wt_matrix[i*ws+j] : scale);
+        rcoeff[i*size+j] = c << (lshift-rshift);// needs clipping?
       }
     }
   } else {
     for (int i = 0; i < size ; i++){
       for (int j = 0; j < size; j++){
-        int c = coeff[i*size+j];
-        if (wt_matrix)
-          c = c*wt_matrix[i*ws+j];
-        rcoeff[i*size+j] = (c * scale + add) >> (rshift - lshift);//needs clipping
+        int64_t c = coeff[i*size+j] * (wt_matrix ? wt_matrix[i*ws+j] : scale);
+        rcoeff[i*size+j] = (c + add) >> (rshift - lshift);//needs clipping
       }
     }
 
@@ -167,6 +170,45 @@ void reconstruct_block(int16_t *block, uint8_t *pblock, uint8_t *rec, int size,
   }
 }
 
+/* Eight byte planes followed by two MV planes */
+#define DEBLOCK_UNIT_BYTES (8 + 2*sizeof(mv_t))
+
+void create_deblock_data(deblock_data_t *d, int width, int height)
+{
+  int n = (height/MIN_PB_SIZE) * (width/MIN_PB_SIZE);
+  d->stride = width/MIN_PB_SIZE;
+  d->num_units = n;
+  d->buf = (uint8_t *)malloc(n * DEBLOCK_UNIT_BYTES);
+  if (!d->buf)
+    fatalerror("Memory allocation failed for block data");
+  d->mv0 = (mv_t *)d->buf;
+  d->mv1 = d->mv0 + n;
+  d->mode = (uint8_t *)(d->mv1 + n);
+  d->cbp = d->mode + n;
+  d->size = d->cbp + n;
+  d->tb_split = d->size + n;
+  d->pb_part = d->tb_split + n;
+  d->ref_idx0 = (int8_t *)(d->pb_part + n);
+  d->ref_idx1 = d->ref_idx0 + n;
+  d->bipred_flag = d->ref_idx1 + n;
+}
+
+void close_deblock_data(deblock_data_t *d)
+{
+  free(d->buf);
+  d->buf = NULL;
+}
+
+void clear_deblock_data(deblock_data_t *d)
+{
+  memset(d->buf, 0, d->num_units * DEBLOCK_UNIT_BYTES);
+}
+
+void clone_deblock_data(deblock_data_t *dst, const deblock_data_t *src)
+{
+  memcpy(dst->buf, src->buf, src->num_units * DEBLOCK_UNIT_BYTES);
+}
+
 void find_block_contexts(int ypos, int xpos, int height, int width, int size, deblock_data_t *deblock_data, block_context_t *block_context, int enable){
 
   if (ypos >= MIN_BLOCK_SIZE && xpos >= MIN_BLOCK_SIZE && ypos + size < height && xpos + size < width && enable && size <= MAX_TR_SIZE) {
@@ -174,12 +216,11 @@ void find_block_contexts(int ypos, int xpos, int height, int width, int size, de
     int bx = xpos/MIN_PB_SIZE;
     int bs = width/MIN_PB_SIZE;
     int bindex = by*bs+bx;
-    block_context->split = (deblock_data[bindex-bs].size < size) + (deblock_data[bindex-1].size < size);
+    block_context->split = (deblock_data->size[bindex-bs] < size) + (deblock_data->size[bindex-1] < size);
     int cbp1;
-    cbp1 = (deblock_data[bindex-bs].cbp.y > 0) + (deblock_data[bindex-1].cbp.y > 0);
+    cbp1 = ((deblock_data->cbp[bindex-bs] & CBP_Y) != 0) + ((deblock_data->cbp[bindex-1] & CBP_Y) != 0);
     block_context->cbp = cbp1;
-    int cbp2 = (deblock_data[bindex-bs].cbp.y > 0 || deblock_data[bindex-bs].cbp.u > 0 || deblock_data[bindex-bs].cbp.v > 0) +
-           (deblock_data[bindex-1].cbp.y > 0 || deblock_data[bindex-1].cbp.u > 0 || deblock_data[bindex-1].cbp.v > 0);
+    int cbp2 = (deblock_data->cbp[bindex-bs] != 0) + (deblock_data->cbp[bindex-1] != 0);
     block_context->index = 3*block_context->split + cbp2;
   }
   else{
@@ -38,6 +38,31 @@ int get_downleft_available(int ypos, int xpos, int size, int height);
 void dequantize (int16_t *coeff, int16_t *rcoeff, int qp, int size, qmtx_t * wt_matrix, int ws);
 void reconstruct_block(int16_t *block, uint8_t *pblock, uint8_t *rec, int size, int stride);
 
+#define CBP_Y 1
+#define CBP_U 2
+#define CBP_V 4
+
+void create_deblock_data(deblock_data_t *d, int width, int height);
+void close_deblock_data(deblock_data_t *d);
+void clear_deblock_data(deblock_data_t *d);
+void clone_deblock_data(deblock_data_t *dst, const deblock_data_t *src);
+
+static inline uint8_t pack_cbp(cbp_t cbp)
+{
+  return (cbp.y != 0)*CBP_Y | (cbp.u != 0)*CBP_U | (cbp.v != 0)*CBP_V;
+}
+
+static inline inter_pred_t get_inter_pred(const deblock_data_t *d, int index)
+{
+  inter_pred_t p;
+  p.mv0 = d->mv0[index];
+  p.mv1 = d->mv1[index];
+  p.ref_idx0 = d->ref_idx0[index];
+  p.ref_idx1 = d->ref_idx1[index];
+  p.bipred_flag = d->bipred_flag[index];
+  return p;
+}
+
 void find_block_contexts(int ypos, int xpos, int height, int width, int size, deblock_data_t *deblock_data, block_context_t *block_context, int enable);
 
 void clpf_block(const uint8_t *src, uint8_t *dst, int sstride, int dstride, int x0, int y0, int size, int width, int height);
@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "global.h"
 #include "assert.h"
 #include "common_block.h"
+#include "simd.h"
 #include "common_kernels.h"
 
 int beta_table[52] = {
@@ -132,20 +133,20 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
       d = abs(p22-2*p12+p02) + abs(q22-2*q12+q02) + abs(p25-2*p15+p05) + abs(q25-2*q15+q05);
 #endif
 #endif
-      int m;
+      int m, lines = 0;
       for (m=0;m<MIN_BLOCK_SIZE;m+=MIN_PB_SIZE){
         q_index = ((i+m)/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + (j/MIN_PB_SIZE);
         p_index = q_index - 1;
-        p_mv0 = deblock_data[p_index].inter_pred.mv0;
-        q_mv0 = deblock_data[q_index].inter_pred.mv0;
-        p_mv1 = deblock_data[p_index].inter_pred.mv1;
-        q_mv1 = deblock_data[q_index].inter_pred.mv1;
-        p_mode = deblock_data[p_index].mode;
-        q_mode = deblock_data[q_index].mode;
-        p_cbp = deblock_data[p_index].cbp.y;
-        q_cbp = deblock_data[q_index].cbp.y;
-        q_size = deblock_data[q_index].size;
-        if ((deblock_data[q_index].tb_split || deblock_data[q_index].pb_part == PART_VER || deblock_data[q_index].pb_part == PART_QUAD) && q_size > MIN_BLOCK_SIZE) q_size = q_size/2;
+        p_mv0 = deblock_data->mv0[p_index];
+        q_mv0 = deblock_data->mv0[q_index];
+        p_mv1 = deblock_data->mv1[p_index];
+        q_mv1 = deblock_data->mv1[q_index];
+        p_mode = deblock_data->mode[p_index];
+        q_mode = deblock_data->mode[q_index];
+        p_cbp = deblock_data->cbp[p_index] & CBP_Y;
+        q_cbp = deblock_data->cbp[q_index] & CBP_Y;
+        q_size = deblock_data->size[q_index];
+        if ((deblock_data->tb_split[q_index] || deblock_data->pb_part[q_index] == PART_VER || deblock_data->pb_part[q_index] == PART_QUAD) && q_size > MIN_BLOCK_SIZE) q_size = q_size/2;
 
 #if NEW_MV_TEST
         mv = abs(p_mv0.y) >= 4 || abs(q_mv0.y) >= 4 || abs(p_mv0.x) >= 4 || abs(q_mv0.x) >= 4; //TODO: Investigate >=3 instead
@@ -162,7 +163,14 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
 #else
         do_filter = (d < beta) && !interior && (mv || cbp || mode); //TODO: This logic needs to support 4x4TUs
 #endif
-        if (do_filter){
+        if (do_filter && use_simd){
+          for (k=m;k<m+MIN_PB_SIZE;k++)
+#if MODIFIED_DEBLOCK_TEST
+            if ((k & 1 ? d_26 : d_15) < beta)
+#endif
+              lines |= 1 << k;
+        }
+        else if (do_filter){
           for (k=m;k<m+MIN_PB_SIZE;k++){
 #if MODIFIED_DEBLOCK_TEST
             d = k & 1 ? d_26 : d_15;
@@ -207,7 +215,8 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
           }
         }
       }
-
+      if (lines)
+        deblock_luma_ver_simd(recY + i*stride + j, stride, lines, tc);
     }
   }
 
@@ -266,21 +275,21 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
       d = abs(p22-2*p12+p02) + abs(q22-2*q12+q02) + abs(p25-2*p15+p05) + abs(q25-2*q15+q05);
 #endif
 #endif
-      int n;
+      int n, lines = 0;
       for (n=0;n<MIN_BLOCK_SIZE;n+=MIN_PB_SIZE){
         q_index = (i/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + ((j+n)/MIN_PB_SIZE);
         p_index = q_index - (width/MIN_PB_SIZE);
-        p_mv0 = deblock_data[p_index].inter_pred.mv0;
-        q_mv0 = deblock_data[q_index].inter_pred.mv0;
-        p_mv1 = deblock_data[p_index].inter_pred.mv1;
-        q_mv1 = deblock_data[q_index].inter_pred.mv1;
-        p_mode = deblock_data[p_index].mode;
-        q_mode = deblock_data[q_index].mode;
-        p_cbp = deblock_data[p_index].cbp.y;
-        q_cbp = deblock_data[q_index].cbp.y;
-        q_size = deblock_data[q_index].size;
-
-        if ((deblock_data[q_index].tb_split || deblock_data[q_index].pb_part == PART_HOR || deblock_data[q_index].pb_part == PART_QUAD) && q_size > MIN_BLOCK_SIZE) q_size = q_size/2;
+        p_mv0 = deblock_data->mv0[p_index];
+        q_mv0 = deblock_data->mv0[q_index];
+        p_mv1 = deblock_data->mv1[p_index];
+        q_mv1 = deblock_data->mv1[q_index];
+        p_mode = deblock_data->mode[p_index];
+        q_mode = deblock_data->mode[q_index];
+        p_cbp = deblock_data->cbp[p_index] & CBP_Y;
+        q_cbp = deblock_data->cbp[q_index] & CBP_Y;
+        q_size = deblock_data->size[q_index];
+
+        if ((deblock_data->tb_split[q_index] || deblock_data->pb_part[q_index] == PART_HOR || deblock_data->pb_part[q_index] == PART_QUAD) && q_size > MIN_BLOCK_SIZE) q_size = q_size/2;
 
 #if NEW_MV_TEST
         mv = abs(p_mv0.y) >= 4 || abs(q_mv0.y) >= 4 || abs(p_mv0.x) >= 4 || abs(q_mv0.x) >= 4;
@@ -298,7 +307,14 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
 #else
         do_filter = (d < beta) && !interior && (mv || cbp || mode); //TODO: This logic needs to support 4x4TUs
 #endif
-        if (do_filter){
+        if (do_filter && use_simd){
+          for (l=n;l<n+MIN_PB_SIZE;l++)
+#if MODIFIED_DEBLOCK_TEST
+            if ((l & 1 ? d_26 : d_15) < beta)
+#endif
+              lines |= 1 << l;
+        }
+        else if (do_filter){
           for (l=n;l<n+MIN_PB_SIZE;l++){
 #if MODIFIED_DEBLOCK_TEST
             d = l & 1 ? d_26 : d_15;
@@ -345,7 +361,8 @@ void deblock_frame_y(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width,
           }
         }
       }
-
+      if (lines)
+        deblock_luma_hor_simd(recY + i*stride + j, stride, lines, tc);
     }
   }
 }
@@ -377,14 +394,16 @@ void deblock_frame_uv(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width
         q_index = (i/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + (j/MIN_PB_SIZE);
         p_index = q_index - 1;
 
-        p_mode = deblock_data[p_index].mode;
-        q_mode = deblock_data[q_index].mode;
-        q_size = deblock_data[q_index].size;
+        p_mode = deblock_data->mode[p_index];
+        q_mode = deblock_data->mode[q_index];
+        q_size = deblock_data->size[q_index];
 
         mode = p_mode == MODE_INTRA || q_mode == MODE_INTRA;
         interior = j%q_size > 0 ? 1 : 0;
         do_filter = !interior && mode;
-        if (do_filter){
+        if (do_filter && use_simd)
+          deblock_chroma_ver_simd(recC + i2*stride + j2, stride, tc);
+        else if (do_filter){
           for (k=0;k<MIN_BLOCK_SIZE/2;k++){
             p1 = (int)recC[(i2+k)*stride + j2 - 2];
             p0 = (int)recC[(i2+k)*stride + j2 - 1];
@@ -406,14 +425,16 @@ void deblock_frame_uv(yuv_frame_t  *rec, deblock_data_t *deblock_data, int width
         int j2 = j/2;
         q_index = (i/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + (j/MIN_PB_SIZE);
         p_index = q_index - (width/MIN_PB_SIZE);
-        p_mode = deblock_data[p_index].mode;
-        q_mode = deblock_data[q_index].mode;
-        q_size = deblock_data[q_index].size;
+        p_mode = deblock_data->mode[p_index];
+        q_mode = deblock_data->mode[q_index];
+        q_size = deblock_data->size[q_index];
 
         mode = p_mode == MODE_INTRA || q_mode == MODE_INTRA;
         interior = i%q_size > 0 ? 1 : 0;
         do_filter = !interior && mode;
-        if (do_filter){
+        if (do_filter && use_simd)
+          deblock_chroma_hor_simd(recC + i2*stride + j2, stride, tc);
+        else if (do_filter){
           for (l=0;l<MIN_BLOCK_SIZE/2;l++){
             p1 = (int)recC[(i2-2)*stride + j2 + l];
             p0 = (int)recC[(i2-1)*stride + j2 + l];
@@ -448,6 +469,7 @@ void create_yuv_frame(yuv_frame_t  *frame, int width, int height, int pad_ver_y,
   frame->y = (uint8_t *)malloc(frame->area_y*sizeof(uint8_t))+frame->offset_y;
   frame->u = (uint8_t *)malloc(2*frame->area_c*sizeof(uint8_t))+frame->offset_c;
   frame->v = frame->u + frame->area_c*sizeof(uint8_t);
+  frame->buffer = NULL;
 
   int align;
   align = (16 - ((int64_t)frame->y)) & 15;
@@ -512,6 +534,40 @@ void write_yuv_frame(yuv_frame_t  *frame, int width, int height, FILE *outfile)
 }
 
 
+static void interleave_uv(uint8_t *uv, const uint8_t *u, const uint8_t *v, int len)
+{
+  if (use_simd) {
+    interleave_uv_simd(uv, u, v, len);
+    return;
+  }
+  for (int j=0; j<len; j++) {
+    uv[2*j] = u[j];
+    uv[2*j+1] = v[j];
+  }
+}
+
+/* Write frame with interleaved chroma (NV12), one row at a time */
+void write_nv12_frame(yuv_frame_t  *frame, int width, int height, FILE *outfile)
+{
+  uint8_t *uv = (uint8_t *)malloc(width);
+  if (uv == NULL)
+    fatalerror("Memory allocation failed for output row\n");
+  for (int i=0; i<height; ++i) {
+    if (fwrite(&frame->y[i*frame->stride_y], sizeof(unsigned char), width, outfile) != width)
+    {
+      fatalerror("Error writing Y to file");
+    }
+  }
+  for (int i=0; i<height/2; ++i) {
+    interleave_uv(uv, &frame->u[i*frame->stride_c], &frame->v[i*frame->stride_c], width/2);
+    if (fwrite(uv, sizeof(unsigned char), width, outfile) != width)
+    {
+      fatalerror("Error writing UV to file");
+    }
+  }
+  free(uv);
+}
+
 void pad_yuv_frame(yuv_frame_t * f)
 {
   int sy = f->stride_y;
@@ -571,25 +627,103 @@ void pad_yuv_frame(yuv_frame_t * f)
 
 }
 
-void create_reference_frame(yuv_frame_t  *ref,yuv_frame_t  *rec)
+/* Frame memory is allocated the first time a frame is acquired, so the pool only grows to the
+   number of frames in use at once */
+void create_frame_pool(frame_pool_t *pool, int num_frames, int width, int height, int pad_ver_y, int pad_hor_y, int pad_ver_uv, int pad_hor_uv, const frame_allocator_t *allocator)
 {
-  ref->frame_num = rec->frame_num;
-  int height = rec->height;
-  int width = rec->width;  
-  int i;
-  uint8_t *ref_y = ref->y;
-  uint8_t *ref_u = ref->u;
-  uint8_t *ref_v = ref->v;
-  for (i=0;i<height;i++){
-    memcpy(&ref_y[i*ref->stride_y],&rec->y[i*rec->stride_y],width*sizeof(uint8_t)); 
+  pool->num_frames = num_frames;
+  pool->allocator = allocator;
+  pool->frames = (yuv_frame_t *)calloc(num_frames, sizeof(yuv_frame_t));
+  pool->refcount = (int *)calloc(num_frames, sizeof(int));
+  if (pool->frames == NULL || pool->refcount == NULL)
+    fatalerror("Memory allocation failed for frame pool\n");
+  for (int i=0;i<num_frames;i++){
+    yuv_frame_t *frame = &pool->frames[i];
+    frame->width = width;
+    frame->height = height;
+    frame->pad_hor_y = pad_hor_y;
+    frame->pad_ver_y = pad_ver_y;
+    frame->pad_hor_c = pad_hor_uv;
+    frame->pad_ver_c = pad_ver_uv;
+  }
+}
+
+static void release_frame_buffer(frame_pool_t *pool, yuv_frame_t *frame)
+{
+  pool->allocator->release_buffer(pool->allocator->opaque, frame);
+  frame->y = frame->u = frame->v = NULL;
+  frame->buffer = NULL;
+}
+
+void close_frame_pool(frame_pool_t *pool)
+{
+  for (int i=0;i<pool->num_frames;i++){
+    if (!pool->frames[i].y)
+      continue;
+    if (pool->allocator)
+      release_frame_buffer(pool, &pool->frames[i]);
+    else
+      close_yuv_frame(&pool->frames[i]);
   }
-  for (i=0;i<height/2;i++){
-    memcpy(&ref_u[i*ref->stride_c],&rec->u[i*rec->stride_c],width/2*sizeof(uint8_t));
-    memcpy(&ref_v[i*ref->stride_c],&rec->v[i*rec->stride_c],width/2*sizeof(uint8_t));
+  free(pool->frames);
+  free(pool->refcount);
+  pool->num_frames = 0;
+}
+
+/* Ask the allocator of the pool for the memory of frame and check that it can be used by the codec */
+static void get_frame_buffer(frame_pool_t *pool, yuv_frame_t *frame)
+{
+  frame->buffer = NULL;
+  if (!pool->allocator->get_buffer(pool->allocator->opaque, frame))
+    fatalerror("Frame allocator failed to supply a buffer\n");
+  if ((((uintptr_t)frame->y | (uintptr_t)frame->u | (uintptr_t)frame->v) & 15) ||
+      (frame->stride_y & 15) || (frame->stride_c & 15) ||
+      frame->stride_y < frame->width + 2*frame->pad_hor_y ||
+      frame->stride_c < frame->width/2 + 2*frame->pad_hor_c)
+    fatalerror("Frame buffer does not meet the stride and alignment requirements\n");
+  frame->offset_y = frame->pad_ver_y * frame->stride_y + frame->pad_hor_y;
+  frame->offset_c = frame->pad_ver_c * frame->stride_c + frame->pad_hor_c;
+  frame->area_y = (frame->height + 2*frame->pad_ver_y) * frame->stride_y;
+  frame->area_c = (frame->height/2 + 2*frame->pad_ver_c) * frame->stride_c;
+}
+
+/* Return an unused frame with a reference count of one */
+yuv_frame_t *acquire_pool_frame(frame_pool_t *pool)
+{
+  for (int i=0;i<pool->num_frames;i++){
+    if (pool->refcount[i] == 0){
+      yuv_frame_t *frame = &pool->frames[i];
+      pool->refcount[i] = 1;
+      if (pool->allocator)
+        get_frame_buffer(pool, frame);
+      else if (!frame->y)
+        create_yuv_frame(frame,frame->width,frame->height,frame->pad_ver_y,frame->pad_hor_y,frame->pad_ver_c,frame->pad_hor_c);
+      return frame;
+    }
   }
+  fatalerror("No free frame in frame pool\n");
+  return NULL;
+}
 
-  pad_yuv_frame(ref);
+void retain_pool_frame(frame_pool_t *pool, yuv_frame_t *frame)
+{
+  pool->refcount[frame - pool->frames]++;
+}
+
+void release_pool_frame(frame_pool_t *pool, yuv_frame_t *frame)
+{
+  if (frame && --pool->refcount[frame - pool->frames] == 0 && pool->allocator)
+    release_frame_buffer(pool, frame);
+}
 
+/* Sliding window operation for a reference frame buffer of num_ref_frames frames.
+   The oldest frame is released, and frame is retained as the new ref[0]. */
+void shift_reference_window(frame_pool_t *pool, yuv_frame_t **ref, int num_ref_frames, yuv_frame_t *frame)
+{
+  release_pool_frame(pool, ref[num_ref_frames-1]);
+  memmove(ref+1, ref, sizeof(yuv_frame_t*)*(num_ref_frames-1));
+  retain_pool_frame(pool, frame);
+  ref[0] = frame;
 }
 
 void clpf_frame(yuv_frame_t *rec, yuv_frame_t *org, const deblock_data_t *deblock_data, void *stream,
@@ -615,8 +749,8 @@ void clpf_frame(yuv_frame_t *rec, yuv_frame_t *org, const deblock_data_t *debloc
           xpos = l*MAX_BLOCK_SIZE + n*block_size;
           ypos = k*MAX_BLOCK_SIZE + m*block_size;
           index = (ypos/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + (xpos/MIN_PB_SIZE);
-          cand |= deblock_data[index].mode != MODE_BIPRED &&
-            (deblock_data[index].cbp.y || deblock_data[index].cbp.u || deblock_data[index].cbp.v);
+          cand |= deblock_data->mode[index] != MODE_BIPRED &&
+            deblock_data->cbp[index] != 0;
         }
       }
 
@@ -637,17 +771,17 @@ void clpf_frame(yuv_frame_t *rec, yuv_frame_t *org, const deblock_data_t *debloc
             xpos = l*MAX_BLOCK_SIZE + n*block_size;
             ypos = k*MAX_BLOCK_SIZE + m*block_size;
             index = (ypos/MIN_PB_SIZE)*(width/MIN_PB_SIZE) + (xpos/MIN_PB_SIZE);
-            int filter = deblock_data[index].mode != MODE_BIPRED;
+            int filter = deblock_data->mode[index] != MODE_BIPRED;
 
             if (filter) {
               /* Y */
-              if (deblock_data[index].cbp.y)
+              if (deblock_data->cbp[index] & CBP_Y)
                 (use_simd ? clpf_block_simd : clpf_block)(rec->y,tmp,stride_y,MAX_BLOCK_SIZE, xpos,ypos,block_size,width, height);
 
               /* C */
-              if (deblock_data[index].cbp.u)
+              if (deblock_data->cbp[index] & CBP_U)
                 (use_simd ? clpf_block_simd : clpf_block)(rec->u,tmp+MAX_BLOCK_SIZE*MAX_BLOCK_SIZE,stride_c,MAX_BLOCK_SIZE/2,xpos/2,ypos/2,block_size/2,width/2,height/2);
-              if (deblock_data[index].cbp.v)
+              if (deblock_data->cbp[index] & CBP_V)
                 (use_simd ? clpf_block_simd : clpf_block)(rec->v,tmp+MAX_BLOCK_SIZE*MAX_BLOCK_SIZE*5/4,stride_c,MAX_BLOCK_SIZE/2,xpos/2,ypos/2,block_size/2,width/2,height/2);
             }
           }
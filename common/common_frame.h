@@ -33,8 +33,14 @@ void create_yuv_frame(yuv_frame_t  *frame, int width, int height, int pad_ver_y,
 void close_yuv_frame(yuv_frame_t  *frame);
 void read_yuv_frame(yuv_frame_t  *frame, int width, int height, FILE *infile);
 void write_yuv_frame(yuv_frame_t  *frame, int width, int height, FILE *outfile);
+void write_nv12_frame(yuv_frame_t  *frame, int width, int height, FILE *outfile);
 void pad_yuv_frame(yuv_frame_t* f);
-void create_reference_frame(yuv_frame_t  *ref,yuv_frame_t  *rec);
+void create_frame_pool(frame_pool_t *pool, int num_frames, int width, int height, int pad_ver_y, int pad_hor_y, int pad_ver_uv, int pad_hor_uv, const frame_allocator_t *allocator);
+void close_frame_pool(frame_pool_t *pool);
+yuv_frame_t *acquire_pool_frame(frame_pool_t *pool);
+void retain_pool_frame(frame_pool_t *pool, yuv_frame_t *frame);
+void release_pool_frame(frame_pool_t *pool, yuv_frame_t *frame);
+void shift_reference_window(frame_pool_t *pool, yuv_frame_t **ref, int num_ref_frames, yuv_frame_t *frame);
 void clpf_frame(yuv_frame_t *rec, yuv_frame_t *org, const deblock_data_t *deblock_data, void *stream,
                 int (*decision)(int, int, yuv_frame_t *, yuv_frame_t *, const deblock_data_t *, int, void *));
 
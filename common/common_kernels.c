@@ -2354,3 +2354,268 @@ void clpf_block8(const uint8_t *src, uint8_t *dst, int sstride, int dstride, int
     dst += dstride;
   }
 }
+
+/* Bit-exact with dequantize(), the products only need to be correct
+   modulo 2^32 since at most 11 bits are shifted out before truncation */
+void dequantize_simd(int16_t *coeff, int16_t *rcoeff, int qp, int size, qmtx_t *wt_matrix, int ws)
+{
+  extern const uint16_t gdequant_table[6];
+  int lshift = qp / 6;
+  int rshift = log2i(size) - 1 + (wt_matrix != NULL ? INV_WEIGHT_SHIFT : 0);
+  int add = lshift < rshift ? (1 << (rshift - lshift - 1)) : 0;
+  v128 scale = v128_dup_32(gdequant_table[qp % 6]);
+  v128 round = v128_dup_32(add);
+  int i, j;
+
+  if (size == 4) {
+    for (i = 0; i < 4; i++) {
+      v128 c = v128_unpack_s16_s32(v64_load_unaligned(coeff + i*4));
+      c = v128_mullo_s32(c, wt_matrix ? v128_load_unaligned(wt_matrix + i*ws) : scale);
+      c = lshift >= rshift ? v128_shl_32(c, lshift - rshift) : v128_shr_s32(v128_add_32(c, round), rshift - lshift);
+      v64_store_unaligned(rcoeff + i*4, v128_low_v64(v128_unziplo_16(c, c)));
+    }
+  } else {
+    for (i = 0; i < size; i++) {
+      for (j = 0; j < size; j += 8) {
+        v128 c = v128_load_unaligned(coeff + i*size + j);
+        v128 lo = v128_unpacklo_s16_s32(c);
+        v128 hi = v128_unpackhi_s16_s32(c);
+        lo = v128_mullo_s32(lo, wt_matrix ? v128_load_unaligned(wt_matrix + i*ws + j) : scale);
+        hi = v128_mullo_s32(hi, wt_matrix ? v128_load_unaligned(wt_matrix + i*ws + j + 4) : scale);
+        if (lshift >= rshift) {
+          lo = v128_shl_32(lo, lshift - rshift);
+          hi = v128_shl_32(hi, lshift - rshift);
+        } else {
+          lo = v128_shr_s32(v128_add_32(lo, round), rshift - lshift);
+          hi = v128_shr_s32(v128_add_32(hi, round), rshift - lshift);
+        }
+        v128_store_unaligned(rcoeff + i*size + j, v128_unziplo_16(hi, lo));
+      }
+    }
+  }
+}
+
+/* Filter the four pixels closest to an edge for the lines set in mask */
+SIMD_INLINE void deblock_luma_lines(v64 *p1, v64 *p0, v64 *q0, v64 *q1, v64 p2, v64 q2, v64 mask, int tc)
+{
+  v128 P1 = v128_unpack_u8_s16(*p1);
+  v128 P0 = v128_unpack_u8_s16(*p0);
+  v128 Q0 = v128_unpack_u8_s16(*q0);
+  v128 Q1 = v128_unpack_u8_s16(*q1);
+#if NEW_DEBLOCK_FILTER
+  v128 delta = v128_sub_16(v128_mullo_s16(v128_sub_16(Q0, P0), v128_dup_16(18)),
+                           v128_mullo_s16(v128_sub_16(Q1, P1), v128_dup_16(6)));
+  (void)p2;
+  (void)q2;
+#else
+  v128 delta = v128_add_16(v128_mullo_s16(v128_sub_16(Q0, P0), v128_dup_16(13)),
+                           v128_shl_n_16(v128_sub_16(Q1, P1), 2));
+  delta = v128_sub_16(delta, v128_mullo_s16(v128_sub_16(v128_unpack_u8_s16(q2), v128_unpack_u8_s16(p2)), v128_dup_16(5)));
+#endif
+  delta = v128_shr_n_s16(v128_add_16(delta, v128_dup_16(16)), 5);
+  delta = v128_min_s16(v128_max_s16(delta, v128_dup_16(-tc)), v128_dup_16(tc));
+
+  /* delta/2 rounding towards zero */
+  v128 half = v128_shr_n_s16(v128_sub_16(delta, v128_shr_n_s16(delta, 15)), 1);
+  v128 p = v128_pack_s16_u8(v128_add_16(P1, half), v128_add_16(P0, delta));
+  v128 q = v128_pack_s16_u8(v128_sub_16(Q0, delta), v128_sub_16(Q1, half));
+
+  *p1 = v64_or(v64_and(v128_high_v64(p), mask), v64_andn(*p1, mask));
+  *p0 = v64_or(v64_and(v128_low_v64(p), mask), v64_andn(*p0, mask));
+  *q0 = v64_or(v64_and(v128_high_v64(q), mask), v64_andn(*q0, mask));
+  *q1 = v64_or(v64_and(v128_low_v64(q), mask), v64_andn(*q1, mask));
+}
+
+SIMD_INLINE v64 deblock_line_mask(int lines)
+{
+  v64 bits = v64_from_64(0x8040201008040201LL);
+  return v64_cmpeq_8(v64_and(v64_dup_8(lines), bits), bits);
+}
+
+/* Filter a vertical 8x8 luma edge, rec points to q0 of the first line */
+void deblock_luma_ver_simd(uint8_t *rec, int stride, int lines, int tc)
+{
+  uint8_t *r = rec - 4;
+  v128 s0 = v128_zip_8(v64_load_unaligned(r + 1*stride), v64_load_unaligned(r + 0*stride));
+  v128 s1 = v128_zip_8(v64_load_unaligned(r + 3*stride), v64_load_unaligned(r + 2*stride));
+  v128 s2 = v128_zip_8(v64_load_unaligned(r + 5*stride), v64_load_unaligned(r + 4*stride));
+  v128 s3 = v128_zip_8(v64_load_unaligned(r + 7*stride), v64_load_unaligned(r + 6*stride));
+  v128 u0 = v128_ziplo_16(s1, s0);
+  v128 u1 = v128_ziphi_16(s1, s0);
+  v128 u2 = v128_ziplo_16(s3, s2);
+  v128 u3 = v128_ziphi_16(s3, s2);
+  v128 c01 = v128_ziplo_32(u2, u0);
+  v128 c23 = v128_ziphi_32(u2, u0);
+  v128 c45 = v128_ziplo_32(u3, u1);
+  v128 c67 = v128_ziphi_32(u3, u1);
+  v64 p1 = v128_low_v64(c23);
+  v64 p0 = v128_high_v64(c23);
+  v64 q0 = v128_low_v64(c45);
+  v64 q1 = v128_high_v64(c45);
+  int i;
+
+  deblock_luma_lines(&p1, &p0, &q0, &q1, v128_high_v64(c01), v128_low_v64(c67), deblock_line_mask(lines), tc);
+
+  /* Transpose the four modified columns back */
+  v128 a = v128_zip_8(p0, p1);
+  v128 b = v128_zip_8(q1, q0);
+  v128 lo = v128_ziplo_16(b, a);
+  v128 hi = v128_ziphi_16(b, a);
+  for (i = 0; i < 4; i++) {
+    u32_store_unaligned(rec - 2 + i*stride, v128_low_u32(lo));
+    u32_store_unaligned(rec - 2 + (i + 4)*stride, v128_low_u32(hi));
+    lo = v128_shr_n_byte(lo, 4);
+    hi = v128_shr_n_byte(hi, 4);
+  }
+}
+
+/* Filter a horizontal 8 pixel luma edge, rec points to q0 of the first line */
+void deblock_luma_hor_simd(uint8_t *rec, int stride, int lines, int tc)
+{
+  v64 p1 = v64_load_unaligned(rec - 2*stride);
+  v64 p0 = v64_load_unaligned(rec - 1*stride);
+  v64 q0 = v64_load_unaligned(rec);
+  v64 q1 = v64_load_unaligned(rec + 1*stride);
+
+  deblock_luma_lines(&p1, &p0, &q0, &q1, v64_load_unaligned(rec - 3*stride), v64_load_unaligned(rec + 2*stride), deblock_line_mask(lines), tc);
+
+  v64_store_unaligned(rec - 2*stride, p1);
+  v64_store_unaligned(rec - 1*stride, p0);
+  v64_store_unaligned(rec, q0);
+  v64_store_unaligned(rec + 1*stride, q1);
+}
+
+/* Filter four chroma lines given as packed p1, p0, q0, q1 */
+SIMD_INLINE void deblock_chroma_lines(uint32_t *p0, uint32_t *q0, uint32_t p1, uint32_t q1, int tc)
+{
+  v64 P1 = v64_unpacklo_u8_s16(v64_from_32(0, p1));
+  v64 P0 = v64_unpacklo_u8_s16(v64_from_32(0, *p0));
+  v64 Q0 = v64_unpacklo_u8_s16(v64_from_32(0, *q0));
+  v64 Q1 = v64_unpacklo_u8_s16(v64_from_32(0, q1));
+  v64 delta = v64_add_16(v64_shl_n_16(v64_sub_16(Q0, P0), 2), v64_sub_16(P1, Q1));
+  delta = v64_shr_n_s16(v64_add_16(delta, v64_dup_16(4)), 3);
+  delta = v64_min_s16(v64_max_s16(delta, v64_dup_16(-tc)), v64_dup_16(tc));
+  v64 r = v64_pack_s16_u8(v64_add_16(P0, delta), v64_sub_16(Q0, delta));
+  *p0 = v64_high_u32(r);
+  *q0 = v64_low_u32(r);
+}
+
+/* Filter a vertical 4x4 chroma edge, rec points to q0 of the first line */
+void deblock_chroma_ver_simd(uint8_t *rec, int stride, int tc)
+{
+  v128 transpose = v128_from_32(0x0f0b0703, 0x0e0a0602, 0x0d090501, 0x0c080400);
+  v128 t = v128_shuffle_8(v128_from_32(u32_load_unaligned(rec - 2 + 3*stride),
+                                       u32_load_unaligned(rec - 2 + 2*stride),
+                                       u32_load_unaligned(rec - 2 + 1*stride),
+                                       u32_load_unaligned(rec - 2 + 0*stride)), transpose);
+  uint32_t p1 = v128_low_u32(t);
+  uint32_t p0 = v128_low_u32(v128_shr_n_byte(t, 4));
+  uint32_t q0 = v128_low_u32(v128_shr_n_byte(t, 8));
+  uint32_t q1 = v128_low_u32(v128_shr_n_byte(t, 12));
+  int i;
+
+  deblock_chroma_lines(&p0, &q0, p1, q1, tc);
+
+  t = v128_shuffle_8(v128_from_32(q1, q0, p0, p1), transpose);
+  for (i = 0; i < 4; i++) {
+    u32_store_unaligned(rec - 2 + i*stride, v128_low_u32(t));
+    t = v128_shr_n_byte(t, 4);
+  }
+}
+
+/* Filter a horizontal 4 pixel chroma edge, rec points to q0 of the first line */
+void deblock_chroma_hor_simd(uint8_t *rec, int stride, int tc)
+{
+  uint32_t p0 = u32_load_unaligned(rec - stride);
+  uint32_t q0 = u32_load_unaligned(rec);
+
+  deblock_chroma_lines(&p0, &q0, u32_load_unaligned(rec - 2*stride), u32_load_unaligned(rec + stride), tc);
+
+  u32_store_unaligned(rec - stride, p0);
+  u32_store_unaligned(rec, q0);
+}
+
+/* 1-2-1 filter with the end samples repeated */
+void filter_121_simd(const uint8_t *in, uint8_t *out, int len)
+{
+  ALIGN(16) uint8_t buf[2*MAX_TR_SIZE+2];
+  int j;
+
+  buf[0] = in[0];
+  memcpy(buf + 1, in, len);
+  buf[len+1] = in[len-1];
+
+  if (len == 4) {
+    v64 a = v64_unpacklo_u8_s16(v64_from_32(0, u32_load_unaligned(buf + 0)));
+    v64 b = v64_unpacklo_u8_s16(v64_from_32(0, u32_load_unaligned(buf + 1)));
+    v64 c = v64_unpacklo_u8_s16(v64_from_32(0, u32_load_unaligned(buf + 2)));
+    v64 r = v64_shr_n_u16(v64_add_16(v64_add_16(a, c), v64_add_16(v64_shl_n_16(b, 1), v64_dup_16(2))), 2);
+    u32_store_unaligned(out, v64_low_u32(v64_pack_s16_u8(r, r)));
+  } else {
+    for (j = 0; j < len; j += 8) {
+      v128 a = v128_unpack_u8_s16(v64_load_unaligned(buf + j + 0));
+      v128 b = v128_unpack_u8_s16(v64_load_unaligned(buf + j + 1));
+      v128 c = v128_unpack_u8_s16(v64_load_unaligned(buf + j + 2));
+      v128 r = v128_shr_n_u16(v128_add_16(v128_add_16(a, c), v128_add_16(v128_shl_n_16(b, 1), v128_dup_16(2))), 2);
+      v64_store_unaligned(out + j, v128_low_v64(v128_pack_s16_u8(r, r)));
+    }
+  }
+}
+
+/* Copy intra prediction rows from a line buffer, row i starting at
+   line[base[i&1] + (i>>1)*step] */
+void intra_rows_simd(uint8_t *pblock, const uint8_t *line, int base0, int base1, int step, int size)
+{
+  int i, j;
+  for (i = 0; i < size; i++) {
+    const uint8_t *l = line + ((i & 1) ? base1 : base0) + (i >> 1)*step;
+    if (size == 4)
+      u32_store_unaligned(pblock + i*4, u32_load_unaligned(l));
+    else if (size == 8)
+      v64_store_unaligned(pblock + i*8, v64_load_unaligned(l));
+    else
+      for (j = 0; j < size; j += 16)
+        v128_store_unaligned(pblock + i*size + j, v128_load_unaligned(l + j));
+  }
+}
+
+void planar_pred_simd(const int16_t *leftF, const int16_t *topF, int top_leftF, int size, uint8_t *pblock)
+{
+  int i, j;
+  if (size == 4) {
+    v64 t = v64_load_unaligned(topF);
+    for (i = 0; i < 4; i++) {
+      v64 r = v64_shr_n_s16(v64_add_16(t, v64_dup_16(leftF[i] - top_leftF + 4)), 3);
+      u32_store_unaligned(pblock + i*4, v64_low_u32(v64_pack_s16_u8(r, r)));
+    }
+  } else {
+    for (i = 0; i < size; i++) {
+      v128 l = v128_dup_16(leftF[i] - top_leftF + 4);
+      for (j = 0; j < size; j += 16) {
+        v128 r0 = v128_shr_n_s16(v128_add_16(v128_load_unaligned(topF + j), l), 3);
+        if (size == 8) {
+          v64_store_unaligned(pblock + i*size + j, v128_low_v64(v128_pack_s16_u8(r0, r0)));
+        } else {
+          v128 r1 = v128_shr_n_s16(v128_add_16(v128_load_unaligned(topF + j + 8), l), 3);
+          v128_store_unaligned(pblock + i*size + j, v128_pack_s16_u8(r1, r0));
+        }
+      }
+    }
+  }
+}
+
+/* Interleave len samples of two chroma rows into one row of U,V pairs (NV12) */
+void interleave_uv_simd(uint8_t *uv, const uint8_t *u, const uint8_t *v, int len)
+{
+  int j;
+  for (j = 0; j + 16 <= len; j += 16) {
+    v128 a = v128_load_unaligned(u + j);
+    v128 b = v128_load_unaligned(v + j);
+    v128_store_unaligned(uv + 2*j, v128_ziplo_8(b, a));
+    v128_store_unaligned(uv + 2*j + 16, v128_ziphi_8(b, a));
+  }
+  for (; j < len; j++) {
+    uv[2*j] = u[j];
+    uv[2*j+1] = v[j];
+  }
+}
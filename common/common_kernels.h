@@ -34,6 +34,15 @@ void get_inter_prediction_luma_simd(int width, int height, int xoff, int yoff, u
 void get_inter_prediction_chroma_simd(int width, int height, int xoff, int yoff, unsigned char *restrict qp, int qstride, const unsigned char *restrict ip, int istride);
 void transform_simd(const int16_t *block, int16_t *coeff, int size, int fast);
 void inverse_transform_simd(const int16_t *coeff, int16_t *block, int size);
+void dequantize_simd(int16_t *coeff, int16_t *rcoeff, int qp, int size, qmtx_t *wt_matrix, int ws);
+void deblock_luma_ver_simd(uint8_t *rec, int stride, int lines, int tc);
+void deblock_luma_hor_simd(uint8_t *rec, int stride, int lines, int tc);
+void deblock_chroma_ver_simd(uint8_t *rec, int stride, int tc);
+void deblock_chroma_hor_simd(uint8_t *rec, int stride, int tc);
+void filter_121_simd(const uint8_t *in, uint8_t *out, int len);
+void intra_rows_simd(uint8_t *pblock, const uint8_t *line, int base0, int base1, int step, int size);
+void planar_pred_simd(const int16_t *leftF, const int16_t *topF, int top_leftF, int size, uint8_t *pblock);
+void interleave_uv_simd(uint8_t *uv, const uint8_t *u, const uint8_t *v, int len);
 void clpf_block4(const uint8_t *src, uint8_t *dst, int sstride, int dstride, int x0, int y0, int width, int height);
 void clpf_block8(const uint8_t *src, uint8_t *dst, int sstride, int dstride, int x0, int y0, int width, int height);
 SIMD_INLINE void clpf_block_simd(const uint8_t *src, uint8_t *dst, int sstride, int dstride, int x0, int y0, int size, int width, int height) {
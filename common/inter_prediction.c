@@ -201,6 +201,77 @@ void get_inter_prediction_luma(uint8_t *pblock, uint8_t *ref, int width, int hei
   }
 }
 
+#define EDGE_MARGIN 8
+#define EDGE_STRIDE (MAX_BLOCK_SIZE+2*EDGE_MARGIN)
+
+/* Copy the area around (x,y) in a plane with the picture edges replicated, as pad_yuv_frame() would */
+static uint8_t *fetch_edge_block(uint8_t *buf, const uint8_t *plane, int stride, int x, int y, int height, int pic_width, int pic_height)
+{
+  int i,j;
+  for (i=0;i<height+2*EDGE_MARGIN;i++){
+    const uint8_t *src = plane + clip(y+i-EDGE_MARGIN,0,pic_height-1)*stride;
+    for (j=0;j<EDGE_STRIDE;j++)
+      buf[i*EDGE_STRIDE+j] = src[clip(x+j-EDGE_MARGIN,0,pic_width-1)];
+  }
+  return buf + EDGE_MARGIN*EDGE_STRIDE + EDGE_MARGIN;
+}
+
+/* Prediction of the block at (x,y) from a plane that need not be padded. The block itself
+   lies inside the enclosing block at (xpos,ypos), which bounds the motion vector. */
+void get_inter_prediction_chroma_clamped(uint8_t *pblock, uint8_t *plane, int stride, int x, int y, int width, int height, int pstride, mv_t *mv, int sign, int pic_width2, int pic_height2, int xpos, int ypos)
+{
+  ALIGN(16) uint8_t buf[(MAX_BLOCK_SIZE+2*EDGE_MARGIN+1)*EDGE_STRIDE];
+  mv_t mvtemp;
+  mvtemp.x = sign ? -mv->x : mv->x;
+  mvtemp.y = sign ? -mv->y : mv->y;
+  int ver_int = (mvtemp.y)>>3;
+  int hor_int = (mvtemp.x)>>3;
+  ver_int = min(ver_int,pic_height2-ypos);
+  ver_int = max(ver_int,-xpos-height);
+  hor_int = min(hor_int,pic_width2-xpos);
+  hor_int = max(hor_int,-xpos-width);
+  int x0 = x + hor_int;
+  int y0 = y + ver_int;
+
+  /* Interior blocks read the plane directly */
+  if (x0 >= 1 && y0 >= 1 && x0 + width + 2 <= pic_width2 && y0 + height + 2 <= pic_height2) {
+    get_inter_prediction_chroma(pblock, plane + y*stride + x, width, height, stride, pstride, mv, sign, pic_width2, pic_height2, xpos, ypos);
+    return;
+  }
+
+  /* Only the fractional part of the motion vector is left once the footprint has been fetched */
+  mvtemp.x &= 7;
+  mvtemp.y &= 7;
+  get_inter_prediction_chroma(pblock, fetch_edge_block(buf, plane, stride, x0, y0, height, pic_width2, pic_height2), width, height, EDGE_STRIDE, pstride, &mvtemp, 0, pic_width2, pic_height2, xpos, ypos);
+}
+
+void get_inter_prediction_luma_clamped(uint8_t *pblock, uint8_t *plane, int stride, int x, int y, int width, int height, int pstride, mv_t *mv, int sign, int bipred, int pic_width, int pic_height, int xpos, int ypos)
+{
+  ALIGN(16) uint8_t buf[(MAX_BLOCK_SIZE+2*EDGE_MARGIN+1)*EDGE_STRIDE];
+  mv_t mvtemp;
+  mvtemp.x = sign ? -mv->x : mv->x;
+  mvtemp.y = sign ? -mv->y : mv->y;
+  int ver_int = (mvtemp.y)>>2;
+  int hor_int = (mvtemp.x)>>2;
+  ver_int = min(ver_int,pic_height-ypos);
+  ver_int = max(ver_int,-xpos-height);
+  hor_int = min(hor_int,pic_width-xpos);
+  hor_int = max(hor_int,-xpos-width);
+  int x0 = x + hor_int;
+  int y0 = y + ver_int;
+
+  /* Interior blocks read the plane directly */
+  if (x0 >= OFFYM1 && y0 >= OFFYM1 && x0 + width + OFFY <= pic_width && y0 + height + OFFY <= pic_height) {
+    get_inter_prediction_luma(pblock, plane + y*stride + x, width, height, stride, pstride, mv, sign, bipred, pic_width, pic_height, xpos, ypos);
+    return;
+  }
+
+  /* Only the fractional part of the motion vector is left once the footprint has been fetched */
+  mvtemp.x &= 3;
+  mvtemp.y &= 3;
+  get_inter_prediction_luma(pblock, fetch_edge_block(buf, plane, stride, x0, y0, height, pic_width, pic_height), width, height, EDGE_STRIDE, pstride, &mvtemp, 0, bipred, pic_width, pic_height, xpos, ypos);
+}
+
 mv_t get_mv_pred(int ypos,int xpos,int width,int height,int size,int ref_idx,deblock_data_t *deblock_data) //TODO: Remove ref_idx as argument if not needed
 {
   mv_t mvp, mva, mvb, mvc;
@@ -254,44 +325,44 @@ mv_t get_mv_pred(int ypos,int xpos,int width,int height,int size,int ref_idx,deb
      inter_predC = zero_pred;
   }
   else if (U==1 && UR==0 && L==0 && DL==0){
-     inter_predA = deblock_data[up_index0].inter_pred;
-     inter_predB = deblock_data[up_index1].inter_pred;
-     inter_predC = deblock_data[up_index2].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, up_index0);
+     inter_predB = get_inter_pred(deblock_data, up_index1);
+     inter_predC = get_inter_pred(deblock_data, up_index2);
   }
   else if (U==1 && UR==1 && L==0 && DL==0){
-     inter_predA = deblock_data[up_index0].inter_pred;
-     inter_predB = deblock_data[up_index2].inter_pred;
-     inter_predC = deblock_data[upright_index].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, up_index0);
+     inter_predB = get_inter_pred(deblock_data, up_index2);
+     inter_predC = get_inter_pred(deblock_data, upright_index);
   }
   else if (U==0 && UR==0 && L==1 && DL==0){
-     inter_predA = deblock_data[left_index0].inter_pred;
-     inter_predB = deblock_data[left_index1].inter_pred;
-     inter_predC = deblock_data[left_index2].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, left_index0);
+     inter_predB = get_inter_pred(deblock_data, left_index1);
+     inter_predC = get_inter_pred(deblock_data, left_index2);
   }
   else if (U==1 && UR==0 && L==1 && DL==0){
-     inter_predA = deblock_data[upleft_index].inter_pred;
-     inter_predB = deblock_data[up_index2].inter_pred;
-     inter_predC = deblock_data[left_index2].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, upleft_index);
+     inter_predB = get_inter_pred(deblock_data, up_index2);
+     inter_predC = get_inter_pred(deblock_data, left_index2);
   }
   else if (U==1 && UR==1 && L==1 && DL==0){
-     inter_predA = deblock_data[up_index0].inter_pred;
-     inter_predB = deblock_data[upright_index].inter_pred;
-     inter_predC = deblock_data[left_index2].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, up_index0);
+     inter_predB = get_inter_pred(deblock_data, upright_index);
+     inter_predC = get_inter_pred(deblock_data, left_index2);
   }
  else if (U==0 && UR==0 && L==1 && DL==1){
-     inter_predA = deblock_data[left_index0].inter_pred;
-     inter_predB = deblock_data[left_index2].inter_pred;
-     inter_predC = deblock_data[downleft_index].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, left_index0);
+     inter_predB = get_inter_pred(deblock_data, left_index2);
+     inter_predC = get_inter_pred(deblock_data, downleft_index);
   }
  else if (U==1 && UR==0 && L==1 && DL==1){
-     inter_predA = deblock_data[up_index2].inter_pred;
-     inter_predB = deblock_data[left_index0].inter_pred;
-     inter_predC = deblock_data[downleft_index].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, up_index2);
+     inter_predB = get_inter_pred(deblock_data, left_index0);
+     inter_predC = get_inter_pred(deblock_data, downleft_index);
   }
  else if (U==1 && UR==1 && L==1 && DL==1){
-     inter_predA = deblock_data[up_index0].inter_pred;
-     inter_predB = deblock_data[upright_index].inter_pred;
-     inter_predC = deblock_data[left_index0].inter_pred;
+     inter_predA = get_inter_pred(deblock_data, up_index0);
+     inter_predB = get_inter_pred(deblock_data, upright_index);
+     inter_predC = get_inter_pred(deblock_data, left_index0);
   }
   else{
     printf("Error in mvp definition\n");
@@ -359,13 +430,13 @@ int get_mv_merge(int yposY, int xposY, int width, int height, int size, deblock_
     up_index2 = up_index0;
   }
   if (left_available)
-    tmp_merge_candidates[0] = deblock_data[left_index2].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, left_index2);
   else
     tmp_merge_candidates[0] = zero_pred;
   if (upright_available)
-    tmp_merge_candidates[1] = deblock_data[upright_index].inter_pred;
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, upright_index);
   else if (up_available)
-    tmp_merge_candidates[1] = deblock_data[up_index2].inter_pred;
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, up_index2);
   else
     tmp_merge_candidates[1] = zero_pred;
 #else
@@ -395,52 +466,52 @@ int get_mv_merge(int yposY, int xposY, int width, int height, int size, deblock_
     tmp_merge_candidates[3] = zero_pred;
   }
   else if (U == 1 && UR == 0 && L == 0 && DL == 0) {
-    tmp_merge_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[up_index1].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[up_index2].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[up_index2].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, up_index1);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, up_index2);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, up_index2);
   }
   else if (U == 1 && UR == 1 && L == 0 && DL == 0) {
-    tmp_merge_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[up_index2].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[upright_index].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[upright_index].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, up_index2);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, upright_index);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, upright_index);
   }
   else if (U == 0 && UR == 0 && L == 1 && DL == 0) {
-    tmp_merge_candidates[0] = deblock_data[left_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[left_index1].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[left_index2].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, left_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, left_index1);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, left_index2);
   }
   else if (U == 1 && UR == 0 && L == 1 && DL == 0) {
-    tmp_merge_candidates[0] = deblock_data[upleft_index].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[up_index2].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[up_index0].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, upleft_index);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, up_index2);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, up_index0);
   }
   else if (U == 1 && UR == 1 && L == 1 && DL == 0) {
-    tmp_merge_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[upright_index].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[left_index0].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, upright_index);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, left_index0);
   }
   else if (U == 0 && UR == 0 && L == 1 && DL == 1) {
-    tmp_merge_candidates[0] = deblock_data[left_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[left_index2].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[downleft_index].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[downleft_index].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, left_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, left_index2);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, downleft_index);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, downleft_index);
   }
   else if (U == 1 && UR == 0 && L == 1 && DL == 1) {
-    tmp_merge_candidates[0] = deblock_data[up_index2].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[left_index0].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[downleft_index].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[up_index0].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, up_index2);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, left_index0);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, downleft_index);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, up_index0);
   }
   else if (U == 1 && UR == 1 && L == 1 && DL == 1) {
-    tmp_merge_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_merge_candidates[1] = deblock_data[upright_index].inter_pred;
-    tmp_merge_candidates[2] = deblock_data[left_index0].inter_pred;
-    tmp_merge_candidates[3] = deblock_data[downleft_index].inter_pred;
+    tmp_merge_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_merge_candidates[1] = get_inter_pred(deblock_data, upright_index);
+    tmp_merge_candidates[2] = get_inter_pred(deblock_data, left_index0);
+    tmp_merge_candidates[3] = get_inter_pred(deblock_data, downleft_index);
   }
   else {
     printf("Error in merge vector definition\n");
@@ -512,13 +583,13 @@ int get_mv_skip(int yposY, int xposY, int width, int height, int size, deblock_d
     up_index2 = up_index0;
   }
   if (left_available)
-    tmp_skip_candidates[0] = deblock_data[left_index2].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, left_index2);
   else
     tmp_skip_candidates[0] = zero_pred;
   if (upright_available)
-     tmp_skip_candidates[1] = deblock_data[upright_index].inter_pred;
+     tmp_skip_candidates[1] = get_inter_pred(deblock_data, upright_index);
   else if (up_available)
-    tmp_skip_candidates[1] = deblock_data[up_index2].inter_pred;
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, up_index2);
   else
     tmp_skip_candidates[1] = zero_pred;
 #else
@@ -548,52 +619,52 @@ int get_mv_skip(int yposY, int xposY, int width, int height, int size, deblock_d
     tmp_skip_candidates[3] = zero_pred;
   }
   else if (U == 1 && UR == 0 && L == 0 && DL == 0) {
-    tmp_skip_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[up_index1].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[up_index2].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[up_index2].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, up_index1);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, up_index2);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, up_index2);
   }
   else if (U==1 && UR==1 && L==0 && DL==0){
-    tmp_skip_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[up_index2].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[upright_index].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[upright_index].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, up_index2);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, upright_index);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, upright_index);
   }
   else if (U==0 && UR==0 && L==1 && DL==0){
-    tmp_skip_candidates[0] = deblock_data[left_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[left_index1].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[left_index2].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, left_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, left_index1);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, left_index2);
   }
   else if (U==1 && UR==0 && L==1 && DL==0){
-    tmp_skip_candidates[0] = deblock_data[upleft_index].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[up_index2].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[up_index0].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, upleft_index);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, up_index2);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, up_index0);
   }
   else if (U==1 && UR==1 && L==1 && DL==0){
-    tmp_skip_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[upright_index].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[left_index2].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[left_index0].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, upright_index);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, left_index2);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, left_index0);
   }
   else if (U==0 && UR==0 && L==1 && DL==1){
-   tmp_skip_candidates[0] = deblock_data[left_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[left_index2].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[downleft_index].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[downleft_index].inter_pred;
+   tmp_skip_candidates[0] = get_inter_pred(deblock_data, left_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, left_index2);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, downleft_index);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, downleft_index);
   }
   else if (U==1 && UR==0 && L==1 && DL==1){
-    tmp_skip_candidates[0] = deblock_data[up_index2].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[left_index0].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[downleft_index].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[up_index0].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, up_index2);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, left_index0);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, downleft_index);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, up_index0);
   }
   else if (U==1 && UR==1 && L==1 && DL==1){
-    tmp_skip_candidates[0] = deblock_data[up_index0].inter_pred;
-    tmp_skip_candidates[1] = deblock_data[upright_index].inter_pred;
-    tmp_skip_candidates[2] = deblock_data[left_index0].inter_pred;
-    tmp_skip_candidates[3] = deblock_data[downleft_index].inter_pred;
+    tmp_skip_candidates[0] = get_inter_pred(deblock_data, up_index0);
+    tmp_skip_candidates[1] = get_inter_pred(deblock_data, upright_index);
+    tmp_skip_candidates[2] = get_inter_pred(deblock_data, left_index0);
+    tmp_skip_candidates[3] = get_inter_pred(deblock_data, downleft_index);
   }
   else{
     printf("Error in skip vector definition\n");
@@ -30,6 +30,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 void get_inter_prediction_chroma(uint8_t *pblock, uint8_t *ref, int width, int height, int stride, int pstride, mv_t *mv, int sign, int pic_width2, int pic_height2, int xpos, int ypos);
 void get_inter_prediction_luma(uint8_t *pblock, uint8_t *ref, int width, int height, int stride, int pstride, mv_t *mv, int sign, int bipred, int pic_width, int pic_height, int xpos, int ypos);
+void get_inter_prediction_chroma_clamped(uint8_t *pblock, uint8_t *plane, int stride, int x, int y, int width, int height, int pstride, mv_t *mv, int sign, int pic_width2, int pic_height2, int xpos, int ypos);
+void get_inter_prediction_luma_clamped(uint8_t *pblock, uint8_t *plane, int stride, int x, int y, int width, int height, int pstride, mv_t *mv, int sign, int bipred, int pic_width, int pic_height, int xpos, int ypos);
 //void get_inter_prediction_luma(uint8_t *pblock, uint8_t *ref, int width, int height, int stride, int pstride, mv_t *mv, int sign, int bipred);
 //void get_inter_prediction_chroma(uint8_t *pblock, uint8_t *ref, int width, int height, int stride, int pstride, mv_t *mv, int sign);
 mv_t get_mv_pred(int yposY,int xposY,int width,int height,int size,int ref_idx,deblock_data_t *deblock_data);
@@ -34,11 +34,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "global.h"
 #include "common_block.h"
+#include "simd.h"
+#include "common_kernels.h"
+#include "intra_prediction.h"
 
 
 static void filter_121(uint8_t* in, uint8_t* out, int len)
 {
   int j;
+  if (use_simd) {
+    filter_121_simd(in, out, len);
+    return;
+  }
   /* Calculate filtered 1D arrays */
   out[0] = (uint8_t)((in[0] + 2*in[0] + in[1] + 2)>>2);
   for (j=1;j<len-1;j++){
@@ -206,6 +213,11 @@ void get_planar_pred(uint8_t* left, uint8_t* top, uint8_t top_left,int size,uint
 
   top_leftF = left[1] + 2*left[0] + 2*top_left + 2*top[0]+top[1];
 
+  if (use_simd) {
+    planar_pred_simd(leftF, topF, top_leftF, size, pblock);
+    return;
+  }
+
   for (i=0;i<size;i++){
     for (j=0;j<size;j++){
       pblock[i*size+j] = clip255((leftF[i] + topF[j] - top_leftF + 4) / 8);
@@ -360,9 +372,119 @@ void get_downleftleft_pred(uint8_t *left,int size,uint8_t *pblock){
   }
 }
 
+/* Express a directional (or vertical) prediction as rows of a line buffer
+   of 4*size bytes, row i starting at line[base[i&1] + (i>>1)*step].
+   Returns 0 for modes that can't be expressed this way. */
+int get_intra_line(uint8_t* left, uint8_t* top, uint8_t top_left, int size, intra_mode_t intra_mode, uint8_t *line, int *base, int *step)
+{
+  uint8_t topF[2*MAX_TR_SIZE];
+  uint8_t leftF[2*MAX_TR_SIZE];
+  uint8_t top_leftF;
+  int k,e,d;
+  int e0 = size/2 - 1;
+  int dmax = 2*size - 2;
+
+  switch (intra_mode) {
+  case MODE_VER:
+    memcpy(line,top,size*sizeof(uint8_t));
+    base[0] = base[1] = 0;
+    *step = 0;
+    return 1;
+  case MODE_UPLEFT:
+    /* diag = j-i runs from -(size-1) to size-1 */
+    filter_121_all(left,leftF,top,topF,size,top_left,&top_leftF);
+    for (k=0;k<size-1;k++)
+      line[k] = leftF[size-2-k];
+    line[size-1] = top_leftF;
+    memcpy(&line[size],topF,(size-1)*sizeof(uint8_t));
+    base[0] = size-1;
+    base[1] = size-2;
+    *step = -2;
+    return 1;
+  case MODE_UPRIGHT:
+    filter_121(top,line,2*size);
+    base[0] = 1;
+    base[1] = 2;
+    *step = 2;
+    return 1;
+  case MODE_UPUPRIGHT:
+    /* Averages for even rows followed by the filtered top for odd rows */
+    filter_121(top,&line[2*size],2*size);
+    for (k=0;k<2*size-1;k++)
+      line[k] = (line[2*size+k] + line[2*size+k+1])>>1;
+    base[0] = 0;
+    base[1] = 2*size+1;
+    *step = 1;
+    return 1;
+  case MODE_UPUPLEFT:
+    /* Even and odd rows use separate lines, each indexed by e0-(i>>1)+j */
+    filter_121_all(left,leftF,top,topF,size,top_left,&top_leftF);
+    for (k=0;k<=e0+size-1;k++){
+      e = e0 - k;
+      if (e > 0){
+        line[k] = leftF[2*e-2];
+        line[2*size+k] = leftF[2*e-1];
+      }
+      else if (e == 0){
+        line[k] = (top_leftF + topF[0])>>1;
+        line[2*size+k] = top_leftF;
+      }
+      else{
+        line[k] = (topF[-e] + topF[-e-1])>>1;
+        line[2*size+k] = topF[-e-1];
+      }
+    }
+    base[0] = e0;
+    base[1] = 2*size+e0;
+    *step = -1;
+    return 1;
+  case MODE_UPLEFTLEFT:
+    /* diag = 2*i-j runs backwards through the line */
+    filter_121_all(left,leftF,top,topF,size,top_left,&top_leftF);
+    for (k=0;k<=dmax+size-1;k++){
+      d = dmax - k;
+      if (d < -1)
+        line[k] = topF[-d-2];
+      else if (d == -1)
+        line[k] = top_leftF;
+      else if (d == 0)
+        line[k] = (top_leftF + leftF[0])>>1;
+      else if (d&1)
+        line[k] = leftF[d/2];
+      else
+        line[k] = (leftF[d/2] + leftF[d/2 - 1])>>1;
+    }
+    base[0] = dmax;
+    base[1] = dmax-2;
+    *step = -4;
+    return 1;
+  case MODE_DOWNLEFTLEFT:
+    /* diag = 2*i+j */
+    filter_121(left,leftF,2*size);
+    for (k=0;k<3*size/2;k++){
+      line[2*k] = (leftF[k] + leftF[k+1])>>1;
+      line[2*k+1] = leftF[k+1];
+    }
+    base[0] = 0;
+    base[1] = 2;
+    *step = 4;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
 void get_intra_prediction(uint8_t* left, uint8_t* top, uint8_t top_left, int ypos,int xpos,
     int size, uint8_t *pblock,intra_mode_t intra_mode)
 {
+  uint8_t line[4*MAX_TR_SIZE];
+  int base[2],step;
+
+  if (use_simd && get_intra_line(left,top,top_left,size,intra_mode,line,base,&step)){
+    intra_rows_simd(pblock,line,base[0],base[1],step,size);
+    return;
+  }
+
   if (intra_mode == MODE_DC)
     get_dc_pred(xpos!=0 ? left:top, ypos!=0 ? top:left ,size,pblock);
   else if (intra_mode == MODE_HOR)
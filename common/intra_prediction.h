@@ -40,6 +40,7 @@ void get_upupright_pred(uint8_t *top,int size,uint8_t *pblock);
 void get_upupleft_pred(uint8_t *left,uint8_t * top, uint8_t top_left, int size,uint8_t *pblock);
 void get_upleftleft_pred(uint8_t* left, uint8_t* top, uint8_t top_left, int size,uint8_t *pblock);
 void get_downleftleft_pred(uint8_t *left,int size,uint8_t *pblock);
+int get_intra_line(uint8_t* left, uint8_t* top, uint8_t top_left, int size, intra_mode_t intra_mode, uint8_t *line, int *base, int *step);
 
 void get_intra_prediction(uint8_t* left, uint8_t* top, uint8_t top_left, int ypos,int xpos,
     int size, uint8_t *pblock,intra_mode_t intra_mode);
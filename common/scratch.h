@@ -0,0 +1,58 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if !defined(_SCRATCH_H_)
+#define _SCRATCH_H_
+
+#include "global.h"
+#include "types.h"
+
+void create_scratch_arena(scratch_arena_t *arena, size_t size);
+void close_scratch_arena(scratch_arena_t *arena);
+
+/* Bump allocation of temporary buffers. Memory is given back by releasing the arena
+   to a mark taken before the allocations, normally on every exit of the function. */
+static inline void *scratch_alloc(scratch_arena_t *arena, size_t size, uintptr_t align)
+{
+  uintptr_t p = ((uintptr_t)arena->buf + arena->used + align - 1) & ~(align - 1);
+  size_t used = p + size - (uintptr_t)arena->buf;
+  if (used > arena->size)
+    fatalerror("Scratch arena exhausted\n");
+  arena->used = used;
+  return (void *)p;
+}
+
+static inline size_t scratch_mark(const scratch_arena_t *arena)
+{
+  return arena->used;
+}
+
+static inline void scratch_release(scratch_arena_t *arena, size_t mark)
+{
+  arena->used = mark;
+}
+
+#endif
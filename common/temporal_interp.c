@@ -148,7 +148,7 @@ void free_mv_data(mv_data_t* mv_data)
   free(mv_data);
 }
 
-static void scale_frame_down2x2(yuv_frame_t* sin, yuv_frame_t* sout)
+void scale_frame_down2x2(yuv_frame_t* sin, yuv_frame_t* sout)
 {
   int wo=sout->width;
   int ho=sout->height;
@@ -3,5 +3,7 @@
 #include "types.h"
 
 void interpolate_frames(yuv_frame_t* new_frame, yuv_frame_t* ref0, yuv_frame_t* ref1, int ratio, int pos);
+void scale_frame_down2x2(yuv_frame_t* sin, yuv_frame_t* sout);
+void scale_frame_down2x2_simd(yuv_frame_t* sin, yuv_frame_t* sout);
 
 #endif
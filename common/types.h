@@ -56,8 +56,37 @@ typedef struct
     int area_y;
     int area_c;
     int frame_num;
+    void *buffer;       //Owner's handle for memory supplied by a frame allocator
 } yuv_frame_t;
 
+/* Frame memory supplied by the caller. get_buffer is given a frame with width, height and
+   padding filled in, and sets y, u, v, stride_y, stride_c and optionally buffer. Planes and
+   strides must be multiples of 16, the padding must be addressable around each plane, and
+   16 bytes past the end of each plane must be readable. Returns 0 on failure. */
+typedef struct
+{
+    void *opaque;
+    int (*get_buffer)(void *opaque, yuv_frame_t *frame);
+    void (*release_buffer)(void *opaque, yuv_frame_t *frame);
+} frame_allocator_t;
+
+/* Equally sized frames handed out with reference counts */
+typedef struct
+{
+    int num_frames;
+    yuv_frame_t *frames;
+    int *refcount;
+    const frame_allocator_t *allocator; //NULL if the pool owns the frame memory
+} frame_pool_t;
+
+/* Stack-like memory for temporary buffers, one per encoder or worker thread */
+typedef struct
+{
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+} scratch_arena_t;
+
 typedef enum {     // Order matters: log2(size)-2
     TR_4x4 = 0,
     TR_8x8 = 1,
@@ -124,14 +153,22 @@ typedef struct
   int v;
 } cbp_t;
 
+/* Block parameters per MIN_PB_SIZE unit, one plane per field */
 typedef struct
 {
-  block_mode_t mode;
-  cbp_t cbp;
-  uint8_t size;
-  uint8_t tb_split;
-  part_t pb_part;
-  inter_pred_t inter_pred;
+  int stride;            //Units per row
+  int num_units;
+  uint8_t *mode;         //block_mode_t
+  uint8_t *cbp;          //CBP_Y, CBP_U and CBP_V bits
+  uint8_t *size;
+  uint8_t *tb_split;
+  uint8_t *pb_part;      //part_t
+  int8_t *ref_idx0;
+  int8_t *ref_idx1;
+  int8_t *bipred_flag;   //-1 for intra
+  mv_t *mv0;
+  mv_t *mv1;
+  uint8_t *buf;          //Single allocation backing all planes
 } deblock_data_t;
 
 typedef enum {
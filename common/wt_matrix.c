@@ -32,33 +32,21 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 static uint16_t iwt_matrix_ref[52][3][2][64];
 static uint16_t wt_matrix_ref[52][3][2][64];
 
-void alloc_wmatrices(qmtx_t* matrix[52][3][2][TR_SIZE_RANGE])
-{
-  qmtx_t * start = (qmtx_t*) malloc(52*3*2*TR_SIZE_RANGE*MAX_QUANT_SIZE*MAX_QUANT_SIZE*sizeof(qmtx_t));
-  qmtx_t * current=start;
-  int q, c, f, t;
-  for (q=0; q<52; ++q) {
-    for (c=0; c<3; ++c) {
-      for (f=0; f<2; ++f) {
-        for (t=0; t<TR_SIZE_RANGE; ++t) {
-          matrix[q][c][f][t] = current;
-          current += MAX_QUANT_SIZE*MAX_QUANT_SIZE;
-        }
-      }
-    }
-  }
+extern int chroma_qp[52];
+extern const uint16_t gquant_table[6];
+extern const uint16_t gdequant_table[6];
 
-}
-
-void free_wmatrices(qmtx_t* matrix[52][3][2][TR_SIZE_RANGE])
-{
-    free (&matrix[0][0][0][0][0]);
-}
+/* Tables are built on first use of a (qp, component) and shared by all
+   encoder and decoder instances in the process */
+static qmtx_t wmatrix_tab[52][3][2][TR_SIZE_RANGE][MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+static qmtx_t iwmatrix_tab[52][3][2][TR_SIZE_RANGE][MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+static qmtx_t *wmatrix_ptr[52][3][2][TR_SIZE_RANGE];
+static qmtx_t *iwmatrix_ptr[52][3][2][TR_SIZE_RANGE];
+static uint8_t wmatrix_built[52][3];
 
-void make_wmatrices(qmtx_t* wmatrix[52][3][2][TR_SIZE_RANGE], qmtx_t* iwmatrix[52][3][2][TR_SIZE_RANGE])
+static void make_wmatrices(int qp, int c)
 {
-  int c,f,t,i,j;
-  int qp;
+  int f,t,i,j;
   int size,res;
   int xp,yp,xoff,yoff;
   int wt;
@@ -68,56 +56,64 @@ void make_wmatrices(qmtx_t* wmatrix[52][3][2][TR_SIZE_RANGE], qmtx_t* iwmatrix[5
   uint16_t* wm8 = NULL;
   uint16_t* iwm8 = NULL;
 
-  for (qp=0; qp<52; ++qp){
-    for (c=0; c<3; ++c) {
-      for (f=0; f<2; ++f) {
-        wm8 = wt_matrix_ref[qp][c][f];
-        iwm8 = iwt_matrix_ref[qp][c][f];
-        for (t=0; t<TR_SIZE_RANGE; ++t) {
+  /* Fold in the quantizer step of the QP the component is coded with */
+  int qps = c ? chroma_qp[qp] : qp;
+  int scale = gquant_table[qps%6];
+  int iscale = gdequant_table[qps%6];
 
-          if(wmatrix){
-            wm = wmatrix[qp][c][f][t];
-            memset(wm,0,sizeof(qmtx_t)*MAX_QUANT_SIZE*MAX_QUANT_SIZE);
-          }
-          iwm = iwmatrix[qp][c][f][t];
-          memset(iwm,0,sizeof(qmtx_t)*MAX_QUANT_SIZE*MAX_QUANT_SIZE);
-
-          size = 4<<t;
-          res = size / 8;
-          for (i=0; i<min(MAX_QUANT_SIZE, size); ++i) {
-            for (j=0; j<min(MAX_QUANT_SIZE, size); ++j) {
-              if (size == 4) {
-                iwt = (iwm8[2*i*8+2*j]+iwm8[2*i*8+2*j+1]+iwm8[(2*i+1)*8+2*j]+iwm8[(2*i+1)*8+(2*j+1)]+(1<<(8-INV_WEIGHT_SHIFT+1)))>>(8-INV_WEIGHT_SHIFT+2);
-                wt = (wm8[2*i*8+2*j]+wm8[2*i*8+2*j+1]+wm8[(2*i+1)*8+2*j]+wm8[(2*i+1)*8+(2*j+1)]+(1<<(8-WEIGHT_SHIFT+1)))>>(8-WEIGHT_SHIFT+2);
-              } else if (size==8) {
-                iwt = (iwm8[i*8+j]+(1<<(8-INV_WEIGHT_SHIFT))/2)>>(8-INV_WEIGHT_SHIFT);
-                wt = (wm8[i*8+j]+(1<<(8-INV_WEIGHT_SHIFT))/2)>>(8-INV_WEIGHT_SHIFT);
-              } else {
-                xp = j/res;
-                xoff = j%res;
-                yp = i/res;
-                yoff = i%res;
-                iwt = iwm8[yp*8+xp]*(res-xoff)*(res-yoff) +
-                      iwm8[8*min(yp+1,7)+xp]*(res-xoff)*yoff +
-                      iwm8[8*yp+min(xp+1,7)]*xoff*(res-yoff)+
-                      iwm8[8*min(yp+1,7)+min(xp+1,7)]*xoff*yoff;
-                wt = wm8[yp*8+xp]*(res-xoff)*(res-yoff) +
-                     wm8[8*min(yp+1,7)+xp]*(res-xoff)*yoff +
-                     wm8[8*yp+min(xp+1,7)]*xoff*(res-yoff)+
-                     wm8[8*min(yp+1,7)+min(xp+1,7)]*xoff*yoff;
-
-                iwt = (iwt + ((res*res/2)<<(8-INV_WEIGHT_SHIFT)))/(res*res<<(8-INV_WEIGHT_SHIFT));
-                wt = (wt + ((res*res/2)<<(8-WEIGHT_SHIFT)))/(res*res<<(8-WEIGHT_SHIFT));
-              }
-              iwm[i*MAX_QUANT_SIZE+j] = iwt;
-              if (wmatrix)
-                wm[i*MAX_QUANT_SIZE+j] = wt;
-            }
+  for (f=0; f<2; ++f) {
+    wm8 = wt_matrix_ref[qp][c][f];
+    iwm8 = iwt_matrix_ref[qp][c][f];
+    for (t=0; t<TR_SIZE_RANGE; ++t) {
+      wm = wmatrix_ptr[qp][c][f][t] = wmatrix_tab[qp][c][f][t];
+      iwm = iwmatrix_ptr[qp][c][f][t] = iwmatrix_tab[qp][c][f][t];
+      size = 4<<t;
+      res = size / 8;
+      for (i=0; i<min(MAX_QUANT_SIZE, size); ++i) {
+        for (j=0; j<min(MAX_QUANT_SIZE, size); ++j) {
+          if (size == 4) {
+            iwt = (iwm8[2*i*8+2*j]+iwm8[2*i*8+2*j+1]+iwm8[(2*i+1)*8+2*j]+iwm8[(2*i+1)*8+(2*j+1)]+(1<<(8-INV_WEIGHT_SHIFT+1)))>>(8-INV_WEIGHT_SHIFT+2);
+            wt = (wm8[2*i*8+2*j]+wm8[2*i*8+2*j+1]+wm8[(2*i+1)*8+2*j]+wm8[(2*i+1)*8+(2*j+1)]+(1<<(8-WEIGHT_SHIFT+1)))>>(8-WEIGHT_SHIFT+2);
+          } else if (size==8) {
+            iwt = (iwm8[i*8+j]+(1<<(8-INV_WEIGHT_SHIFT))/2)>>(8-INV_WEIGHT_SHIFT);
+            wt = (wm8[i*8+j]+(1<<(8-INV_WEIGHT_SHIFT))/2)>>(8-INV_WEIGHT_SHIFT);
+          } else {
+            xp = j/res;
+            xoff = j%res;
+            yp = i/res;
+            yoff = i%res;
+            iwt = iwm8[yp*8+xp]*(res-xoff)*(res-yoff) +
+                  iwm8[8*min(yp+1,7)+xp]*(res-xoff)*yoff +
+                  iwm8[8*yp+min(xp+1,7)]*xoff*(res-yoff)+
+                  iwm8[8*min(yp+1,7)+min(xp+1,7)]*xoff*yoff;
+            wt = wm8[yp*8+xp]*(res-xoff)*(res-yoff) +
+                 wm8[8*min(yp+1,7)+xp]*(res-xoff)*yoff +
+                 wm8[8*yp+min(xp+1,7)]*xoff*(res-yoff)+
+                 wm8[8*min(yp+1,7)+min(xp+1,7)]*xoff*yoff;
+            iwt = (iwt + ((res*res/2)<<(8-INV_WEIGHT_SHIFT)))/(res*res<<(8-INV_WEIGHT_SHIFT));
+            wt = (wt + ((res*res/2)<<(8-WEIGHT_SHIFT)))/(res*res<<(8-WEIGHT_SHIFT));
           }
+          iwm[i*MAX_QUANT_SIZE+j] = iwt*iscale;
+          wm[i*MAX_QUANT_SIZE+j] = wt*scale;
         }
       }
     }
   }
+  wmatrix_built[qp][c] = 1;
+}
+
+qmtx_t **get_wmatrix(int qp, int c, int f)
+{
+  if (!wmatrix_built[qp][c])
+    make_wmatrices(qp, c);
+  return wmatrix_ptr[qp][c][f];
+}
+
+qmtx_t **get_iwmatrix(int qp, int c, int f)
+{
+  if (!wmatrix_built[qp][c])
+    make_wmatrices(qp, c);
+  return iwmatrix_ptr[qp][c][f];
 }
 
 static uint16_t iwt_matrix_ref[52][3][2][64]=
@@ -30,10 +30,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "global.h"
 #include <stdint.h>
 
-void alloc_wmatrices(qmtx_t* matrix[52][3][2][TR_SIZE_RANGE]);
-void free_wmatrices(qmtx_t* matrix[52][3][2][TR_SIZE_RANGE]);
-
-void make_wmatrices(qmtx_t* wmatrix[52][3][2][TR_SIZE_RANGE], qmtx_t* iwmatrix[52][3][2][TR_SIZE_RANGE]);
+/* Forward and inverse quantizer step times weight for component c of
+   inter (f=0) or intra (f=1) blocks, indexed by log2(size/4) */
+qmtx_t **get_wmatrix(int qp, int c, int f);
+qmtx_t **get_iwmatrix(int qp, int c, int f);
 
 
 #endif
@@ -39,6 +39,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "read_bits.h"
 #include "transform.h"
 #include "common_block.h"
+#include "wt_matrix.h"
 #include "inter_prediction.h"
 #include "intra_prediction.h"
 #include "simd.h"
@@ -127,7 +128,8 @@ void copy_deblock_data(decoder_info_t *decoder_info, block_info_dec_t *block_inf
   int size = block_info->block_pos.size;
   int block_posy = block_info->block_pos.ypos/MIN_PB_SIZE;
   int block_posx = block_info->block_pos.xpos/MIN_PB_SIZE;
-  int block_stride = decoder_info->width/MIN_PB_SIZE;
+  deblock_data_t *d = decoder_info->deblock_data;
+  int block_stride = d->stride;
   int block_index;
   int m,n,m0,n0,index;
   int div = size/(2*MIN_PB_SIZE);
@@ -135,6 +137,7 @@ void copy_deblock_data(decoder_info_t *decoder_info, block_info_dec_t *block_inf
   int bheight =  block_info->block_pos.bheight;
   uint8_t tb_split = block_info->block_param.tb_split > 0;
   part_t pb_part = block_info->block_param.mode == MODE_INTER ? block_info->block_param.pb_part : PART_NONE; //TODO: Set pb_part properly for SKIP and BIPRED
+  uint8_t cbp = pack_cbp(block_info->cbp);
 
   for (m=0;m<bheight/MIN_PB_SIZE;m++){
     for (n=0;n<bwidth/MIN_PB_SIZE;n++){
@@ -143,17 +146,16 @@ void copy_deblock_data(decoder_info_t *decoder_info, block_info_dec_t *block_inf
       n0 = div > 0 ? n/div : 0;
       index = 2*m0+n0;
       if (index > 3) printf("error: index=%4d\n",index);
-      decoder_info->deblock_data[block_index].cbp = block_info->cbp;
-      decoder_info->deblock_data[block_index].tb_split = tb_split;
-      decoder_info->deblock_data[block_index].pb_part = pb_part;
-      decoder_info->deblock_data[block_index].size = block_info->block_pos.size;
-
-      decoder_info->deblock_data[block_index].mode = block_info->block_param.mode;
-      decoder_info->deblock_data[block_index].inter_pred.mv0 = block_info->block_param.mv_arr0[index];
-      decoder_info->deblock_data[block_index].inter_pred.ref_idx0 = block_info->block_param.ref_idx0;
-      decoder_info->deblock_data[block_index].inter_pred.mv1 = block_info->block_param.mv_arr1[index];
-      decoder_info->deblock_data[block_index].inter_pred.ref_idx1 = block_info->block_param.ref_idx1;
-      decoder_info->deblock_data[block_index].inter_pred.bipred_flag = block_info->block_param.dir;
+      d->cbp[block_index] = cbp;
+      d->tb_split[block_index] = tb_split;
+      d->pb_part[block_index] = pb_part;
+      d->size[block_index] = block_info->block_pos.size;
+      d->mode[block_index] = block_info->block_param.mode;
+      d->mv0[block_index] = block_info->block_param.mv_arr0[index];
+      d->ref_idx0[block_index] = block_info->block_param.ref_idx0;
+      d->mv1[block_index] = block_info->block_param.mv_arr1[index];
+      d->ref_idx1[block_index] = block_info->block_param.ref_idx1;
+      d->bipred_flag[block_index] = block_info->block_param.dir;
     }
   }
 }
@@ -195,22 +197,13 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
   uint8_t *pblock1_u = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
   uint8_t *pblock1_v = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
   yuv_frame_t *rec = decoder_info->rec;
-  yuv_frame_t *ref = decoder_info->ref[0];
-
-  /* Calculate position in padded reference frame */
-  int ref_posY = yposY*ref->stride_y+xposY;
-  int ref_posC = yposC*ref->stride_c+xposC;
+  yuv_frame_t *ref;
 
   /* Pointers to current position in reconstructed frame*/
   uint8_t *rec_y = &rec->y[yposY*rec->stride_y+xposY];
   uint8_t *rec_u = &rec->u[yposC*rec->stride_c+xposC];
   uint8_t *rec_v = &rec->v[yposC*rec->stride_c+xposC];
 
-  /* Pointers to colocated block position in reference frame */
-  uint8_t *ref_y = ref->y + ref_posY;
-  uint8_t *ref_u = ref->u + ref_posC;
-  uint8_t *ref_v = ref->v + ref_posC;
-
   stream_t *stream = decoder_info->stream;
 
   /* Read data from bitstream */
@@ -237,9 +230,9 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
     int upright_available = get_upright_available(ypos,xpos,size,width);
     int downleft_available = get_downleft_available(ypos,xpos,size,height);
     int tb_split = block_info.block_param.tb_split;
-    decode_and_reconstruct_block_intra(rec_y,rec->stride_y,sizeY,qpY,pblock_y,coeff_y,tb_split,upright_available,downleft_available,intra_mode,yposY,xposY,width,0,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][0][1] : NULL);
-    decode_and_reconstruct_block_intra(rec_u,rec->stride_c,sizeC,qpC,pblock_u,coeff_u,tb_split&&size>8,upright_available,downleft_available,intra_mode,yposC,xposC,width/2,1,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][1][1] : NULL);
-    decode_and_reconstruct_block_intra(rec_v,rec->stride_c,sizeC,qpC,pblock_v,coeff_v,tb_split&&size>8,upright_available,downleft_available,intra_mode,yposC,xposC,width/2,2,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][2][1] : NULL);
+    decode_and_reconstruct_block_intra(rec_y,rec->stride_y,sizeY,qpY,pblock_y,coeff_y,tb_split,upright_available,downleft_available,intra_mode,yposY,xposY,width,0,decoder_info->qmtx ? get_iwmatrix(qpY,0,1) : NULL);
+    decode_and_reconstruct_block_intra(rec_u,rec->stride_c,sizeC,qpC,pblock_u,coeff_u,tb_split&&size>8,upright_available,downleft_available,intra_mode,yposC,xposC,width/2,1,decoder_info->qmtx ? get_iwmatrix(qpY,1,1) : NULL);
+    decode_and_reconstruct_block_intra(rec_v,rec->stride_c,sizeC,qpC,pblock_v,coeff_v,tb_split&&size>8,upright_available,downleft_available,intra_mode,yposC,xposC,width/2,2,decoder_info->qmtx ? get_iwmatrix(qpY,2,1) : NULL);
   }
   else
   {
@@ -247,33 +240,25 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
 
     if (mode==MODE_SKIP){
       if (block_info.block_param.dir==2){
-        uint8_t *ref0_y,*ref0_u,*ref0_v;
-        uint8_t *ref1_y,*ref1_u,*ref1_v;
 
         int r0 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx0];
         yuv_frame_t *ref0 = r0>=0 ? decoder_info->ref[r0] : decoder_info->interp_frames[0];
-        ref0_y = ref0->y + ref_posY;
-        ref0_u = ref0->u + ref_posC;
-        ref0_v = ref0->v + ref_posC;
 
         int r1 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx1];
         yuv_frame_t *ref1 = r1>=0 ? decoder_info->ref[r1] : decoder_info->interp_frames[0];
-        ref1_y = ref1->y + ref_posY;
-        ref1_u = ref1->u + ref_posC;
-        ref1_v = ref1->v + ref_posC;
         int sign0 = ref0->frame_num >= rec->frame_num;
         int sign1 = ref1->frame_num >= rec->frame_num;
 
         mv = block_info.block_param.mv_arr0[0];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign0);
-        get_inter_prediction_luma  (pblock0_y, ref0_y, bwidth,   bheight,   ref->stride_y, sizeY, &mv, sign0, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock0_u, ref0_u, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock0_v, ref0_v, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock0_y, ref0->y, ref0->stride_y, xposY, yposY, bwidth, bheight, sizeY, &mv, sign0, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock0_u, ref0->u, ref0->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock0_v, ref0->v, ref0->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
         mv = block_info.block_param.mv_arr1[0];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign1);
-        get_inter_prediction_luma  (pblock1_y, ref1_y, bwidth,   bheight,   ref->stride_y, sizeY, &mv, sign1, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock1_u, ref1_u, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock1_v, ref1_v, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock1_y, ref1->y, ref1->stride_y, xposY, yposY, bwidth, bheight, sizeY, &mv, sign1, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock1_u, ref1->u, ref1->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock1_v, ref1->v, ref1->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
 
         int i,j;
         for (i=0;i<bheight;i++){
@@ -297,12 +282,9 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
         ref = r>=0 ? decoder_info->ref[r] : decoder_info->interp_frames[0];
         int sign = ref->frame_num > rec->frame_num;
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign);
-        ref_y = ref->y + ref_posY;
-        ref_u = ref->u + ref_posC;
-        ref_v = ref->v + ref_posC;
-        get_inter_prediction_luma  (pblock_y, ref_y, bwidth, bheight, ref->stride_y, sizeY, &mv, sign, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock_u, ref_u, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock_v, ref_v, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock_y, ref->y, ref->stride_y, xposY, yposY, bwidth, bheight, sizeY, &mv, sign, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock_u, ref->u, ref->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock_v, ref->v, ref->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
 
         int j;
         for (j=0;j<bheight;j++){
@@ -318,34 +300,26 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
     }
     else if (mode==MODE_MERGE){
       if (block_info.block_param.dir==2){
-        uint8_t *ref0_y,*ref0_u,*ref0_v;
-        uint8_t *ref1_y,*ref1_u,*ref1_v;
 
         int r0 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx0];
         yuv_frame_t *ref0 = r0>=0 ? decoder_info->ref[r0] : decoder_info->interp_frames[0];
-        ref0_y = ref0->y + ref_posY;
-        ref0_u = ref0->u + ref_posC;
-        ref0_v = ref0->v + ref_posC;
 
         int r1 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx1];
         yuv_frame_t *ref1 = r1>=0 ? decoder_info->ref[r1] : decoder_info->interp_frames[0];
-        ref1_y = ref1->y + ref_posY;
-        ref1_u = ref1->u + ref_posC;
-        ref1_v = ref1->v + ref_posC;
 
         int sign0 = ref0->frame_num >= rec->frame_num;
         int sign1 = ref1->frame_num >= rec->frame_num;
 
         mv = block_info.block_param.mv_arr0[0];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign0);
-        get_inter_prediction_luma  (pblock0_y, ref0_y, bwidth,   bheight,   ref->stride_y, sizeY, &mv, sign0, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock0_u, ref0_u, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock0_v, ref0_v, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock0_y, ref0->y, ref0->stride_y, xposY, yposY, bwidth, bheight, sizeY, &mv, sign0, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock0_u, ref0->u, ref0->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock0_v, ref0->v, ref0->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign0, width/2, height/2, xposC, yposC);
         mv = block_info.block_param.mv_arr1[0];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign1);
-        get_inter_prediction_luma  (pblock1_y, ref1_y, bwidth,   bheight,   ref->stride_y, sizeY, &mv, sign1, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock1_u, ref1_u, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock1_v, ref1_v, bwidth/2, bheight/2, ref->stride_c, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock1_y, ref1->y, ref1->stride_y, xposY, yposY, bwidth, bheight, sizeY, &mv, sign1, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock1_u, ref1->u, ref1->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock1_v, ref1->v, ref1->stride_c, xposC, yposC, bwidth/2, bheight/2, sizeC, &mv, sign1, width/2, height/2, xposC, yposC);
 
         int i,j;
         for (i=0;i<sizeY;i++){
@@ -367,12 +341,9 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
         ref = r>=0 ? decoder_info->ref[r] : decoder_info->interp_frames[0];
         int sign = ref->frame_num > rec->frame_num;
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign);
-        ref_y = ref->y + ref_posY;
-        ref_u = ref->u + ref_posC;
-        ref_v = ref->v + ref_posC;
-        get_inter_prediction_luma  (pblock_y, ref_y, sizeY, sizeY, ref->stride_y, sizeY, &mv, sign, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock_u, ref_u, sizeC, sizeC, ref->stride_c, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock_v, ref_v, sizeC, sizeC, ref->stride_c, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock_y, ref->y, ref->stride_y, xposY, yposY, sizeY, sizeY, sizeY, &mv, sign, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock_u, ref->u, ref->stride_c, xposC, yposC, sizeC, sizeC, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock_v, ref->v, ref->stride_c, xposC, yposC, sizeC, sizeC, sizeC, &mv, sign, width/2, height/2, xposC, yposC);
 
       }
     }
@@ -387,21 +358,16 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
       int r = decoder_info->frame_info.ref_array[ref_idx];
       ref = r>=0 ? decoder_info->ref[r] : decoder_info->interp_frames[0];
       int sign = ref->frame_num > rec->frame_num;
-      ref_y = ref->y + ref_posY;
-      ref_u = ref->u + ref_posC;
-      ref_v = ref->v + ref_posC;
       for (index=0;index<div*div;index++){
         int idx = (index>>0)&1;
         int idy = (index>>1)&1;
         int offsetpY = idy*psizeY*pstrideY + idx*psizeY;
         int offsetpC = idy*psizeC*pstrideC + idx*psizeC;
-        int offsetrY = idy*psizeY*ref->stride_y + idx*psizeY;
-        int offsetrC = idy*psizeC*ref->stride_c + idx*psizeC;
         mv = block_info.block_param.mv_arr0[index];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign);
-        get_inter_prediction_luma  (pblock_y + offsetpY, ref_y + offsetrY, psizeY, psizeY, ref->stride_y, pstrideY, &mv, sign, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock_u + offsetpC, ref_u + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock_v + offsetpC, ref_v + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock_y + offsetpY, ref->y, ref->stride_y, xposY + idx*psizeY, yposY + idy*psizeY, psizeY, psizeY, pstrideY, &mv, sign, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock_u + offsetpC, ref->u, ref->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock_v + offsetpC, ref->v, ref->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign, width/2, height/2, xposC, yposC);
       }
     }
     else if (mode == MODE_BIPRED){
@@ -410,20 +376,12 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
       int pstrideY = sizeY;
       int pstrideC = sizeC;
 
-      uint8_t *ref0_y,*ref0_u,*ref0_v;
-      uint8_t *ref1_y,*ref1_u,*ref1_v;
 
       int r0 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx0];
       yuv_frame_t *ref0 = r0>=0 ? decoder_info->ref[r0] : decoder_info->interp_frames[0];
-      ref0_y = ref0->y + ref_posY;
-      ref0_u = ref0->u + ref_posC;
-      ref0_v = ref0->v + ref_posC;
 
       int r1 = decoder_info->frame_info.ref_array[block_info.block_param.ref_idx1];
       yuv_frame_t *ref1 = r1>=0 ? decoder_info->ref[r1] : decoder_info->interp_frames[0];
-      ref1_y = ref1->y + ref_posY;
-      ref1_u = ref1->u + ref_posC;
-      ref1_v = ref1->v + ref_posC;
 
       int sign0 = ref0->frame_num >= rec->frame_num;
       int sign1 = ref1->frame_num >= rec->frame_num;
@@ -435,18 +393,16 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
         int idy = (index>>1)&1;
         int offsetpY = idy*psizeY*pstrideY + idx*psizeY;
         int offsetpC = idy*psizeC*pstrideC + idx*psizeC;
-        int offsetrY = idy*psizeY*ref->stride_y + idx*psizeY;
-        int offsetrC = idy*psizeC*ref->stride_c + idx*psizeC;
         mv = block_info.block_param.mv_arr0[index];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign0);
-        get_inter_prediction_luma  (pblock0_y + offsetpY, ref0_y + offsetrY, psizeY, psizeY, ref->stride_y, pstrideY, &mv, sign0, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock0_u + offsetpC, ref0_u + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign0, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock0_v + offsetpC, ref0_v + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock0_y + offsetpY, ref0->y, ref0->stride_y, xposY + idx*psizeY, yposY + idy*psizeY, psizeY, psizeY, pstrideY, &mv, sign0, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock0_u + offsetpC, ref0->u, ref0->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign0, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock0_v + offsetpC, ref0->v, ref0->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign0, width/2, height/2, xposC, yposC);
         mv = block_info.block_param.mv_arr1[index];
         clip_mv(&mv, yposY, xposY, width, height, sizeY, sign1);
-        get_inter_prediction_luma  (pblock1_y + offsetpY, ref1_y + offsetrY, psizeY, psizeY, ref->stride_y, pstrideY, &mv, sign1, bipred, width, height, xposY, yposY);
-        get_inter_prediction_chroma(pblock1_u + offsetpC, ref1_u + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign1, width/2, height/2, xposC, yposC);
-        get_inter_prediction_chroma(pblock1_v + offsetpC, ref1_v + offsetrC, psizeC, psizeC, ref->stride_c, pstrideC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_luma_clamped(pblock1_y + offsetpY, ref1->y, ref1->stride_y, xposY + idx*psizeY, yposY + idy*psizeY, psizeY, psizeY, pstrideY, &mv, sign1, bipred, width, height, xposY, yposY);
+        get_inter_prediction_chroma_clamped(pblock1_u + offsetpC, ref1->u, ref1->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign1, width/2, height/2, xposC, yposC);
+        get_inter_prediction_chroma_clamped(pblock1_v + offsetpC, ref1->v, ref1->stride_c, xposC + idx*psizeC, yposC + idy*psizeC, psizeC, psizeC, pstrideC, &mv, sign1, width/2, height/2, xposC, yposC);
       }
       int i,j;
       for (i=0;i<sizeY;i++){
@@ -464,9 +420,9 @@ void decode_block(decoder_info_t *decoder_info,int size,int ypos,int xpos){
 
     /* Dequantize, invere tranform and reconstruct */
 
-    decode_and_reconstruct_block_inter(rec_y,rec->stride_y,sizeY,qpY,pblock_y,coeff_y,tb_split,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][0][0] : NULL);
-    decode_and_reconstruct_block_inter(rec_u,rec->stride_c,sizeC,qpC,pblock_u,coeff_u,tb_split&&size>8,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][1][0] : NULL);
-    decode_and_reconstruct_block_inter(rec_v,rec->stride_c,sizeC,qpC,pblock_v,coeff_v,tb_split&&size>8,decoder_info->qmtx ? decoder_info->iwmatrix[qpY][2][0] : NULL);
+    decode_and_reconstruct_block_inter(rec_y,rec->stride_y,sizeY,qpY,pblock_y,coeff_y,tb_split,decoder_info->qmtx ? get_iwmatrix(qpY,0,0) : NULL);
+    decode_and_reconstruct_block_inter(rec_u,rec->stride_c,sizeC,qpC,pblock_u,coeff_u,tb_split&&size>8,decoder_info->qmtx ? get_iwmatrix(qpY,1,0) : NULL);
+    decode_and_reconstruct_block_inter(rec_v,rec->stride_c,sizeC,qpC,pblock_v,coeff_v,tb_split&&size>8,decoder_info->qmtx ? get_iwmatrix(qpY,2,0) : NULL);
   }
 
   /* Copy deblock data to frame array */
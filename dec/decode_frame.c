@@ -43,7 +43,7 @@ static int clpf_bit(int k, int l, yuv_frame_t *r, yuv_frame_t *o, const deblock_
   return getbits((stream_t*)stream, 1);
 }
 
-void decode_frame(decoder_info_t *decoder_info, yuv_frame_t* rec_buffer)
+void decode_frame(decoder_info_t *decoder_info)
 {
   int height = decoder_info->height;
   int width = decoder_info->width;
@@ -51,10 +51,9 @@ void decode_frame(decoder_info_t *decoder_info, yuv_frame_t* rec_buffer)
   int num_sb_hor = (width + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE;
   int num_sb_ver = (height + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE;
   stream_t *stream = decoder_info->stream;
-  memset(decoder_info->deblock_data, 0, ((height/MIN_PB_SIZE) * (width/MIN_PB_SIZE) * sizeof(deblock_data_t)) );
+  clear_deblock_data(decoder_info->deblock_data);
 
   int bit_start = stream->bitcnt;
-  int rec_buffer_idx;
 
   decoder_info->frame_info.frame_type = getbits(stream,1);
   decoder_info->bit_count.stat_frame_type = decoder_info->frame_info.frame_type;
@@ -78,6 +77,11 @@ void decode_frame(decoder_info_t *decoder_info, yuv_frame_t* rec_buffer)
     decoder_info->frame_info.num_ref = 0;
   }
   decoder_info->frame_info.display_frame_num = getbits(stream,16);
+  for (r=0; r<decoder_info->frame_info.num_ref; ++r){
+    int ref_idx = decoder_info->frame_info.ref_array[r];
+    if (ref_idx >= decoder_info->num_ref_frames || (ref_idx >= 0 && decoder_info->ref[ref_idx] == NULL))
+      fatalerror("Reference index outside the reference window\n");
+  }
   for (r=0; r<decoder_info->frame_info.num_ref; ++r){
     if (decoder_info->frame_info.ref_array[r]!=-1) {
       if (decoder_info->ref[decoder_info->frame_info.ref_array[r]]->frame_num > decoder_info->frame_info.display_frame_num) {
@@ -86,8 +90,8 @@ void decode_frame(decoder_info_t *decoder_info, yuv_frame_t* rec_buffer)
     }
   }
 
-  rec_buffer_idx = decoder_info->frame_info.display_frame_num%MAX_REORDER_BUFFER;
-  decoder_info->rec = &rec_buffer[rec_buffer_idx];
+  /* Reconstruct directly into a padded pool frame; the caller releases it after output */
+  decoder_info->rec = acquire_pool_frame(decoder_info->ref_pool);
   decoder_info->rec->frame_num = decoder_info->frame_info.display_frame_num;
 
   if (decoder_info->frame_info.num_ref>2 && decoder_info->frame_info.ref_array[0]==-1) {
@@ -136,19 +140,11 @@ void decode_frame(decoder_info_t *decoder_info, yuv_frame_t* rec_buffer)
                getbits(stream, 1) ? clpf_true : clpf_bit);
   }
 
-  /* Sliding window operation for reference frame buffer by circular buffer */
-
-  /* Store pointer to reference frame that is shifted out of reference buffer */
-  yuv_frame_t *tmp = decoder_info->ref[MAX_REF_FRAMES-1];
-
-  /* Update remaining pointers to implement sliding window reference buffer operation */
-  memmove(decoder_info->ref+1, decoder_info->ref, sizeof(yuv_frame_t*)*(MAX_REF_FRAMES-1));
-
-  /* Set ref[0] to the memory slot where the new current reconstructed frame wil replace reference frame being shifted out */
-  decoder_info->ref[0] = tmp;
+  /* The reconstructed frame becomes ref[0] in place; only its border needs padding */
+  pad_yuv_frame(decoder_info->rec);
 
-  /* Pad the reconstructed frame and write into ref[0] */
-  create_reference_frame(decoder_info->ref[0],decoder_info->rec);
+  /* Sliding window operation for reference frame buffer; the frame shifted out is returned to the pool */
+  shift_reference_window(decoder_info->ref_pool, decoder_info->ref, decoder_info->num_ref_frames, decoder_info->rec);
 }
 
 
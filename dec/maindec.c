@@ -36,6 +36,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "maindec.h"
 #include "decode_frame.h"
 #include "common_frame.h"
+#include "common_block.h"
 #include "getbits.h"
 #include "../common/simd.h"
 #include "wt_matrix.h"
@@ -48,11 +49,19 @@ void rferror(char error_text[])
     exit(1);
 }
 
-void parse_arg(int argc, char** argv, FILE **infile, FILE **outfile)
+typedef enum {OUTPUT_I420, OUTPUT_NV12, OUTPUT_Y4M} output_format_t;
+
+void parse_arg(int argc, char** argv, FILE **infile, FILE **outfile, output_format_t *format, int *frame_rate)
 {
+    int i;
+    int nv12 = 0;
+    int y4m = 0;
+    char *outname = NULL;
+
     if (argc < 2)
     {
-        fprintf(stdout, "usage: %s infile [outfile]\n", argv[0]);
+        fprintf(stdout, "usage: %s infile [outfile] [-nv12] [-f frame_rate]\n", argv[0]);
+        fprintf(stdout, "       outfile is written as Y4M if it ends in .y4m, and as NV12 if it ends in .nv12\n");
         rferror("Wrong number of arguments.");
     }
 
@@ -61,17 +70,92 @@ void parse_arg(int argc, char** argv, FILE **infile, FILE **outfile)
         rferror("Could not open in-file for reading.");
     }
 
-    if (argc > 2)
+    *frame_rate = 60;
+    for (i = 2; i < argc; i++)
     {
-        if (!(*outfile = fopen(argv[2], "wb")))
+        if (strcmp(argv[i], "-nv12") == 0)
         {
-            rferror("Could not open out-file for writing.");
+            nv12 = 1;
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            *frame_rate = atoi(argv[++i]);
+            if (*frame_rate <= 0)
+                rferror("Invalid frame rate.");
+        }
+        else if (outname == NULL && argv[i][0] != '-')
+        {
+            char *p = strrchr(argv[i], '.');
+            outname = argv[i];
+            y4m = p != NULL && strcmp(p, ".y4m") == 0;
+            nv12 |= p != NULL && strcmp(p, ".nv12") == 0;
+        }
+        else
+        {
+            rferror("Unknown argument.");
         }
     }
-    else
+
+    /* Y4M is always planar 4:2:0 */
+    if (y4m && nv12)
+        rferror("NV12 output cannot be written to a .y4m file.");
+    *format = y4m ? OUTPUT_Y4M : nv12 ? OUTPUT_NV12 : OUTPUT_I420;
+
+    *outfile = NULL;
+    if (outname != NULL && !(*outfile = fopen(outname, "wb")))
     {
-        *outfile = NULL;
+        rferror("Could not open out-file for writing.");
+    }
+}
+
+/* Output pictures are decoded straight into buffers laid out like a frame of the output file,
+   recycled through a free list, so that each picture is written with a single fwrite. */
+typedef struct
+{
+    int frame_size;
+    int num_free;
+    void *free_buf[MAX_REF_FRAMES+1];
+} output_buffers_t;
+
+static int get_output_buffer(void *opaque, yuv_frame_t *frame)
+{
+    output_buffers_t *out = (output_buffers_t *)opaque;
+    void *buf = out->num_free ? out->free_buf[--out->num_free] : malloc(out->frame_size + 16 + 15);
+    if (buf == NULL)
+      return 0;
+    frame->buffer = buf;
+    frame->y = (uint8_t *)(((uintptr_t)buf + 15) & ~(uintptr_t)15);
+    frame->u = frame->y + frame->width*frame->height;
+    frame->v = frame->u + frame->width*frame->height/4;
+    frame->stride_y = frame->width;
+    frame->stride_c = frame->width/2;
+    return 1;
+}
+
+static void release_output_buffer(void *opaque, yuv_frame_t *frame)
+{
+    output_buffers_t *out = (output_buffers_t *)opaque;
+    out->free_buf[out->num_free++] = frame->buffer;
+}
+
+/* Write frame in the output format. I420 pictures in output buffers are written in one go,
+   and NV12 chroma is interleaved row by row as it is written. */
+static void write_output_frame(yuv_frame_t *frame, FILE *outfile, output_format_t format)
+{
+    int ysize = frame->width*frame->height;
+    if (!outfile)
+      return;
+    if (format == OUTPUT_Y4M)
+      fprintf(outfile, "FRAME\x0a");
+    if (format == OUTPUT_NV12)
+      write_nv12_frame(frame,frame->width,frame->height,outfile);
+    else if (frame->stride_y == frame->width && frame->stride_c == frame->width/2 &&
+             frame->u == frame->y + ysize && frame->v == frame->u + ysize/4) {
+      if (fwrite(frame->y, 1, ysize*3/2, outfile) != ysize*3/2)
+        fatalerror("Error writing frame to file");
     }
+    else
+      write_yuv_frame(frame,frame->width,frame->height,outfile);
 }
 
 unsigned int leading_zeros(unsigned int code)
@@ -94,9 +178,10 @@ int main(int argc, char** argv)
     FILE *infile,*outfile;
     decoder_info_t decoder_info;
     stream_t stream;
-    yuv_frame_t rec[MAX_REORDER_BUFFER];
-    yuv_frame_t ref[MAX_REF_FRAMES];
-    int rec_available[MAX_REORDER_BUFFER]={0};
+    yuv_frame_t *rec[MAX_REORDER_BUFFER]={NULL};
+    frame_pool_t ref_pool;
+    frame_allocator_t output_allocator;
+    output_buffers_t output_buffers;
     int rec_buffer_idx;
     int op_rec_buffer_idx;
     int decode_frame_num = 0;
@@ -105,10 +190,12 @@ int main(int argc, char** argv)
     int width;
     int height;
     int r;
+    output_format_t output_format;
+    int frame_rate;
 
     init_use_simd();
 
-    parse_arg(argc, argv, &infile, &outfile);
+    parse_arg(argc, argv, &infile, &outfile, &output_format, &frame_rate);
     
 	  fseek(infile, 0, SEEK_END);
 	  int input_file_size = ftell(infile);
@@ -129,6 +216,12 @@ int main(int argc, char** argv)
     decoder_info.height = height;
     printf("width=%4d height=%4d\n",width,height);
 
+    if (outfile && output_format == OUTPUT_Y4M) {
+      fprintf(outfile,
+       "YUV4MPEG2 W%d H%d F%d:1 Ip A0:0 C420jpeg XYSCSS=420JPEG\x0a",
+       width, height, frame_rate);
+    }
+
     decoder_info.pb_split = getbits(&stream,1);
     printf("pb_split_enable=%1d\n",decoder_info.pb_split); //TODO: Rename variable to pb_split_enable
 
@@ -146,44 +239,59 @@ int main(int argc, char** argv)
     decoder_info.bipred = getbits(&stream,1);
     decoder_info.qmtx = getbits(&stream,1);
     printf("use quant matrix = %d\n", decoder_info.qmtx);
-
-    if (decoder_info.qmtx){
-      alloc_wmatrices(decoder_info.iwmatrix);
-      make_wmatrices(NULL /*only for enc*/, decoder_info.iwmatrix);
-    }
+    /* The stream does not signal how deep it references, so keep the whole window.
+       Pool frames are only allocated once they are needed. */
+    decoder_info.num_ref_frames = MAX_REF_FRAMES;
+    decoder_info.num_rec_frames = MAX_REORDER_BUFFER;
 
     decoder_info.bit_count.sequence_header += (stream.bitcnt - bit_start);
 
-    for (r=0;r<MAX_REORDER_BUFFER;r++){
-      create_yuv_frame(&rec[r],width,height,0,0,0,0);
-    }
+    /* Size the pool for the reference window plus the frame being decoded.
+       Motion compensation replicates the picture edges itself, so references are only padded
+       for temporal interpolation. Unpadded pictures with 16-aligned rows are decoded directly
+       into output buffers. */
+    int pad = decoder_info.interp_ref ? PADDING_Y : 0;
+    int direct_output = pad == 0 && width%32 == 0;
+    output_buffers.frame_size = width*height*3/2;
+    output_buffers.num_free = 0;
+    output_allocator.opaque = &output_buffers;
+    output_allocator.get_buffer = get_output_buffer;
+    output_allocator.release_buffer = release_output_buffer;
+    create_frame_pool(&ref_pool,decoder_info.num_ref_frames+1,width,height,pad,pad,pad/2,pad/2,
+                      direct_output ? &output_allocator : NULL);
+    decoder_info.ref_pool = &ref_pool;
     for (r=0;r<MAX_REF_FRAMES;r++){
-      create_yuv_frame(&ref[r],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
-      decoder_info.ref[r] = &ref[r];
+      decoder_info.ref[r] = NULL;
+    }
+    for (r=0;r<MAX_SKIP_FRAMES;r++){
+      decoder_info.interp_frames[r] = NULL;
     }
     if (decoder_info.interp_ref) {
-      for (r=0;r<MAX_SKIP_FRAMES;r++){
-        decoder_info.interp_frames[r] = malloc(sizeof(yuv_frame_t));
-        create_yuv_frame(decoder_info.interp_frames[r],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
-      }
+      /* Only one interpolated frame is used at a time */
+      decoder_info.interp_frames[0] = malloc(sizeof(yuv_frame_t));
+      create_yuv_frame(decoder_info.interp_frames[0],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
     }
 
-    decoder_info.deblock_data = (deblock_data_t *)malloc((height/MIN_PB_SIZE) * (width/MIN_PB_SIZE) * sizeof(deblock_data_t));
+    decoder_info.deblock_data = (deblock_data_t *)malloc(sizeof(deblock_data_t));
+    create_deblock_data(decoder_info.deblock_data, width, height);
 
     do
     {
       decoder_info.frame_info.decode_order_frame_num = decode_frame_num;
-      decode_frame(&decoder_info,rec);
-      rec_buffer_idx = decoder_info.frame_info.display_frame_num%MAX_REORDER_BUFFER;
-      rec_available[rec_buffer_idx]=1;
+      decode_frame(&decoder_info);
+      rec_buffer_idx = decoder_info.frame_info.display_frame_num%decoder_info.num_rec_frames;
+      if (rec[rec_buffer_idx])
+        fatalerror("Reorder buffer overflow\n");
+      rec[rec_buffer_idx] = decoder_info.rec;
 
       done = initbits_dec(infile, &stream);
 
-      op_rec_buffer_idx = (last_frame_output+1)%MAX_REORDER_BUFFER;
-      if (rec_available[op_rec_buffer_idx]) {
+      op_rec_buffer_idx = (last_frame_output+1)%decoder_info.num_rec_frames;
+      if (rec[op_rec_buffer_idx]) {
         last_frame_output++;
-        write_yuv_frame(&rec[op_rec_buffer_idx],width,height,outfile);
-        rec_available[op_rec_buffer_idx] = 0;
+        write_output_frame(rec[op_rec_buffer_idx],outfile,output_format);
+        release_pool_frame(&ref_pool,rec[op_rec_buffer_idx]);
+        rec[op_rec_buffer_idx] = NULL;
       }
       printf("decode_frame_num=%4d display_frame_num=%4d input_file_size=%12d bitcnt=%12d\n",
           decode_frame_num,decoder_info.frame_info.display_frame_num,input_file_size,stream.bitcnt);
@@ -192,12 +300,13 @@ int main(int argc, char** argv)
     while (!done);
     // Output the tail
     int i,j;
-    for (i=1; i<=MAX_REORDER_BUFFER; ++i) {
-      op_rec_buffer_idx=(last_frame_output+i) % MAX_REORDER_BUFFER;
-      if (rec_available[op_rec_buffer_idx])
-        write_yuv_frame(&rec[op_rec_buffer_idx],width,height,outfile);
-      else
+    for (i=1; i<=decoder_info.num_rec_frames; ++i) {
+      op_rec_buffer_idx=(last_frame_output+i) % decoder_info.num_rec_frames;
+      if (!rec[op_rec_buffer_idx])
         break;
+      write_output_frame(rec[op_rec_buffer_idx],outfile,output_format);
+      release_pool_frame(&ref_pool,rec[op_rec_buffer_idx]);
+      rec[op_rec_buffer_idx] = NULL;
     }
 
     bit_count_t bit_count = decoder_info.bit_count;
@@ -333,22 +442,15 @@ int main(int argc, char** argv)
     }
     printf("\n");
     printf("-----------------------------------------------------------------\n");
-    for (r=0;r<MAX_REORDER_BUFFER;r++){
-      close_yuv_frame(&rec[r]);
-    }
-    for (r=0;r<MAX_REF_FRAMES;r++){
-      close_yuv_frame(&ref[r]);
-    }
-    if (decoder_info.qmtx){
-      free_wmatrices(decoder_info.iwmatrix);
-    }
+    close_frame_pool(&ref_pool);
+    while (output_buffers.num_free)
+      free(output_buffers.free_buf[--output_buffers.num_free]);
     if (decoder_info.interp_ref) {
-      for (r=0;r<MAX_SKIP_FRAMES;r++){
-        close_yuv_frame(decoder_info.interp_frames[r]);
-        free(decoder_info.interp_frames[r]);
-      }
+      close_yuv_frame(decoder_info.interp_frames[0]);
+      free(decoder_info.interp_frames[0]);
     }
 
+    close_deblock_data(decoder_info.deblock_data);
     free(decoder_info.deblock_data);
 
     return 0;
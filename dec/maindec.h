@@ -60,8 +60,11 @@ typedef struct
 {
     frame_info_t frame_info;
     yuv_frame_t *rec;
-    yuv_frame_t *ref[MAX_REF_FRAMES];
+    yuv_frame_t *ref[MAX_REF_FRAMES];     //Sliding window, the first num_ref_frames entries are used
     yuv_frame_t *interp_frames[MAX_SKIP_FRAMES];
+    frame_pool_t *ref_pool;
+    int num_ref_frames;
+    int num_rec_frames;
     stream_t *stream;
     deblock_data_t *deblock_data;
     int width;
@@ -82,7 +85,6 @@ typedef struct
     int bipred;
     int depth;
     int qmtx;
-    qmtx_t *iwmatrix[52][3][2][TR_SIZE_RANGE];
 } decoder_info_t;
 
 #endif
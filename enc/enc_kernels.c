@@ -26,8 +26,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 /* -*- mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
 
+#include <string.h>
+
 #include "simd.h"
 #include "global.h"
+#include "types.h"
 
 int sad_calc_simd(uint8_t *a, uint8_t *b, int astride, int bstride, int width, int height)
 {
@@ -646,3 +649,419 @@ unsigned int sad_calc_fastquarter_simd(const uint8_t *po, const uint8_t *r, int
   *y = besty;
   return sad_top;
 }
+
+/* Inverse zigzag scans: raster position of each scan position */
+static const uint8_t izigzag16[16] = {
+    0,  1,  4,  8,
+    5,  2,  3,  6,
+    9, 12, 13, 10,
+    7, 11, 14, 15
+};
+
+static const uint8_t izigzag64[64] = {
+    0,  1,  8, 16,  9,  2,  3, 10,
+   17, 24, 32, 25, 18, 11,  4,  5,
+   12, 19, 26, 33, 40, 48, 41, 34,
+   27, 20, 13,  6,  7, 14, 21, 28,
+   35, 42, 49, 56, 57, 50, 43, 36,
+   29, 22, 15, 23, 30, 37, 44, 51,
+   58, 59, 52, 45, 38, 31, 39, 46,
+   53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t izigzag256[256] = {
+    0,  1, 16, 32, 17,  2,  3, 18, 33, 48, 64, 49, 34, 19,  4,  5,
+   20, 35, 50, 65, 80, 96, 81, 66, 51, 36, 21,  6,  7, 22, 37, 52,
+   67, 82, 97,112,128,113, 98, 83, 68, 53, 38, 23,  8,  9, 24, 39,
+   54, 69, 84, 99,114,129,144,160,145,130,115,100, 85, 70, 55, 40,
+   25, 10, 11, 26, 41, 56, 71, 86,101,116,131,146,161,176,192,177,
+  162,147,132,117,102, 87, 72, 57, 42, 27, 12, 13, 28, 43, 58, 73,
+   88,103,118,133,148,163,178,193,208,224,209,194,179,164,149,134,
+  119,104, 89, 74, 59, 44, 29, 14, 15, 30, 45, 60, 75, 90,105,120,
+  135,150,165,180,195,210,225,240,241,226,211,196,181,166,151,136,
+  121,106, 91, 76, 61, 46, 31, 47, 62, 77, 92,107,122,137,152,167,
+  182,197,212,227,242,243,228,213,198,183,168,153,138,123,108, 93,
+   78, 63, 79, 94,109,124,139,154,169,184,199,214,229,244,245,230,
+  215,200,185,170,155,140,125,110, 95,111,126,141,156,171,186,201,
+  216,231,246,247,232,217,202,187,172,157,142,127,143,158,173,188,
+  203,218,233,248,249,234,219,204,189,174,159,175,190,205,220,235,
+  250,251,236,221,206,191,207,222,237,252,253,238,223,239,254,255
+};
+
+extern const uint16_t gquant_table[6];
+
+/* Compute (a*scale + off) >> shift for non-negative a < 2^31.  When
+   the product may exceed 32 bits the multiplication is split in 16 bit
+   halves, which requires shift >= 16 and scale < 2^16. */
+SIMD_INLINE v128 quant_level(v128 a, v128 scale, int off, int shift, int split)
+{
+  if (!split)
+    return v128_shr_s32(v128_add_32(v128_mullo_s32(a, scale), v128_dup_32(off)), shift);
+
+  v128 hi = v128_mullo_s32(v128_shr_n_u32(a, 16), scale);
+  v128 lo = v128_mullo_s32(v128_and(a, v128_dup_32(0xffff)), scale);
+  hi = v128_add_32(hi, v128_dup_32(off >> 16));
+  lo = v128_shr_n_u32(v128_add_32(lo, v128_dup_32(off & 0xffff)), 16);
+  return v128_shr_s32(v128_add_32(hi, lo), shift - 16);
+}
+
+/* Bit-exact with quantize(), requires shift2 < 32 */
+int quantize_simd(int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block_type, qmtx_t *wmatrix, int ws)
+{
+  int intra_block = (coeff_block_type>>1) & 1;
+  int qsize = min(MAX_QUANT_SIZE, size);
+  int log2qsize = log2i(qsize);
+  int shift2 = 21 - log2i(size) + qp/6 + (wmatrix ? WEIGHT_SHIFT : 0);
+  int split = wmatrix != NULL;
+  int offsetl = (intra_block ? 38 : -26) << (shift2-8);
+  int offset0 = (intra_block ? 102 : 51) << (shift2-8);
+  int offset1 = (intra_block ? 115 : 90) << (shift2-8);
+  v128 scale = v128_dup_32(gquant_table[qp%6]);
+  int level_mode = 1;
+  int cbp = 0;
+  int i, j, pos, last_pos;
+  ALIGN(16) int32_t sgn[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  ALIGN(16) int32_t lvl[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  ALIGN(16) int32_t lvl0[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  ALIGN(16) int32_t lvl1[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  ALIGN(16) int32_t lvll[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+
+  const uint8_t *scan = izigzag64;
+  if (qsize == 4)
+    scan = izigzag16;
+  else if (qsize == 16)
+    scan = izigzag256;
+
+  /* Weight and compute all candidate levels in raster order */
+  for (i = 0; i < qsize; i++) {
+    for (j = 0; j < qsize; j += 4) {
+      int k = i*qsize + j;
+      v128 c = v128_unpack_s16_s32(v64_load_unaligned(coeff + i*size + j));
+      v128 s = v128_shr_n_s32(c, 31);
+      v128 a = v128_sub_32(v128_xor(c, s), s);
+      v128 m = scale;
+      if (wmatrix) {
+        /* The weighted step size is split instead of the coefficient */
+        m = a;
+        a = v128_load_unaligned(wmatrix + i*ws + j);
+      }
+      v128_store_aligned(sgn + k, s);
+      v128_store_aligned(lvll + k, quant_level(a, m, offsetl, shift2, split));
+      v128_store_aligned(lvl + k, quant_level(a, m, 0, shift2, split));
+      v128_store_aligned(lvl0 + k, quant_level(a, m, offset0, shift2, split));
+      v128_store_aligned(lvl1 + k, quant_level(a, m, offset1, shift2, split));
+    }
+  }
+
+  for (i = 0; i < qsize; i++)
+    memset(coeffq + i*size, 0, qsize*sizeof(int16_t));
+
+  /* Find last_pos */
+  for (last_pos = qsize*qsize-1; last_pos >= 0 && lvll[scan[last_pos]] <= 0; last_pos--);
+
+  /* Forward scan up to last_pos */
+  for (pos = 0; pos <= last_pos; pos++) {
+    int k = scan[pos];
+    int level = lvl[k] > 1 - level_mode ? lvl1[k] : lvl0[k];
+    coeffq[(k >> log2qsize)*size + (k & (qsize-1))] = sgn[k] ? -level : level;
+    cbp |= level;
+    if (level_mode) {
+      if (level == 0) level_mode = 0;
+    }
+    else {
+      if (level > 1) level_mode = 1;
+    }
+  }
+  return cbp != 0;
+}
+
+/* SAD against an intra prediction given as rows of a line buffer, see intra_rows_simd() */
+int sad_intra_rows_simd(const uint8_t *org, int ostride, const uint8_t *line, int base0, int base1, int step, int size)
+{
+  int i, j;
+
+  if (size == 4) {
+    sad64_internal s = v64_sad_u8_init();
+    for (i = 0; i < 4; i += 2) {
+      const uint8_t *l0 = line + base0 + (i >> 1)*step;
+      const uint8_t *l1 = line + base1 + (i >> 1)*step;
+      s = v64_sad_u8(s, v64_from_32(u32_load_unaligned(org + (i+1)*ostride), u32_load_unaligned(org + i*ostride)),
+                     v64_from_32(u32_load_unaligned(l1), u32_load_unaligned(l0)));
+    }
+    return v64_sad_u8_sum(s);
+  } else if (size == 8) {
+    sad64_internal s = v64_sad_u8_init();
+    for (i = 0; i < 8; i++)
+      s = v64_sad_u8(s, v64_load_unaligned(org + i*ostride), v64_load_unaligned(line + ((i & 1) ? base1 : base0) + (i >> 1)*step));
+    return v64_sad_u8_sum(s);
+  } else {
+    sad128_internal s = v128_sad_u8_init();
+    for (i = 0; i < size; i++) {
+      const uint8_t *l = line + ((i & 1) ? base1 : base0) + (i >> 1)*step;
+      for (j = 0; j < size; j += 16)
+        s = v128_sad_u8(s, v128_load_unaligned(org + i*ostride + j), v128_load_unaligned(l + j));
+    }
+    return v128_sad_u8_sum(s);
+  }
+}
+
+SIMD_INLINE void hadamard4_1d(v64 *r)
+{
+  v64 t0 = v64_add_16(r[0], r[1]);
+  v64 t1 = v64_sub_16(r[0], r[1]);
+  v64 t2 = v64_add_16(r[2], r[3]);
+  v64 t3 = v64_sub_16(r[2], r[3]);
+  r[0] = v64_add_16(t0, t2);
+  r[1] = v64_add_16(t1, t3);
+  r[2] = v64_sub_16(t0, t2);
+  r[3] = v64_sub_16(t1, t3);
+}
+
+SIMD_INLINE void hadamard8_1d(v128 *r)
+{
+  int i;
+  v128 t[8];
+  for (i = 0; i < 4; i++) {
+    t[i] = v128_add_16(r[i], r[i+4]);
+    t[i+4] = v128_sub_16(r[i], r[i+4]);
+  }
+  for (i = 0; i < 8; i += 4) {
+    r[i+0] = v128_add_16(t[i+0], t[i+2]);
+    r[i+1] = v128_add_16(t[i+1], t[i+3]);
+    r[i+2] = v128_sub_16(t[i+0], t[i+2]);
+    r[i+3] = v128_sub_16(t[i+1], t[i+3]);
+  }
+  for (i = 0; i < 8; i += 2) {
+    t[i+0] = v128_add_16(r[i], r[i+1]);
+    t[i+1] = v128_sub_16(r[i], r[i+1]);
+  }
+  for (i = 0; i < 8; i++)
+    r[i] = t[i];
+}
+
+/* Sum of absolute 4x4 Hadamard transformed differences, (sum+1)>>1 */
+static unsigned int satd4x4_simd(const uint8_t *a, const uint8_t *b, int astride, int bstride)
+{
+  v64 r[4], c[4];
+  int i;
+  for (i = 0; i < 4; i++)
+    r[i] = v64_sub_16(v64_unpacklo_u8_s16(v64_from_32(0, u32_load_unaligned(a + i*astride))),
+                      v64_unpacklo_u8_s16(v64_from_32(0, u32_load_unaligned(b + i*bstride))));
+  hadamard4_1d(r);
+
+  v64 t0 = v64_ziplo_16(r[1], r[0]);
+  v64 t1 = v64_ziphi_16(r[1], r[0]);
+  v64 t2 = v64_ziplo_16(r[3], r[2]);
+  v64 t3 = v64_ziphi_16(r[3], r[2]);
+  c[0] = v64_ziplo_32(t2, t0);
+  c[1] = v64_ziphi_32(t2, t0);
+  c[2] = v64_ziplo_32(t3, t1);
+  c[3] = v64_ziphi_32(t3, t1);
+  hadamard4_1d(c);
+
+  v64 ones = v64_dup_16(1);
+  v64 s = v64_madd_s16(v64_abs_s16(c[0]), ones);
+  for (i = 1; i < 4; i++)
+    s = v64_add_32(s, v64_madd_s16(v64_abs_s16(c[i]), ones));
+  return (v64_low_u32(s) + v64_high_u32(s) + 1) >> 1;
+}
+
+/* Sum of absolute 8x8 Hadamard transformed differences, (sum+2)>>2 */
+static unsigned int satd8x8_simd(const uint8_t *a, const uint8_t *b, int astride, int bstride)
+{
+  v128 r[8], c[8], t[8];
+  int i;
+  for (i = 0; i < 8; i++)
+    r[i] = v128_sub_16(v128_unpack_u8_s16(v64_load_unaligned(a + i*astride)),
+                       v128_unpack_u8_s16(v64_load_unaligned(b + i*bstride)));
+  hadamard8_1d(r);
+
+  for (i = 0; i < 8; i += 2) {
+    t[i+0] = v128_ziplo_16(r[i+1], r[i]);
+    t[i+1] = v128_ziphi_16(r[i+1], r[i]);
+  }
+  for (i = 0; i < 2; i++) {
+    r[4*i+0] = v128_ziplo_32(t[i+2], t[i]);
+    r[4*i+1] = v128_ziphi_32(t[i+2], t[i]);
+    r[4*i+2] = v128_ziplo_32(t[i+6], t[i+4]);
+    r[4*i+3] = v128_ziphi_32(t[i+6], t[i+4]);
+  }
+  for (i = 0; i < 8; i += 4) {
+    c[i+0] = v128_ziplo_64(r[i+2], r[i]);
+    c[i+1] = v128_ziphi_64(r[i+2], r[i]);
+    c[i+2] = v128_ziplo_64(r[i+3], r[i+1]);
+    c[i+3] = v128_ziphi_64(r[i+3], r[i+1]);
+  }
+  hadamard8_1d(c);
+
+  v128 ones = v128_dup_16(1);
+  v128 s = v128_madd_s16(v128_abs_s16(c[0]), ones);
+  for (i = 1; i < 8; i++)
+    s = v128_add_32(s, v128_madd_s16(v128_abs_s16(c[i]), ones));
+  s = v128_add_32(s, v128_shr_n_byte(s, 8));
+  s = v128_add_32(s, v128_shr_n_byte(s, 4));
+  return (v128_low_u32(s) + 2) >> 2;
+}
+
+unsigned int satd_calc_simd(const uint8_t *a, const uint8_t *b, int astride, int bstride, int width, int height)
+{
+  unsigned int satd = 0;
+  int i, j;
+  if (!(width & 7) && !(height & 7)) {
+    for (i = 0; i < height; i += 8)
+      for (j = 0; j < width; j += 8)
+        satd += satd8x8_simd(a + i*astride + j, b + i*bstride + j, astride, bstride);
+  } else {
+    for (i = 0; i < height; i += 4)
+      for (j = 0; j < width; j += 4)
+        satd += satd4x4_simd(a + i*astride + j, b + i*bstride + j, astride, bstride);
+  }
+  return satd;
+}
+
+/* SAD of one block against n reference positions, loading the original once per row */
+SIMD_INLINE void sad_calc_multi(const uint8_t *a, uint8_t *const *b, int astride, int bstride, int width, int height, unsigned int *sad, int n)
+{
+  int i, j, k;
+
+  if (width == 8) {
+    sad64_internal s[8];
+    for (k = 0; k < n; k++)
+      s[k] = v64_sad_u8_init();
+    for (i = 0; i < height; i++) {
+      v64 aa = v64_load_aligned(a + i*astride);
+      for (k = 0; k < n; k++)
+        s[k] = v64_sad_u8(s[k], aa, v64_load_unaligned(b[k] + i*bstride));
+    }
+    for (k = 0; k < n; k++)
+      sad[k] = v64_sad_u8_sum(s[k]);
+  } else {
+    sad128_internal s[8];
+    for (k = 0; k < n; k++)
+      s[k] = v128_sad_u8_init();
+    for (i = 0; i < height; i++)
+      for (j = 0; j < width; j += 16) {
+        v128 aa = v128_load_aligned(a + i*astride + j);
+        for (k = 0; k < n; k++)
+          s[k] = v128_sad_u8(s[k], aa, v128_load_unaligned(b[k] + i*bstride + j));
+      }
+    for (k = 0; k < n; k++)
+      sad[k] = v128_sad_u8_sum(s[k]);
+  }
+}
+
+void sad_calc_x4_simd(const uint8_t *a, uint8_t *const *b, int astride, int bstride, int width, int height, unsigned int *sad)
+{
+  sad_calc_multi(a, b, astride, bstride, width, height, sad, 4);
+}
+
+void sad_calc_x8_simd(const uint8_t *a, uint8_t *const *b, int astride, int bstride, int width, int height, unsigned int *sad)
+{
+  sad_calc_multi(a, b, astride, bstride, width, height, sad, 8);
+}
+
+/* Gradient histogram of an 8xN or larger block, see gradient_histogram() */
+void gradient_histogram_simd(const uint8_t *org, int stride, int size, unsigned int *hist)
+{
+  static const intra_mode_t bin_mode[8] = { MODE_HOR, MODE_VER, MODE_UPLEFTLEFT, MODE_DOWNLEFTLEFT, MODE_UPLEFT, MODE_UPRIGHT, MODE_UPUPLEFT, MODE_UPUPRIGHT };
+  v128 zero = v128_zero();
+  v128 ones = v128_dup_16(1);
+  v128 acc32[8], acc[8];
+  int i, j, k;
+
+  for (k = 0; k < 8; k++)
+    acc32[k] = zero;
+
+  for (i = 0; i < size - 1; i++) {
+    const uint8_t *a = org + i*stride;
+    const uint8_t *b = a + stride;
+    for (k = 0; k < 8; k++)
+      acc[k] = zero;
+    for (j = 0; j < size; j += 8) {
+      v64 a0 = v64_load_unaligned(a + j);
+      v64 b0 = v64_load_unaligned(b + j);
+      /* The last column has no right neighbour and is masked out below */
+      v64 a1 = j + 8 < size ? v64_load_unaligned(a + j + 1) : v64_shr_n_byte(a0, 1);
+      v64 b1 = j + 8 < size ? v64_load_unaligned(b + j + 1) : v64_shr_n_byte(b0, 1);
+      v128 x0 = v128_add_16(v128_unpack_u8_s16(a0), v128_unpack_u8_s16(b0));
+      v128 x1 = v128_add_16(v128_unpack_u8_s16(a1), v128_unpack_u8_s16(b1));
+      v128 y0 = v128_add_16(v128_unpack_u8_s16(a0), v128_unpack_u8_s16(a1));
+      v128 y1 = v128_add_16(v128_unpack_u8_s16(b0), v128_unpack_u8_s16(b1));
+      v128 gx = v128_sub_16(x1, x0);
+      v128 gy = v128_sub_16(y1, y0);
+      v128 ax = v128_abs_s16(gx);
+      v128 ay = v128_abs_s16(gy);
+      v128 w = v128_add_16(ax, ay);
+      if (j + 8 >= size)
+        w = v128_shr_n_byte(v128_shl_n_byte(w, 2), 2);
+
+      v128 opp = v128_cmplt_s16(v128_xor(gx, gy), zero);
+      v128 m1 = v128_cmpgt_s16(v128_shl_n_16(ax, 2), ay);
+      v128 ver = v128_cmpgt_s16(ax, v128_shl_n_16(ay, 2));
+      v128 m2 = v128_cmpgt_s16(v128_shl_n_16(ax, 2), v128_add_16(v128_shl_n_16(ay, 1), ay));
+      v128 m3 = v128_cmpgt_s16(v128_add_16(v128_shl_n_16(ax, 2), ax), v128_sub_16(v128_shl_n_16(ay, 3), ay));
+      v128 ll = v128_and(w, v128_andn(m1, m2));
+      v128 d45 = v128_and(w, v128_andn(m2, m3));
+      v128 steep = v128_and(w, v128_andn(m3, ver));
+
+      acc[0] = v128_add_16(acc[0], v128_andn(w, m1));
+      acc[1] = v128_add_16(acc[1], v128_and(w, ver));
+      acc[2] = v128_add_16(acc[2], v128_and(ll, opp));
+      acc[3] = v128_add_16(acc[3], v128_andn(ll, opp));
+      acc[4] = v128_add_16(acc[4], v128_and(d45, opp));
+      acc[5] = v128_add_16(acc[5], v128_andn(d45, opp));
+      acc[6] = v128_add_16(acc[6], v128_and(steep, opp));
+      acc[7] = v128_add_16(acc[7], v128_andn(steep, opp));
+    }
+    /* A row adds at most 8*1020 per lane, so widen once per row */
+    for (k = 0; k < 8; k++)
+      acc32[k] = v128_add_32(acc32[k], v128_madd_s16(acc[k], ones));
+  }
+
+  for (k = 0; k < 8; k++) {
+    v128 s = v128_add_32(acc32[k], v128_shr_n_byte(acc32[k], 8));
+    s = v128_add_32(s, v128_shr_n_byte(s, 4));
+    hist[bin_mode[k]] = v128_low_u32(s);
+  }
+}
+
+/* Split len U,V pairs into two chroma rows (NV12 input) */
+void deinterleave_uv_simd(uint8_t *u, uint8_t *v, const uint8_t *uv, int len)
+{
+  int j;
+  for (j = 0; j + 16 <= len; j += 16) {
+    v128 a = v128_load_unaligned(uv + 2*j);
+    v128 b = v128_load_unaligned(uv + 2*j + 16);
+    v128_store_unaligned(u + j, v128_unziplo_8(b, a));
+    v128_store_unaligned(v + j, v128_unziphi_8(b, a));
+  }
+  for (; j < len; j++) {
+    u[j] = uv[2*j];
+    v[j] = uv[2*j+1];
+  }
+}
+
+/* Two rows of YUY2 to two luma rows and the rounded average of their chroma */
+void yuy2_rows_simd(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *src0, const uint8_t *src1, int width)
+{
+  int j;
+  for (j = 0; j + 16 <= width; j += 16) {
+    v128 a0 = v128_load_unaligned(src0 + 2*j);
+    v128 b0 = v128_load_unaligned(src0 + 2*j + 16);
+    v128 a1 = v128_load_unaligned(src1 + 2*j);
+    v128 b1 = v128_load_unaligned(src1 + 2*j + 16);
+    v128 c = v128_avg_u8(v128_unziphi_8(b0, a0), v128_unziphi_8(b1, a1));
+    v128_store_unaligned(y0 + j, v128_unziplo_8(b0, a0));
+    v128_store_unaligned(y1 + j, v128_unziplo_8(b1, a1));
+    v64_store_unaligned(u + j/2, v128_low_v64(v128_unziplo_8(c, c)));
+    v64_store_unaligned(v + j/2, v128_low_v64(v128_unziphi_8(c, c)));
+  }
+  for (; j < width; j += 2) {
+    y0[j] = src0[2*j];
+    y0[j+1] = src0[2*j+2];
+    y1[j] = src1[2*j];
+    y1[j+1] = src1[2*j+2];
+    u[j/2] = (src0[2*j+1] + src1[2*j+1] + 1) >> 1;
+    v[j/2] = (src0[2*j+3] + src1[2*j+3] + 1) >> 1;
+  }
+}
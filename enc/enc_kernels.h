@@ -35,5 +35,13 @@ void detect_clpf_simd(const uint8_t *rec,const uint8_t *org,int x0, int y0, int
 unsigned int sad_calc_fasthalf_simd(const uint8_t *a, const uint8_t *b, int astride, int bstride, int width, int height, int *x, int *y);
 unsigned int sad_calc_fastquarter_simd(const uint8_t *o, const uint8_t *r, int os, int rs, int width, int height, int *x, int *y);
 unsigned int widesad_calc_simd(uint8_t *a, uint8_t *b, int astride, int bstride, int width, int height, int *x);
+int quantize_simd(int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block_type, qmtx_t *wmatrix, int ws);
+int sad_intra_rows_simd(const uint8_t *org, int ostride, const uint8_t *line, int base0, int base1, int step, int size);
+unsigned int satd_calc_simd(const uint8_t *a, const uint8_t *b, int astride, int bstride, int width, int height);
+void sad_calc_x4_simd(const uint8_t *a, uint8_t *const *b, int astride, int bstride, int width, int height, unsigned int *sad);
+void sad_calc_x8_simd(const uint8_t *a, uint8_t *const *b, int astride, int bstride, int width, int height, unsigned int *sad);
+void gradient_histogram_simd(const uint8_t *org, int stride, int size, unsigned int *hist);
+void deinterleave_uv_simd(uint8_t *u, uint8_t *v, const uint8_t *uv, int len);
+void yuy2_rows_simd(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *src0, const uint8_t *src1, int width);
 
 #endif
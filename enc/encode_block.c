@@ -43,9 +43,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "putvlc.h"
 #include "transform.h"
 #include "common_block.h"
+#include "wt_matrix.h"
 #include "inter_prediction.h"
 #include "intra_prediction.h"
 #include "enc_kernels.h"
+#include "encode_block.h"
+#include "scratch.h"
+#include "subpel_planes.h"
+
+#define MAX_MV_BATCH 64 /* Large enough for a telescope step or a full mvcand list */
 
 int YPOS,XPOS;
 
@@ -57,34 +63,23 @@ extern uint16_t gquant_table[6];
 extern uint16_t gdequant_table[6];
 extern double squared_lambda_QP [MAX_QP+1];
 
-static inline uint64_t mv_mask_hash(const mv_t *mv) { return (uint64_t)1 << (((mv->y << 3) ^ mv->x) & 63); }
-
-static inline void add_mvcandidate(const mv_t *mv, mv_t *list, int *list_len, uint64_t *mask)
-{
-  mv_t imv;
-  imv.x = (mv->x + 2) >> 2;
-  imv.y = (mv->y + 2) >> 2;
-  uint64_t m = mv_mask_hash(&imv);
-  if (!(m & *mask)) {
-    list[*list_len] = imv;
-    *list_len += 1;
-  }
-  *mask |= m;
-}
-
 int quantize (int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block_type, qmtx_t* wmatrix, int ws)
 {
   int intra_block = (coeff_block_type>>1) & 1;
   int tr_log2size = log2i(size);
   int qsize = min(MAX_QUANT_SIZE,size); //Only quantize 16x16 low frequency coefficients
   int64_t scale = gquant_table[qp%6];
-  int scoeff[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  int64_t sabs[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
+  int ssign[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
   int scoeffq[MAX_QUANT_SIZE*MAX_QUANT_SIZE];
   int64_t level64,abs_coeff;
   int i,j,c,sign,offset,level,cbp,pos,last_pos,level0,offset0,offset1;
   int shift2 = 21 - tr_log2size + qp/6 + (wmatrix ? WEIGHT_SHIFT : 0);
   int level_mode = 1;
 
+  if (use_simd && shift2 < 32)
+    return quantize_simd(coeff, coeffq, qp, size, coeff_block_type, wmatrix, ws);
+
   int *zigzagptr = zigzag64;
   if (qsize==4)
     zigzagptr = zigzag16;
@@ -96,12 +91,12 @@ int quantize (int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block
   /* Initialize 1D array of quantized coefficients to zero */
   memset(scoeffq,0,qsize*qsize*sizeof(int));
 
-  /* Zigzag scan of 8x8 low frequency coefficients */
+  /* Zigzag scan of 8x8 low frequency coefficients, scaled by the step size and weight */
   for(i=0;i<qsize;i++){
     for (j=0;j<qsize;j++){
-      scoeff[zigzagptr[i*qsize+j]] = coeff[i*size+j];
-      if (wmatrix!=NULL)
-        scoeff[zigzagptr[i*qsize+j]] *= wmatrix[i*ws+j];
+      c = coeff[i*size+j];
+      ssign[zigzagptr[i*qsize+j]] = c < 0 ? -1 : 1;
+      sabs[zigzagptr[i*qsize+j]] = abs(c) * (wmatrix ? wmatrix[i*ws+j] : scale);
     }
   }
 
@@ -111,8 +106,7 @@ int quantize (int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block
   level = 0;
   pos = qsize*qsize-1;
   while (level==0 && pos>=0){
-    c = scoeff[pos];
-    level64 = (abs(c))*scale + offset;
+    level64 = sabs[pos] + offset;
     level = (level64>0 ? level64 : -level64)>>shift2;
     pos--;
   }
@@ -124,9 +118,8 @@ int quantize (int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block
   offset0 = intra_block ? 102 : 51; //Scaled by 256 relative to quantization step size
   offset1 = intra_block ? 115 : 90; //Scaled by 256 relative to quantization step size
   for (pos=0;pos<=last_pos;pos++){
-    c = scoeff[pos];
-    sign = c < 0 ? -1 : 1;
-    abs_coeff = scale*abs(c);
+    sign = ssign[pos];
+    abs_coeff = sabs[pos];
     level0 = (abs_coeff + 0)>>shift2;
     offset = (level0 > (1 - level_mode)) ? offset1 : offset0;
     offset = offset<<(shift2-8);
@@ -423,6 +416,77 @@ unsigned int sad_calc(uint8_t *a, uint8_t *b, int astride, int bstride, int widt
   return sad;
 }
 
+/* SAD for n reference positions, scored four or eight at a time */
+void sad_calc_batch(uint8_t *a, uint8_t **b, int n, int astride, int bstride, int width, int height, unsigned int *sad)
+{
+  int k = 0;
+  if (use_simd && width > 4) {
+    for (; k + 8 <= n; k += 8)
+      sad_calc_x8_simd(a, b + k, astride, bstride, width, height, sad + k);
+    for (; k + 4 <= n; k += 4)
+      sad_calc_x4_simd(a, b + k, astride, bstride, width, height, sad + k);
+  }
+  for (; k < n; k++)
+    sad[k] = sad_calc(a, b[k], astride, bstride, width, height);
+}
+
+static unsigned int satd_nxn(uint8_t *a, uint8_t *b, int astride, int bstride, int n)
+{
+  int d[8][8],t[8];
+  unsigned int sum = 0;
+  int i,j,k,h;
+
+  for (i=0;i<n;i++)
+    for (j=0;j<n;j++)
+      d[i][j] = a[i*astride+j] - b[i*bstride+j];
+
+  /* Butterflies on rows, then columns */
+  for (h=1;h<n;h<<=1){
+    for (i=0;i<n;i++){
+      for (j=0;j<n;j+=2*h){
+        for (k=j;k<j+h;k++){
+          t[k] = d[i][k] + d[i][k+h];
+          t[k+h] = d[i][k] - d[i][k+h];
+        }
+      }
+      for (j=0;j<n;j++)
+        d[i][j] = t[j];
+    }
+  }
+  for (h=1;h<n;h<<=1){
+    for (j=0;j<n;j++){
+      for (i=0;i<n;i+=2*h){
+        for (k=i;k<i+h;k++){
+          t[k] = d[k][j] + d[k+h][j];
+          t[k+h] = d[k][j] - d[k+h][j];
+        }
+      }
+      for (i=0;i<n;i++)
+        d[i][j] = t[i];
+    }
+  }
+
+  for (i=0;i<n;i++)
+    for (j=0;j<n;j++)
+      sum += abs(d[i][j]);
+  return n == 8 ? (sum + 2) >> 2 : (sum + 1) >> 1;
+}
+
+/* Sum of absolute Hadamard transformed differences in 8x8 (or 4x4) units */
+unsigned int satd_calc(uint8_t *a, uint8_t *b, int astride, int bstride, int width, int height)
+{
+  unsigned int satd = 0;
+  int n = (width & 7) || (height & 7) ? 4 : 8;
+
+  if (use_simd)
+    return satd_calc_simd(a, b, astride, bstride, width, height);
+
+  for (int i = 0; i < height; i += n)
+    for (int j = 0; j < width; j += n)
+      satd += satd_nxn(a + i*astride + j, b + i*bstride + j, astride, bstride, n);
+  return satd;
+}
+
 unsigned int widesad_calc(uint8_t *a, uint8_t *b, int astride, int bstride, int width, int height, int *x)
 {
   // Calculate the SAD for five positions x.xXx.x and return the best
@@ -482,16 +546,85 @@ int quote_mv_bits(int mv_diff_y, int mv_diff_x)
   return bits;
 }
 
-int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda,enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred){
+void alloc_me_cache(encoder_info_t *encoder_info)
+{
+  me_cache_t *mc = (me_cache_t *)calloc(1, sizeof(me_cache_t));
+  if (mc == NULL)
+    fatalerror("Memory allocation failed for ME cache\n");
+  mc->entry = (me_cache_entry_t *)calloc(1 << ME_CACHE_BITS, sizeof(me_cache_entry_t));
+  if (mc->entry == NULL)
+    fatalerror("Memory allocation failed for ME cache\n");
+  encoder_info->me_cache = mc;
+}
+
+void free_me_cache(encoder_info_t *encoder_info)
+{
+  if (encoder_info->me_cache == NULL)
+    return;
+  free(encoder_info->me_cache->entry);
+  free(encoder_info->me_cache);
+  encoder_info->me_cache = NULL;
+}
+
+/* Entries from earlier frames become stale */
+void reset_me_cache(me_cache_t *mc)
+{
+  mc->gen++;
+}
+
+static me_cache_entry_t *get_me_cache_entry(me_cache_t *mc, const uint8_t *ref, int width, int height)
+{
+  uintptr_t h = (uintptr_t)ref * 0x9E3779B1u ^ (width << 8) ^ height;
+  return &mc->entry[(h ^ (h >> ME_CACHE_BITS)) & ((1 << ME_CACHE_BITS) - 1)];
+}
+
+static inline int me_cache_hit(const me_cache_t *mc, const me_cache_entry_t *e, const uint8_t *ref, int width, int height, int bipred)
+{
+  return e->gen == mc->gen && e->ref == ref && e->width == width && e->height == height && e->bipred == bipred;
+}
+
+/* Luma prediction, read straight from the sub-pel planes when they are cached */
+static uint8_t *get_luma_block(subpel_planes_t *subpel, uint8_t *rf, uint8_t *ref, int width, int height, int stride_r, mv_t *mv, int sign, int bipred, int fwidth, int fheight, int xpos, int ypos, int *pstride)
+{
+  uint8_t *p = get_subpel_block(subpel, ref, width, height, mv, sign, bipred, fwidth, fheight, xpos, ypos, pstride);
+  if (p)
+    return p;
+  get_inter_prediction_luma(rf,ref,width,height,stride_r,width,mv,sign,bipred,fwidth,fheight,xpos,ypos);
+  *pstride = width;
+  return rf;
+}
+
+int motion_estimate(scratch_arena_t *scratch, subpel_planes_t *subpel, me_cache_t *me_cache, uint8_t *orig, uint8_t *ref, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda,enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred){
   unsigned int sad;
   uint32_t min_sad;
-  uint8_t *rf = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  size_t mark = scratch_mark(scratch);
+  uint8_t *rf = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
   mv_t mv_cand;
   mv_t mv_opt;
   mv_t mv_ref;
+  mv_t mv_batch[MAX_MV_BATCH];
+  uint8_t *ref_batch[MAX_MV_BATCH];
+  unsigned int sad_batch[MAX_MV_BATCH];
   int s = sign ? -1 : 1;
+  me_cache_entry_t *ce = me_cache ? get_me_cache_entry(me_cache, ref, width, height) : NULL;
+  int cache_hit = ce && me_cache_hit(me_cache, ce, ref, width, height, enable_bipred);
 
   min_sad = MAX_UINT32;
+
+  /* Reuse an earlier search of this block, re-costing the vector for the current predictor */
+  if (cache_hit && params->me_cache > 1) {
+    *mv = ce->mv;
+    scratch_release(scratch, mark);
+    return ce->dist + (unsigned int)(lambda * (double)quote_mv_bits(mv->y - mvp->y, mv->x - mvp->x) + 0.5);
+  }
+
+  /* Or start from its integer vector */
+  if (cache_hit) {
+    mv_opt = ce->mv_int;
+    min_sad = sad_calc(orig,ref + s*(mv_opt.x >> 2) + s*(mv_opt.y >> 2)*stride_r,size,stride_r,width,height);
+    min_sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_opt.y - mvp->y, mv_opt.x - mvp->x) + 0.5);
+  }
+
   mv_ref.y = (((mvc->y) + 2) >> 2) << 2;
   mv_ref.x = (((mvc->x) + 2) >> 2) << 2;
 
@@ -501,25 +634,35 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
     int step = 32;
     while (step >= 4) {
       int range = 2*step;
+      int wide = step == 32 && size == 16 && params->encoder_speed < 2 && params->encoder_speed > 0;
+      int num = 0;
       for (int k = -range; k <= range; k += step) {
         for (int l = -range; l <= range; l += step) {
           if (step < 32 && !k && !l)
             continue; //Center position was investigated at previous step
 
-          mv_cand.y = mv_ref.y + k;
-          mv_cand.x = mv_ref.x + l;
-          clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-          if (step == 32 && size == 16 && params->encoder_speed < 2 && params->encoder_speed > 0) {
-            int x = 0;
-            sad = widesad_calc(orig,ref + s*(mv_cand.x >> 2) + s*(mv_cand.y >> 2)*stride_r,size,stride_r,width,height,&x);
-            mv_cand.x += s*x << 2;
-          } else
-            sad = sad_calc(orig,ref + s*(mv_cand.x >> 2) + s*(mv_cand.y >> 2)*stride_r,size,stride_r,width,height);
-          sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
-          if (sad < min_sad){
-            min_sad = sad;
-            mv_opt = mv_cand;
-          }
+          mv_batch[num].y = mv_ref.y + k;
+          mv_batch[num].x = mv_ref.x + l;
+          clip_mv(&mv_batch[num], ypos, xpos, fwidth, fheight, size, sign);
+          ref_batch[num] = ref + s*(mv_batch[num].x >> 2) + s*(mv_batch[num].y >> 2)*stride_r;
+          num++;
+        }
+      }
+
+      if (!wide)
+        sad_calc_batch(orig, ref_batch, num, size, stride_r, width, height, sad_batch);
+      for (int idx = 0; idx < num; idx++) {
+        mv_cand = mv_batch[idx];
+        if (wide) {
+          int x = 0;
+          sad = widesad_calc(orig,ref_batch[idx],size,stride_r,width,height,&x);
+          mv_cand.x += s*x << 2;
+        } else
+          sad = sad_batch[idx];
+        sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
+        if (sad < min_sad){
+          min_sad = sad;
+          mv_opt = mv_cand;
         }
       }
 
@@ -529,15 +672,22 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
   }
 
   /* Candidate search */
-  for (int idx = 0; idx < *mvcand_num; idx++){
+  int num_cand = *mvcand_num;
+  for (int idx = 0; idx < num_cand; idx++){
+    mv_batch[idx].y = mvcand[idx].y << 2;
+    mv_batch[idx].x = mvcand[idx].x << 2;
+    clip_mv(&mv_batch[idx], ypos, xpos, fwidth, fheight, size, sign);
+    ref_batch[idx] = ref + s*(mv_batch[idx].x >> 2) + s*(mv_batch[idx].y >> 2)*stride_r;
+  }
+  if (size != 16)
+    sad_calc_batch(orig, ref_batch, num_cand, size, stride_r, width, height, sad_batch);
+  for (int idx = 0; idx < num_cand; idx++){
     int x = 0;
-    mv_cand.y = mvcand[idx].y << 2;
-    mv_cand.x = mvcand[idx].x << 2;
-    clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
+    mv_cand = mv_batch[idx];
     if (size == 16)
-      sad = widesad_calc(orig,ref + s*(mv_cand.x >> 2) + s*(mv_cand.y >> 2)*stride_r,size,stride_r,width,height, &x);
+      sad = widesad_calc(orig,ref_batch[idx],size,stride_r,width,height, &x);
     else
-      sad = sad_calc(orig,ref + s*(mv_cand.x >> 2) + s*(mv_cand.y >> 2)*stride_r,size,stride_r,width,height);
+      sad = sad_batch[idx];
     mv_cand.x += s*x << 2;
     sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
     if (sad < min_sad){
@@ -557,23 +707,32 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
     int dir = start-1;
     int best_dir = -1;
 
+    int dirs[6];
+    int num = 0;
+
     do {
       dir++;
       dir = dir == 6 ? 0 : dir;
       static int diy[] = {  1, 2, 1, -1, -2, -1 };
       static int dix[] = { -1, 0, 1,  1,  0, -1 };
-      mv_cand.y = mv_ref.y + dix[dir]*4;
-      mv_cand.x = mv_ref.x + diy[dir]*4;
+      mv_batch[num].y = mv_ref.y + dix[dir]*4;
+      mv_batch[num].x = mv_ref.x + diy[dir]*4;
 
-      clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-      sad = sad_calc(orig,ref + s*(mv_cand.x >> 2) + s*(mv_cand.y >> 2)*stride_r,size,stride_r,width,height);
-      sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
+      clip_mv(&mv_batch[num], ypos, xpos, fwidth, fheight, size, sign);
+      ref_batch[num] = ref + s*(mv_batch[num].x >> 2) + s*(mv_batch[num].y >> 2)*stride_r;
+      dirs[num++] = dir;
+    } while (dir != end);
+
+    sad_calc_batch(orig, ref_batch, num, size, stride_r, width, height, sad_batch);
+    for (int idx = 0; idx < num; idx++) {
+      mv_cand = mv_batch[idx];
+      sad = sad_batch[idx] + (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
       if (sad < min_sad){
         min_sad = sad;
         mv_opt = mv_cand;
-        best_dir = dir;
+        best_dir = dirs[idx];
       }
-    } while (dir != end);
+    }
 
     mv_ref = mv_opt;
     start = best_dir ? best_dir - 1 : 5;
@@ -584,6 +743,7 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
   }
 
 
+  mv_t mv_int = mv_opt;
   int ydelta_hp = 0;
   int xdelta_hp = 0;
   int ydelta_qp = 0;
@@ -591,6 +751,14 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
   unsigned int cmin = min_sad;
 
   if (params->encoder_speed == 0) {
+    /* Optionally rank the sub-pel candidates by SATD */
+    unsigned int (*dist)(uint8_t *, uint8_t *, int, int, int, int) = params->hadamard_me ? satd_calc : sad_calc;
+    uint8_t *pred;
+    int pstride;
+    if (params->hadamard_me) {
+      cmin = satd_calc(orig,ref + s*(mv_ref.x >> 2) + s*(mv_ref.y >> 2)*stride_r,size,stride_r,width,height);
+      cmin += (unsigned int)(lambda * (double)quote_mv_bits(mv_ref.y - mvp->y, mv_ref.x - mvp->x) + 0.5);
+    }
 
     /* Half-pel search */
     for (int i = 1; i <= 8; i++) {
@@ -599,8 +767,8 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
 
       mv_cand.y = mv_ref.y + hmpos[i];
       mv_cand.x = mv_ref.x + hnpos[i];
-      get_inter_prediction_luma(rf,ref,width,height,stride_r,width,&mv_cand, sign,enable_bipred,fwidth,fheight,xpos,ypos);
-      sad = sad_calc(orig,rf,size,width,width,height);
+      pred = get_luma_block(subpel,rf,ref,width,height,stride_r,&mv_cand,sign,enable_bipred,fwidth,fheight,xpos,ypos,&pstride);
+      sad = dist(orig,pred,size,pstride,width,height);
       sad += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
 
       if (sad < cmin) {
@@ -620,8 +788,8 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
     for (int i = 1; i <= 8; i++) {
       mv_cand.y = mv_opt.y + qmpos[i];
       mv_cand.x = mv_opt.x + qnpos[i];
-      get_inter_prediction_luma(rf,ref,width,height,stride_r,width,&mv_cand, sign,enable_bipred,fwidth,fheight,xpos,ypos);
-      sad = sad_calc(orig,rf,size,width,width,height);
+      pred = get_luma_block(subpel,rf,ref,width,height,stride_r,&mv_cand,sign,enable_bipred,fwidth,fheight,xpos,ypos,&pstride);
+      sad = dist(orig,pred,size,pstride,width,height);
       sad += (int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
       if (sad < cmin) {
         cmin = sad;
@@ -629,6 +797,19 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
         xdelta_qp = qnpos[i];
       }
     }
+
+    /* Return a SAD based cost regardless of the search metric */
+    if (params->hadamard_me) {
+      mv_cand.y = mv_opt.y + ydelta_qp;
+      mv_cand.x = mv_opt.x + xdelta_qp;
+      if (mv_cand.x == mv_ref.x && mv_cand.y == mv_ref.y)
+        cmin = min_sad;
+      else {
+        pred = get_luma_block(subpel,rf,ref,width,height,stride_r,&mv_cand,sign,enable_bipred,fwidth,fheight,xpos,ypos,&pstride);
+        cmin = sad_calc(orig,pred,size,pstride,width,height);
+        cmin += (unsigned int)(lambda * (double)quote_mv_bits(mv_cand.y - mvp->y, mv_cand.x - mvp->x) + 0.5);
+      }
+    }
   } else { /* Faster bilinear approximation */
     mv_ref.x *= s;
     mv_ref.y *= s;
@@ -665,15 +846,30 @@ int motion_estimate(uint8_t *orig, uint8_t *ref, int size, int stride_r, int wid
   mv_opt.x += xdelta_qp;
   mv_opt.y += ydelta_qp;
 
+  if (ce) {
+    unsigned int bits = (unsigned int)(lambda * (double)quote_mv_bits(mv_opt.y - mvp->y, mv_opt.x - mvp->x) + 0.5);
+    ce->ref = ref;
+    ce->width = width;
+    ce->height = height;
+    ce->bipred = enable_bipred;
+    ce->gen = me_cache->gen;
+    ce->mv = mv_opt;
+    ce->mv_int = mv_int;
+    ce->dist = cmin > bits ? cmin - bits : 0;
+  }
+
   *mv = mv_opt;
-  thor_free(rf);
-  return min(cmin, min_sad);
+  scratch_release(scratch, mark);
+  return cmin;
 }
 
-int motion_estimate_sync(uint8_t *orig, uint8_t *ref, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda,enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred){
+int motion_estimate_sync(scratch_arena_t *scratch, subpel_planes_t *subpel, me_cache_t *me_cache, uint8_t *orig, uint8_t *ref, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda,enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred){
   int k,l,sad,range,step;
   uint32_t min_sad;
-  uint8_t *rf = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  size_t mark = scratch_mark(scratch);
+  uint8_t *rf = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *pred;
+  int pstride;
   mv_t mv_cand;
   mv_t mv_opt;
   mv_t mv_ref;
@@ -715,8 +911,8 @@ int motion_estimate_sync(uint8_t *orig, uint8_t *ref, int size, int stride_r, in
         mv_cand.x = mv_ref.x + l;
 
         clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-        get_inter_prediction_luma(rf,ref,width,height,stride_r,width,&mv_cand, sign, enable_bipred,fwidth,fheight,xpos,ypos);
-        sad = sad_calc(orig,rf,size,width,width,height);
+        pred = get_luma_block(subpel,rf,ref,width,height,stride_r,&mv_cand,sign,enable_bipred,fwidth,fheight,xpos,ypos,&pstride);
+        sad = sad_calc(orig,pred,size,pstride,width,height);
         mv_diff_y = mv_cand.y - mvp->y;
         mv_diff_x = mv_cand.x - mvp->x;
         sad += (int)(lambda * (double)quote_mv_bits(mv_diff_y,mv_diff_x) + 0.5);
@@ -738,8 +934,8 @@ int motion_estimate_sync(uint8_t *orig, uint8_t *ref, int size, int stride_r, in
     mv_cand = mvcand[idx];
 
     clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-    get_inter_prediction_luma(rf,ref,width,height,stride_r,width,&mv_cand, sign,enable_bipred,fwidth,fheight,xpos,ypos);
-    sad = sad_calc(orig,rf,size,width,width,height);
+    pred = get_luma_block(subpel,rf,ref,width,height,stride_r,&mv_cand,sign,enable_bipred,fwidth,fheight,xpos,ypos,&pstride);
+    sad = sad_calc(orig,pred,size,pstride,width,height);
     mv_diff_y = mv_cand.y - mvp->y;
     mv_diff_x = mv_cand.x - mvp->x;
     sad += (int)(lambda * (double)quote_mv_bits(mv_diff_y,mv_diff_x) + 0.5);
@@ -750,16 +946,17 @@ int motion_estimate_sync(uint8_t *orig, uint8_t *ref, int size, int stride_r, in
   }
   *mv = mv_opt;
 
-  thor_free(rf);
+  scratch_release(scratch, mark);
   return min_sad;
 }
 
-int motion_estimate_bi(uint8_t *orig, uint8_t *ref0, uint8_t *ref1, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda, enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred) {
+int motion_estimate_bi(scratch_arena_t *scratch, subpel_planes_t *subpel, uint8_t *orig, uint8_t *ref0, uint8_t *ref1, int size, int stride_r, int width, int height, mv_t *mv, mv_t *mvc, mv_t *mvp, double lambda, enc_params *params, int sign, int fwidth, int fheight, int xpos, int ypos, mv_t *mvcand, int *mvcand_num, int enable_bipred) {
   int k, l, sad, range, step;
   uint32_t min_sad;
-  uint8_t *rf = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *rf0 = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *rf1 = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  size_t mark = scratch_mark(scratch);
+  uint8_t *rf = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *rf0 = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *rf1 = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
   mv_t mv_cand;
   mv_t mv_opt;
   mv_t mv_ref;
@@ -801,10 +998,10 @@ int motion_estimate_bi(uint8_t *orig, uint8_t *ref0, uint8_t *ref1, int size, in
         mv_cand.x = mv_ref.x + l;
 
         clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-        get_inter_prediction_luma(rf0, ref0, width, height, stride_r, width, &mv_cand, sign, enable_bipred,fwidth,fheight,xpos,ypos);
+        get_inter_prediction_luma_cached(subpel, rf0, ref0, width, height, stride_r, width, &mv_cand, sign, enable_bipred,fwidth,fheight,xpos,ypos);
 
         clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, 1 - sign);
-        get_inter_prediction_luma(rf1, ref1, width, height, stride_r, width, &mv_cand, 1 - sign, enable_bipred,fwidth,fheight,xpos,ypos);
+        get_inter_prediction_luma_cached(subpel, rf1, ref1, width, height, stride_r, width, &mv_cand, 1 - sign, enable_bipred,fwidth,fheight,xpos,ypos);
 
         int i, j;
         for (i = 0; i < size; i++) {
@@ -841,10 +1038,10 @@ int motion_estimate_bi(uint8_t *orig, uint8_t *ref0, uint8_t *ref1, int size, in
     mv_cand = mvcand[idx];
 
     clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, sign);
-    get_inter_prediction_luma(rf0, ref0, width, height, stride_r, width, &mv_cand, sign, enable_bipred,fwidth,fheight,xpos,ypos);
+    get_inter_prediction_luma_cached(subpel, rf0, ref0, width, height, stride_r, width, &mv_cand, sign, enable_bipred,fwidth,fheight,xpos,ypos);
 
     clip_mv(&mv_cand, ypos, xpos, fwidth, fheight, size, 1 - sign);
-    get_inter_prediction_luma(rf1, ref1, width, height, stride_r, width, &mv_cand, 1 - sign, enable_bipred,fwidth,fheight,xpos,ypos);
+    get_inter_prediction_luma_cached(subpel, rf1, ref1, width, height, stride_r, width, &mv_cand, 1 - sign, enable_bipred,fwidth,fheight,xpos,ypos);
 
     int i, j;
     for (i = 0; i < size; i++) {
@@ -863,9 +1060,7 @@ int motion_estimate_bi(uint8_t *orig, uint8_t *ref0, uint8_t *ref1, int size, in
   }
   *mv = mv_opt;
 
-  thor_free(rf);
-  thor_free(rf0);
-  thor_free(rf1);
+  scratch_release(scratch, mark);
   return min_sad;
 }
 
@@ -882,16 +1077,73 @@ uint32_t cost_calc(yuv_block_t *org_block,yuv_block_t *rec_block,int stride,int
   return cost;
 }
 
-int search_intra_prediction_params(uint8_t *org_y,yuv_frame_t *rec,block_pos_t *block_pos,int width,int height,int num_intra_modes,intra_mode_t *intra_mode)
+#define ALL_INTRA_MODES ((1 << MAX_NUM_INTRA_MODES) - 1)
+
+/* Histogram of 2x2 gradients binned by the directional mode along the edge, weighted by |gx|+|gy| */
+static void gradient_histogram(const uint8_t *org, int stride, int size, unsigned int *hist)
+{
+  memset(hist, 0, MAX_NUM_INTRA_MODES*sizeof(unsigned int));
+  if (use_simd && size >= 8) {
+    gradient_histogram_simd(org, stride, size, hist);
+    return;
+  }
+
+  for (int i = 0; i < size - 1; i++) {
+    for (int j = 0; j < size - 1; j++) {
+      const uint8_t *p = org + i*stride + j;
+      int gx = p[1] + p[stride+1] - p[0] - p[stride];
+      int gy = p[stride] + p[stride+1] - p[0] - p[1];
+      int ax = abs(gx);
+      int ay = abs(gy);
+      int opp = (gx ^ gy) < 0;
+      intra_mode_t mode;
+      if (4*ax <= ay)
+        mode = MODE_HOR;
+      else if (ax > 4*ay)
+        mode = MODE_VER;
+      else if (4*ax <= 3*ay)
+        mode = opp ? MODE_UPLEFTLEFT : MODE_DOWNLEFTLEFT;
+      else if (5*ax <= 7*ay)
+        mode = opp ? MODE_UPLEFT : MODE_UPRIGHT;
+      else
+        mode = opp ? MODE_UPUPLEFT : MODE_UPUPRIGHT;
+      hist[mode] += ax + ay;
+    }
+  }
+}
+
+/* Return a mask of DC, PLANAR and the two dominant edge directions of the original block */
+static uint32_t gradient_intra_modes(uint8_t *org_y, int size, int num_intra_modes)
+{
+  unsigned int hist[MAX_NUM_INTRA_MODES];
+  uint32_t mask = (1 << MODE_DC) | (1 << MODE_PLANAR);
+
+  gradient_histogram(org_y, size, size, hist);
+  for (int k = 0; k < 2; k++) {
+    int best = -1;
+    for (int m = MODE_HOR; m < num_intra_modes; m++)
+      if (!(mask & (1 << m)) && hist[m] && (best < 0 || hist[m] > hist[best]))
+        best = m;
+    if (best >= 0)
+      mask |= 1 << best;
+  }
+  return mask;
+}
+
+int search_intra_prediction_params(scratch_arena_t *scratch, uint8_t *org_y,yuv_frame_t *rec,block_pos_t *block_pos,int width,int height,int num_intra_modes,intra_mode_t *intra_mode,uint32_t mode_mask)
 {
   int size = block_pos->size;
   int yposY = block_pos->ypos;
   int xposY = block_pos->xpos;
   int sad,min_sad;
-  uint8_t *pblock = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t* left = (uint8_t*)thor_alloc(2*MAX_TR_SIZE+2,16)+1;
-  uint8_t* top = (uint8_t*)thor_alloc(2*MAX_TR_SIZE+2,16)+1;
+  size_t mark = scratch_mark(scratch);
+  uint8_t *pblock = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t* left = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
+  uint8_t* top = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
   uint8_t top_left;
+  uint8_t line[4*MAX_TR_SIZE];
+  int base[2],step;
+  static const intra_mode_t dir_modes[] = { MODE_UPLEFT, MODE_UPRIGHT, MODE_UPUPRIGHT, MODE_UPUPLEFT, MODE_UPLEFTLEFT, MODE_DOWNLEFTLEFT };
 
   int upright_available = get_upright_available(yposY,xposY,size,width);
   int downleft_available = get_downleft_available(yposY,xposY,size,height);
@@ -908,18 +1160,26 @@ int search_intra_prediction_params(uint8_t *org_y,yuv_frame_t *rec,block_pos_t *
     *intra_mode = MODE_DC;
     min_sad = sad;
   }
-  get_hor_pred(left,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_HOR;
-    min_sad = sad;
+  if (mode_mask & (1 << MODE_HOR)) {
+    get_hor_pred(left,size,pblock);
+    sad = sad_calc(org_y,pblock,size,size,size,size);
+    if (sad < min_sad){
+      *intra_mode = MODE_HOR;
+      min_sad = sad;
+    }
   }
 
-  get_ver_pred(top,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_VER;
-    min_sad = sad;
+  if (mode_mask & (1 << MODE_VER)) {
+    if (use_simd && get_intra_line(left,top,top_left,size,MODE_VER,line,base,&step))
+      sad = sad_intra_rows_simd(org_y,size,line,base[0],base[1],step,size);
+    else {
+      get_ver_pred(top,size,pblock);
+      sad = sad_calc(org_y,pblock,size,size,size,size);
+    }
+    if (sad < min_sad){
+      *intra_mode = MODE_VER;
+      min_sad = sad;
+    }
   }
 
   get_planar_pred(left,top,top_left,size,pblock);
@@ -930,60 +1190,66 @@ int search_intra_prediction_params(uint8_t *org_y,yuv_frame_t *rec,block_pos_t *
   }
 
   if (num_intra_modes == 4) { //TODO: generalize
-    thor_free(left - 1);
-    thor_free(top - 1);
-    thor_free(pblock);
+    scratch_release(scratch, mark);
     return min_sad;
   }
 
-  get_upleft_pred(left,top,top_left,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_UPLEFT;
-    min_sad = sad;
+  for (int m = 0; m < sizeof(dir_modes)/sizeof(dir_modes[0]); m++) {
+    if (!(mode_mask & (1 << dir_modes[m])))
+      continue;
+    /* Score directional modes straight from the edge line when possible */
+    if (use_simd && get_intra_line(left,top,top_left,size,dir_modes[m],line,base,&step))
+      sad = sad_intra_rows_simd(org_y,size,line,base[0],base[1],step,size);
+    else {
+      get_intra_prediction(left,top,top_left,yposY,xposY,size,pblock,dir_modes[m]);
+      sad = sad_calc(org_y,pblock,size,size,size,size);
+    }
+    if (sad < min_sad){
+      *intra_mode = dir_modes[m];
+      min_sad = sad;
+    }
   }
+  scratch_release(scratch, mark);
+  return min_sad;
+}
 
-  get_upright_pred(top,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_UPRIGHT;
-    min_sad = sad;
-  }
+/* Return a mask of the num_keep intra modes with the lowest SATD */
+static uint32_t prune_intra_modes(scratch_arena_t *scratch, uint8_t *org_y,yuv_frame_t *rec,block_pos_t *block_pos,int width,int height,int num_intra_modes,int num_keep)
+{
+  int size = block_pos->size;
+  int yposY = block_pos->ypos;
+  int xposY = block_pos->xpos;
+  unsigned int cost[32];
+  uint32_t mask = 0;
+  size_t mark = scratch_mark(scratch);
+  uint8_t *pblock = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t* left = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
+  uint8_t* top = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
+  uint8_t top_left;
 
-  get_upupright_pred(top,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_UPUPRIGHT;
-    min_sad = sad;
-  }
+  int upright_available = get_upright_available(yposY,xposY,size,width);
+  int downleft_available = get_downleft_available(yposY,xposY,size,height);
+  make_top_and_left(left,top,&top_left,&rec->y[yposY*rec->stride_y+xposY],rec->stride_y,NULL,0,0,0,yposY,xposY,size,upright_available,downleft_available,0);
 
-  get_upupleft_pred(left,top,top_left,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_UPUPLEFT;
-    min_sad = sad;
+  for (int m = 0; m < num_intra_modes; m++) {
+    get_intra_prediction(left,top,top_left,yposY,xposY,size,pblock,m);
+    cost[m] = satd_calc(org_y,pblock,size,size,size,size);
   }
 
-  get_upleftleft_pred(left,top,top_left,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_UPLEFTLEFT;
-    min_sad = sad;
+  /* Pick the cheapest remaining mode num_keep times, lowest mode first on ties */
+  for (int k = 0; k < num_keep; k++) {
+    int best = -1;
+    for (int m = 0; m < num_intra_modes; m++)
+      if (!(mask & (1 << m)) && (best < 0 || cost[m] < cost[best]))
+        best = m;
+    mask |= 1 << best;
   }
 
-  get_downleftleft_pred(left,size,pblock);
-  sad = sad_calc(org_y,pblock,size,size,size,size);
-  if (sad < min_sad){
-    *intra_mode = MODE_DOWNLEFTLEFT;
-    min_sad = sad;
-  }
-  thor_free(left - 1);
-  thor_free(top - 1);
-  thor_free(pblock);
-  return min_sad;
+  scratch_release(scratch, mark);
+  return mask;
 }
 
-int search_inter_prediction_params(uint8_t *org_y,yuv_frame_t *ref,block_pos_t *block_pos,mv_t *mvc, mv_t *mvp, mv_t *mv_arr, part_t part, double lambda, enc_params *params, int sign,int fwidth,int fheight, mv_t *mvcand, int *mvcand_num, int enable_bipred)
+int search_inter_prediction_params(scratch_arena_t *scratch, subpel_planes_t *subpel, me_cache_t *me_cache, uint8_t *org_y,yuv_frame_t *ref,block_pos_t *block_pos,mv_t *mvc, mv_t *mvp, mv_t *mv_arr, part_t part, double lambda, enc_params *params, int sign,int fwidth,int fheight, mv_t *mvcand, int *mvcand_num, int enable_bipred)
 {
   int size = block_pos->size;
   int yposY = block_pos->ypos;
@@ -1001,7 +1267,7 @@ int search_inter_prediction_params(uint8_t *org_y,yuv_frame_t *ref,block_pos_t *
     height = size;
     offset_o = 0;
     offset_r = 0;
-    sad += (params->sync ? motion_estimate_sync : motion_estimate)(org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num, enable_bipred);
+    sad += (params->sync ? motion_estimate_sync : motion_estimate)(scratch, subpel, me_cache, org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num, enable_bipred);
     mv_arr[0] = mv;
     mv_arr[1] = mv;
     mv_arr[2] = mv;
@@ -1014,7 +1280,7 @@ int search_inter_prediction_params(uint8_t *org_y,yuv_frame_t *ref,block_pos_t *
       py = index>>1;
       offset_o = py*(size/2)*ostride;
       offset_r = py*(size/2)*rstride;
-      sad += motion_estimate(org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num, enable_bipred);
+      sad += motion_estimate(scratch, subpel, me_cache, org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num, enable_bipred);
       mv_arr[index] = mv;
       mv_arr[index+1] = mv;
       mvp2 = mv_arr[0]; //mv predictor from inside block
@@ -1027,7 +1293,7 @@ int search_inter_prediction_params(uint8_t *org_y,yuv_frame_t *ref,block_pos_t *
       px = index;
       offset_o = px*(size/2);
       offset_r = px*(size/2);
-      sad += motion_estimate(org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num,enable_bipred);
+      sad += motion_estimate(scratch, subpel, me_cache, org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num,enable_bipred);
       mv_arr[index] = mv;
       mv_arr[index+2] = mv;
       mvp2 = mv_arr[0]; //mv predictor from inside block
@@ -1041,7 +1307,7 @@ int search_inter_prediction_params(uint8_t *org_y,yuv_frame_t *ref,block_pos_t *
       py = (index&2)>>1;
       offset_o = py*(size/2)*ostride + px*(size/2);
       offset_r = py*(size/2)*rstride + px*(size/2);
-      sad += motion_estimate(org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num,enable_bipred);
+      sad += motion_estimate(scratch, subpel, me_cache, org_y+offset_o,ref_y+offset_r,ostride,rstride,width,height,&mv,mvc,&mvp2,lambda,params,sign,fwidth,fheight,xposY,yposY,mvcand,mvcand_num,enable_bipred);
       mv_arr[index] = mv;
       mvp2 = mv_arr[0]; //mv predictor from inside block
     }
@@ -1055,15 +1321,17 @@ int encode_and_reconstruct_block_intra (encoder_info_t *encoder_info, uint8_t *o
     qmtx_t ** wmatrix, qmtx_t ** iwmatrix)
 {
     int cbp,cbpbit;
-    int16_t *block = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *block2 = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *coeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rcoeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rblock = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rblock2 = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-
-    uint8_t* left_data = (uint8_t*)thor_alloc(2*MAX_TR_SIZE+2,16)+1;
-    uint8_t* top_data = (uint8_t*)thor_alloc(2*MAX_TR_SIZE+2,16)+1;
+    scratch_arena_t *scratch = encoder_info->scratch;
+    size_t mark = scratch_mark(scratch);
+    int16_t *block = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *block2 = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *coeff = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rcoeff = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rblock = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rblock2 = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+
+    uint8_t* left_data = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
+    uint8_t* top_data = (uint8_t*)scratch_alloc(scratch, 2*MAX_TR_SIZE+2,16)+1;
     uint8_t top_left;
 
     if (tb_split){
@@ -1111,32 +1379,76 @@ int encode_and_reconstruct_block_intra (encoder_info_t *encoder_info, uint8_t *o
       }
     }
 
-    thor_free(top_data - 1);
-    thor_free(left_data - 1);
-    thor_free(block);
-    thor_free(block2);
-    thor_free(coeff);
-    thor_free(rcoeff);
-    thor_free(rblock);
-    thor_free(rblock2);
+    scratch_release(scratch, mark);
     return cbp;
 }
 
-int encode_and_reconstruct_block_inter (encoder_info_t *encoder_info, uint8_t *orig, int orig_stride, int size, int qp, uint8_t *pblock, int16_t *coeffq, uint8_t *rec, int coeff_type, int tb_split,int rdoq, qmtx_t ** wmatrix, qmtx_t ** iwmatrix)
+/* Conservative test for a residual that quantizes to all zeros without transforming it.
+   No coefficient exceeds 90*90*SAD scaled down by the transform shifts (plus rounding),
+   and quantize() rounds a coefficient below one step with offset0, so it is zeroed
+   if it is below (256 - offset0)/256 of the step size. */
+static int zero_residual(const int16_t *block, int size, int qp, int coeff_type)
+{
+  int intra_block = (coeff_type>>1) & 1;
+  int shift2 = 21 - log2i(size) + qp/6;
+  int offset0 = intra_block ? 102 : 51; //As in quantize()
+  int64_t limit = (int64_t)(256 - offset0) << (shift2 - 8);
+  int sad = 0;
+
+  for (int i = 0; i < size*size; i++)
+    sad += abs(block[i]);
+  int64_t cmax = ((int64_t)8100*sad >> (2*log2i(size) + 5)) + 3;
+  return cmax*gquant_table[qp%6] < limit;
+}
+
+/* Squared error of a quantized block estimated from the transform coefficients.
+   The forward transform has a gain of 128/size per dimension, and coefficients
+   outside the quantized low frequency region are zeroed by quantization. */
+static uint32_t estimate_distortion(const int16_t *block, const int16_t *coeff, const int16_t *rcoeff, int size, int cbp)
+{
+  int qsize = min(size, MAX_QUANT_SIZE);
+  int64_t energy = 0, kept = 0, err = 0;
+  int i, j;
+
+  for (i = 0; i < size*size; i++)
+    energy += block[i]*block[i];
+  if (!cbp)
+    return (uint32_t)min(energy, 1 << 30);
+
+  for (i = 0; i < qsize; i++) {
+    for (j = 0; j < qsize; j++) {
+      int c = coeff[i*size + j];
+      int d = c - rcoeff[i*size + j];
+      kept += c*c;
+      err += d*d;
+    }
+  }
+  int64_t dist = energy + ((err - kept)*size*size + 8192)/16384;
+  return (uint32_t)max(0, min(dist, 1 << 30));
+}
+
+/* If dist is non-NULL the distortion is returned and the reconstruction is skipped where it can be estimated */
+int encode_and_reconstruct_block_inter (encoder_info_t *encoder_info, uint8_t *orig, int orig_stride, int size, int qp, uint8_t *pblock, int16_t *coeffq, uint8_t *rec, int coeff_type, int tb_split,int rdoq, qmtx_t ** wmatrix, qmtx_t ** iwmatrix, uint32_t *dist)
 {
     int cbp,cbpbit;
-    int16_t *block = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *block2 = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *coeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rcoeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rblock = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-    int16_t *rblock2 = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    scratch_arena_t *scratch = encoder_info->scratch;
+    size_t mark = scratch_mark(scratch);
+    int16_t *block = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *block2 = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *coeff = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rcoeff = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rblock = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+    int16_t *rblock2 = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
 
     get_residual (block, pblock, orig, size, orig_stride);
 
     if (tb_split){
       int size2 = size/2;
+      int fast = size == 64 || encoder_info->params->encoder_speed > 1;
+      /* The subsampled 32x32 and 64x64 transforms can't be used for estimation */
+      int estimate = dist && (size2 <= 16 || !fast);
       cbp = 0;
+      if (estimate) *dist = 0;
       int i,j,k,index=0;
       for (i=0;i<size;i+=size2){
         for (j=0;j<size;j+=size2){
@@ -1145,49 +1457,72 @@ int encode_and_reconstruct_block_inter (encoder_info_t *encoder_info, uint8_t *o
           for (k=0;k<size2;k++){
             memcpy(&block2[k*size2],&block[(i+k)*size+j],size2*sizeof(int16_t));
           }
-          transform (block2, coeff, size2, size == 64 || encoder_info->params->encoder_speed > 1);
-          cbpbit = quantize (coeff, coeffq+index, qp, size2, coeff_type,encoder_info->params->qmtx ? wmatrix[log2i(size2/4)] : NULL,MAX_QUANT_SIZE);
+          if (!encoder_info->params->qmtx && (size2 <= 16 || !fast) && zero_residual(block2, size2, qp, coeff_type))
+            cbpbit = 0;
+          else {
+            transform (block2, coeff, size2, fast);
+            cbpbit = quantize (coeff, coeffq+index, qp, size2, coeff_type,encoder_info->params->qmtx ? wmatrix[log2i(size2/4)] : NULL,MAX_QUANT_SIZE);
+          }
           if (cbpbit){
             dequantize (coeffq+index, rcoeff, qp, size2, encoder_info->params->qmtx ? iwmatrix[log2i(size2/4)] : NULL, MAX_QUANT_SIZE);
-            inverse_transform (rcoeff, rblock2, size2);
+            if (!estimate)
+              inverse_transform (rcoeff, rblock2, size2);
           }
-          else{
+          else if (!estimate){
             memset(rblock2,0,size2*size2*sizeof(int16_t));
           }
 
-          /* Copy from compact block of quarter size to full size */
-          for (k=0;k<size2;k++){
-            memcpy(&rblock[(i+k)*size+j],&rblock2[k*size2],size2*sizeof(int16_t));
+          if (estimate) {
+            *dist += estimate_distortion(block2, coeff, rcoeff, size2, cbpbit);
+          }
+          else {
+            /* Copy from compact block of quarter size to full size */
+            for (k=0;k<size2;k++){
+              memcpy(&rblock[(i+k)*size+j],&rblock2[k*size2],size2*sizeof(int16_t));
+            }
           }
           cbp = (cbp<<1) + cbpbit;
           index += size2 * size2;
         }
       }
-      reconstruct_block (rblock, pblock, rec, size, size);
+      if (!estimate) {
+        reconstruct_block (rblock, pblock, rec, size, size);
+        if (dist) *dist = ssd_calc(orig, rec, orig_stride, size, size, size);
+      }
     }
     else{
-      transform (block, coeff, size, (size == 64 && encoder_info->params->encoder_speed > 0) || encoder_info->params->encoder_speed > 1);
-      cbp = quantize (coeff, coeffq, qp, size, coeff_type, encoder_info->params->qmtx ? wmatrix[log2i(size/4)] : NULL, MAX_QUANT_SIZE);
+      int fast = (size == 64 && encoder_info->params->encoder_speed > 0) || encoder_info->params->encoder_speed > 1;
+      int estimate = dist && (size <= 16 || (size == 32 && !fast));
+      if (!encoder_info->params->qmtx && (size <= 16 || (size == 32 && !fast)) && zero_residual(block, size, qp, coeff_type))
+        cbp = 0;
+      else {
+        transform (block, coeff, size, fast);
+        cbp = quantize (coeff, coeffq, qp, size, coeff_type, encoder_info->params->qmtx ? wmatrix[log2i(size/4)] : NULL, MAX_QUANT_SIZE);
+      }
       if (cbp){
         dequantize (coeffq, rcoeff, qp, size, encoder_info->params->qmtx ? iwmatrix[log2i(size/4)] : NULL, MAX_QUANT_SIZE);
-        inverse_transform (rcoeff, rblock, size);
-        reconstruct_block (rblock, pblock, rec, size, size);
+        if (estimate)
+          *dist = estimate_distortion(block, coeff, rcoeff, size, cbp);
+        else {
+          inverse_transform (rcoeff, rblock, size);
+          reconstruct_block (rblock, pblock, rec, size, size);
+          if (dist) *dist = ssd_calc(orig, rec, orig_stride, size, size, size);
+        }
+      }
+      else if (dist){
+        /* The prediction is the reconstruction */
+        *dist = estimate_distortion(block, coeff, rcoeff, size, 0);
       }
       else{
         memcpy(rec,pblock,size*size*sizeof(uint8_t));
       }
     }
 
-    thor_free(block);
-    thor_free(block2);
-    thor_free(coeff);
-    thor_free(rcoeff);
-    thor_free(rblock);
-    thor_free(rblock2);
+    scratch_release(scratch, mark);
     return cbp;
 }
 
-void get_inter_prediction_yuv(yuv_frame_t *ref, uint8_t *pblock_y, uint8_t *pblock_u, uint8_t *pblock_v, block_info_t *block_info, mv_t *mv_arr, int sign, int width, int height, int enable_bipred, int split) {
+void get_inter_prediction_yuv(subpel_planes_t *subpel, yuv_frame_t *ref, uint8_t *pblock_y, uint8_t *pblock_u, uint8_t *pblock_v, block_info_t *block_info, mv_t *mv_arr, int sign, int width, int height, int enable_bipred, int split) {
   mv_t mv;
   int div = split + 1;
   int bwidth = block_info->block_pos.bwidth/div;
@@ -1216,7 +1551,7 @@ void get_inter_prediction_yuv(yuv_frame_t *ref, uint8_t *pblock_y, uint8_t *pblo
     int offsetrC = idy*bheight*rstride_c/2 + idx*bwidth/2;
     mv = mv_arr[index];
     clip_mv(&mv, yposY, xposY, width, height, size, sign);
-    get_inter_prediction_luma(pblock_y + offsetpY, ref_y + offsetrY, bwidth, bheight, rstride_y, pstride, &mv, sign, enable_bipred, width, height, xposY, yposY);
+    get_inter_prediction_luma_cached(subpel, pblock_y + offsetpY, ref_y + offsetrY, bwidth, bheight, rstride_y, pstride, &mv, sign, enable_bipred, width, height, xposY, yposY);
     get_inter_prediction_chroma(pblock_u + offsetpC, ref_u + offsetrC, bwidth/2, bheight/2, rstride_c, pstride/2, &mv, sign, width/2, height/2, xposC, yposC);
     get_inter_prediction_chroma(pblock_v + offsetpC, ref_v + offsetrC, bwidth/2, bheight/2, rstride_c, pstride/2, &mv, sign, width/2, height/2, xposC, yposC);
   }
@@ -1243,6 +1578,93 @@ void average_blocks_all(uint8_t *rec_y, uint8_t *rec_u, uint8_t *rec_v, uint8_t
   }
 }
 
+static void make_pred_key(const block_param_t *block_param, int bipred, int split, pred_key_t *key)
+{
+  int num = (split + 1)*(split + 1);
+  memset(key, 0, sizeof(pred_key_t));
+  key->bipred = bipred;
+  key->split = split;
+  key->ref_idx0 = block_param->ref_idx0;
+  key->ref_idx1 = bipred ? block_param->ref_idx1 : 0;
+  for (int i = 0; i < num; i++) {
+    key->mv0[i] = block_param->mv_arr0[i];
+    if (bipred)
+      key->mv1[i] = block_param->mv_arr1[i];
+  }
+}
+
+static void copy_pred_block(uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v, const uint8_t *src_y, const uint8_t *src_u, const uint8_t *src_v, block_pos_t *block_pos)
+{
+  int size = block_pos->size;
+  for (int i = 0; i < block_pos->bheight; i++)
+    memcpy(dst_y + i*size, src_y + i*size, block_pos->bwidth*sizeof(uint8_t));
+  for (int i = 0; i < block_pos->bheight/2; i++) {
+    memcpy(dst_u + i*size/2, src_u + i*size/2, block_pos->bwidth/2*sizeof(uint8_t));
+    memcpy(dst_v + i*size/2, src_v + i*size/2, block_pos->bwidth/2*sizeof(uint8_t));
+  }
+}
+
+/* Inter prediction of the current block, computed at most once per process_block() */
+static void get_block_prediction(encoder_info_t *encoder_info, block_info_t *block_info, block_param_t *block_param, int bipred, int split,
+                                 uint8_t *pred_y, uint8_t *pred_u, uint8_t *pred_v)
+{
+  pred_cache_t *cache = block_info->pred_cache;
+  yuv_frame_t *rec = encoder_info->rec;
+  int enable_bipred = encoder_info->params->enable_bipred;
+  pred_key_t key;
+  int i;
+
+  make_pred_key(block_param, bipred, split, &key);
+  for (i = 0; i < cache->num; i++) {
+    if (!memcmp(&cache->key[i], &key, sizeof(pred_key_t))) {
+      copy_pred_block(pred_y, pred_u, pred_v, cache->pred[i].y, cache->pred[i].u, cache->pred[i].v, &block_info->block_pos);
+      return;
+    }
+  }
+
+  int r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
+  yuv_frame_t *ref0 = r0 >= 0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
+  int sign0 = ref0->frame_num > rec->frame_num;
+  if (bipred) {
+    scratch_arena_t *scratch = encoder_info->scratch;
+    size_t mark = scratch_mark(scratch);
+    uint8_t *pblock0_y = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    uint8_t *pblock0_u = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    uint8_t *pblock0_v = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    uint8_t *pblock1_y = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    uint8_t *pblock1_u = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    uint8_t *pblock1_v = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+    int r1 = encoder_info->frame_info.ref_array[block_param->ref_idx1];
+    yuv_frame_t *ref1 = r1 >= 0 ? encoder_info->ref[r1] : encoder_info->interp_frames[0];
+    int sign1 = ref1->frame_num > rec->frame_num;
+    get_inter_prediction_yuv(encoder_info->subpel_planes, ref0, pblock0_y, pblock0_u, pblock0_v, block_info, block_param->mv_arr0, sign0, encoder_info->width, encoder_info->height, enable_bipred, split);
+    get_inter_prediction_yuv(encoder_info->subpel_planes, ref1, pblock1_y, pblock1_u, pblock1_v, block_info, block_param->mv_arr1, sign1, encoder_info->width, encoder_info->height, enable_bipred, split);
+    average_blocks_all(pred_y, pred_u, pred_v, pblock0_y, pblock0_u, pblock0_v, pblock1_y, pblock1_u, pblock1_v, block_info);
+    scratch_release(scratch, mark);
+  }
+  else
+    get_inter_prediction_yuv(encoder_info->subpel_planes, ref0, pred_y, pred_u, pred_v, block_info, block_param->mv_arr0, sign0, encoder_info->width, encoder_info->height, enable_bipred, split);
+
+  i = cache->next;
+  cache->next = (i + 1) % PRED_CACHE_SIZE;
+  cache->num = min(cache->num + 1, PRED_CACHE_SIZE);
+  cache->key[i] = key;
+  copy_pred_block(cache->pred[i].y, cache->pred[i].u, cache->pred[i].v, pred_y, pred_u, pred_v, &block_info->block_pos);
+}
+
+/* Whether a skip or merge candidate predicts the same as an earlier one */
+static int duplicate_candidate(const inter_pred_t *cand, int idx)
+{
+  for (int i = 0; i < idx; i++) {
+    int bipred = cand[idx].bipred_flag == 2;
+    if (cand[i].bipred_flag == cand[idx].bipred_flag && cand[i].ref_idx0 == cand[idx].ref_idx0 &&
+        cand[i].mv0.x == cand[idx].mv0.x && cand[i].mv0.y == cand[idx].mv0.y &&
+        (!bipred || (cand[i].ref_idx1 == cand[idx].ref_idx1 && cand[i].mv1.x == cand[idx].mv1.x && cand[i].mv1.y == cand[idx].mv1.y)))
+      return 1;
+  }
+  return 0;
+}
+
 int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *block_info,block_param_t *block_param)
 {
   int width = encoder_info->width;
@@ -1261,12 +1683,13 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
   intra_mode_t intra_mode;
 
   frame_type_t frame_type = encoder_info->frame_info.frame_type;
-  int enable_bipred = encoder_info->params->enable_bipred;
   int qpY = block_info->qp;
   int qpC = chroma_qp[qpY];
+  int qmtx = encoder_info->params->qmtx;
 
   /* Intermediate block variables */
   int re_use = (block_info->final_encode & 1) && !(encoder_info->params->enable_tb_split);
+  block_info->tdomain_dist = MAX_UINT32;
 
   if (re_use) {
     memcpy(block_info->rec_block->y, block_info->rec_block_best->y, size*size*sizeof(uint8_t));
@@ -1276,27 +1699,13 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
     return nbits;
   }
 
-  uint8_t *pblock_y = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock_u = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock_v = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  uint8_t *pblock_y = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *pblock_u = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *pblock_v = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
 
-  int ref_idx = (frame_type==I_FRAME) ? 0 : block_param->ref_idx0;
-  int r = encoder_info->frame_info.ref_array[ref_idx];
   yuv_frame_t *rec = encoder_info->rec;
-  yuv_frame_t *ref;
-
-  ref = NULL;
-
-  /* Variables for bipred */
-  uint8_t *pblock0_y = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock0_u = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock0_v = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock1_y = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock1_u = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock1_v = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  int r0,r1;
-  yuv_frame_t *ref0;
-  yuv_frame_t *ref1;
 
   /* Pointers to block of original pixels */
   uint8_t *org_y = block_info->org_block->y;
@@ -1313,12 +1722,9 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
   block_param->tb_split = tb_split;
   block_param->mode = mode;
 
-  if (mode!=MODE_INTRA) {
-    ref = r>=0 ? encoder_info->ref[r] : encoder_info->interp_frames[0];
-  }
-  int16_t *coeffq_y = thor_alloc(2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
-  int16_t *coeffq_u = thor_alloc(2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
-  int16_t *coeffq_v = thor_alloc(2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  int16_t *coeffq_y = scratch_alloc(scratch, 2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  int16_t *coeffq_u = scratch_alloc(scratch, 2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  int16_t *coeffq_v = scratch_alloc(scratch, 2 * MAX_TR_SIZE*MAX_TR_SIZE, 16);
 
   if (mode==MODE_INTRA){
     intra_mode = block_param->intra_mode;
@@ -1330,11 +1736,11 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
 
     /* Predict, create residual, transform, quantize, and reconstruct.*/
     cbp.y = encode_and_reconstruct_block_intra (encoder_info, org_y,sizeY,yrec,rec->stride_y,yposY,xposY,sizeY,qpY,pblock_y,coeffq_y,rec_y,((frame_type==I_FRAME)<<1)|0,
-        tb_split,encoder_info->params->rdoq,width,intra_mode,upright_available,downleft_available,encoder_info->wmatrix[qpY][0][1],encoder_info->iwmatrix[qpY][0][1]);
+        tb_split,encoder_info->params->rdoq,width,intra_mode,upright_available,downleft_available,qmtx ? get_wmatrix(qpY,0,1) : NULL,qmtx ? get_iwmatrix(qpY,0,1) : NULL);
     cbp.u = encode_and_reconstruct_block_intra (encoder_info, org_u,sizeC,urec,rec->stride_c,yposC,xposC,sizeC,qpC,pblock_u,coeffq_u,rec_u,((frame_type==I_FRAME)<<1)|1,
-        tb_split&&(size>8),encoder_info->params->rdoq,width/2,intra_mode,upright_available,downleft_available,encoder_info->wmatrix[qpY][1][1],encoder_info->iwmatrix[qpY][1][1]);
+        tb_split&&(size>8),encoder_info->params->rdoq,width/2,intra_mode,upright_available,downleft_available,qmtx ? get_wmatrix(qpY,1,1) : NULL,qmtx ? get_iwmatrix(qpY,1,1) : NULL);
     cbp.v = encode_and_reconstruct_block_intra (encoder_info, org_v,sizeC,vrec,rec->stride_c,yposC,xposC,sizeC,qpC,pblock_v,coeffq_v,rec_v,((frame_type==I_FRAME)<<1)|1,
-        tb_split&&(size>8),encoder_info->params->rdoq,width/2,intra_mode,upright_available,downleft_available,encoder_info->wmatrix[qpY][2][1],encoder_info->iwmatrix[qpY][2][1]);
+        tb_split&&(size>8),encoder_info->params->rdoq,width/2,intra_mode,upright_available,downleft_available,qmtx ? get_wmatrix(qpY,2,1) : NULL,qmtx ? get_iwmatrix(qpY,2,1) : NULL);
 
     if (cbp.y) memcpy(block_param->coeff_y, coeffq_y, size*size*sizeof(uint16_t));
     if (cbp.u) memcpy(block_param->coeff_u, coeffq_u, size*size / 4 * sizeof(uint16_t));
@@ -1342,72 +1748,15 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
 
   }
   else {
-    if (mode==MODE_SKIP){
-      int sign;
-      if (block_param->dir==2){
-        r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-        ref0 = r0>=0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-        sign = ref0->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref0, pblock0_y, pblock0_u, pblock0_v, block_info, block_param->mv_arr0, sign, encoder_info->width, encoder_info->height, enable_bipred,0);
-
-        r1 = encoder_info->frame_info.ref_array[block_param->ref_idx1];
-        ref1 = r1 >= 0 ? encoder_info->ref[r1] : encoder_info->interp_frames[0];
-        sign = ref1->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref1, pblock1_y, pblock1_u, pblock1_v, block_info, block_param->mv_arr1, sign, encoder_info->width, encoder_info->height, enable_bipred, 0);
-
-        average_blocks_all(rec_y, rec_u, rec_v, pblock0_y, pblock0_u, pblock0_v, pblock1_y, pblock1_u, pblock1_v, block_info);
-      }
-      else{
-        r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-        ref0 = r0>=0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-        sign = ref0->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref0, rec_y, rec_u, rec_v, block_info, block_param->mv_arr0, sign, encoder_info->width, encoder_info->height, enable_bipred,0);
-      }
-    }
-    else if (mode==MODE_MERGE){
-      int sign;
-      if (block_param->dir == 2) {
-        r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-        ref0 = r0 >= 0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-        sign = ref0->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref0, pblock0_y, pblock0_u, pblock0_v, block_info, block_param->mv_arr0, sign, encoder_info->width, encoder_info->height, enable_bipred, 0);
-
-        r1 = encoder_info->frame_info.ref_array[block_param->ref_idx1];
-        ref1 = r1 >= 0 ? encoder_info->ref[r1] : encoder_info->interp_frames[0];
-        sign = ref1->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref1, pblock1_y, pblock1_u, pblock1_v, block_info, block_param->mv_arr1, sign, encoder_info->width, encoder_info->height, enable_bipred, 0);
-
-        average_blocks_all(pblock_y, pblock_u, pblock_v, pblock0_y, pblock0_u, pblock0_v, pblock1_y, pblock1_u, pblock1_v, block_info);
-      }
-      else {
-        r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-        ref0 = r0 >= 0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-        sign = ref0->frame_num > rec->frame_num;
-        get_inter_prediction_yuv(ref0, pblock_y, pblock_u, pblock_v, block_info, block_param->mv_arr0, sign, encoder_info->width, encoder_info->height, enable_bipred, 0);
-      }
-    }
-
-    else if (mode==MODE_INTER){
-      r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-      ref0 = r0 >= 0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-      int sign = ref0->frame_num > rec->frame_num;
-      int split = encoder_info->params->enable_pb_split;
-      get_inter_prediction_yuv(ref,pblock_y,pblock_u,pblock_v,block_info, block_param->mv_arr0,sign, encoder_info->width, encoder_info->height,enable_bipred,split);
-    }
-    else if (mode==MODE_BIPRED){
-      int sign;
-      int split = encoder_info->params->enable_pb_split;
-      r0 = encoder_info->frame_info.ref_array[block_param->ref_idx0];
-      ref0 = r0 >= 0 ? encoder_info->ref[r0] : encoder_info->interp_frames[0];
-      sign = ref0->frame_num > rec->frame_num;
-      get_inter_prediction_yuv(ref0, pblock0_y, pblock0_u, pblock0_v, block_info, block_param->mv_arr0, sign, encoder_info->width, encoder_info->height, enable_bipred, split);
-      r1 = encoder_info->frame_info.ref_array[block_param->ref_idx1];
-      ref1 = r1 >= 0 ? encoder_info->ref[r1] : encoder_info->interp_frames[0];
-      sign = ref1->frame_num > rec->frame_num;
-      get_inter_prediction_yuv(ref1, pblock1_y, pblock1_u, pblock1_v, block_info, block_param->mv_arr1, sign, encoder_info->width, encoder_info->height, enable_bipred, split);
-      average_blocks_all(pblock_y, pblock_u, pblock_v, pblock0_y, pblock0_u, pblock0_v, pblock1_y, pblock1_u, pblock1_v, block_info);
-
-    }
+    /* Skip writes the prediction straight into the reconstruction */
+    if (mode==MODE_SKIP)
+      get_block_prediction(encoder_info, block_info, block_param, block_param->dir == 2, 0, rec_y, rec_u, rec_v);
+    else if (mode==MODE_MERGE)
+      get_block_prediction(encoder_info, block_info, block_param, block_param->dir == 2, 0, pblock_y, pblock_u, pblock_v);
+    else if (mode==MODE_INTER)
+      get_block_prediction(encoder_info, block_info, block_param, 0, encoder_info->params->enable_pb_split, pblock_y, pblock_u, pblock_v);
+    else if (mode==MODE_BIPRED)
+      get_block_prediction(encoder_info, block_info, block_param, 1, encoder_info->params->enable_pb_split, pblock_y, pblock_u, pblock_v);
     if (mode!=MODE_SKIP){
       if (zero_block){
         memcpy(rec_y,pblock_y,sizeY*sizeY*sizeof(uint8_t));
@@ -1418,12 +1767,16 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
       else{
         /* Create residual, transform, quantize, and reconstruct.
         NB: coeff block type is here determined by the frame type not the mode. This is only used for quantisation optimisation */
+        int estimate = block_info->tdomain_rdo && !block_info->final_encode;
+        uint32_t dist_y, dist_u, dist_v;
         cbp.y = encode_and_reconstruct_block_inter (encoder_info, org_y,sizeY,sizeY,qpY,pblock_y,coeffq_y,rec_y,((frame_type==I_FRAME)<<1)|0,tb_split,encoder_info->params->rdoq,
-                                                    encoder_info->wmatrix[qpY][0][0],encoder_info->iwmatrix[qpY][0][0]);
+                                                    qmtx ? get_wmatrix(qpY,0,0) : NULL,qmtx ? get_iwmatrix(qpY,0,0) : NULL,estimate ? &dist_y : NULL);
         cbp.u = encode_and_reconstruct_block_inter (encoder_info, org_u,sizeC,sizeC,qpC,pblock_u,coeffq_u,rec_u,((frame_type==I_FRAME)<<1)|1,tb_split&&(size>8),
-            encoder_info->params->rdoq, encoder_info->wmatrix[qpY][1][0],encoder_info->iwmatrix[qpY][1][0]);
+            encoder_info->params->rdoq, qmtx ? get_wmatrix(qpY,1,0) : NULL,qmtx ? get_iwmatrix(qpY,1,0) : NULL,estimate ? &dist_u : NULL);
         cbp.v = encode_and_reconstruct_block_inter (encoder_info, org_v,sizeC,sizeC,qpC,pblock_v,coeffq_v,rec_v,((frame_type==I_FRAME)<<1)|1,tb_split&&(size>8),
-            encoder_info->params->rdoq, encoder_info->wmatrix[qpY][2][0],encoder_info->iwmatrix[qpY][2][0]);
+            encoder_info->params->rdoq, qmtx ? get_wmatrix(qpY,2,0) : NULL,qmtx ? get_iwmatrix(qpY,2,0) : NULL,estimate ? &dist_v : NULL);
+        if (estimate)
+          block_info->tdomain_dist = min(dist_y + dist_u + dist_v, 1 << 30);
 
         if (cbp.y) memcpy(block_param->coeff_y, coeffq_y, size*size*sizeof(uint16_t));
         if (cbp.u) memcpy(block_param->coeff_u, coeffq_u, size*size / 4 * sizeof(uint16_t));
@@ -1443,18 +1796,7 @@ int encode_block(encoder_info_t *encoder_info, stream_t *stream, block_info_t *b
     block_param->cbp.y = block_param->cbp.u = block_param->cbp.v = 1; //TODO: Do properly with respect to deblocking filter
   }
 
-  thor_free(pblock0_y);
-  thor_free(pblock0_u);
-  thor_free(pblock0_v);
-  thor_free(pblock1_y);
-  thor_free(pblock1_u);
-  thor_free(pblock1_v);
-  thor_free(pblock_y);
-  thor_free(pblock_u);
-  thor_free(pblock_v);
-  thor_free(coeffq_y);
-  thor_free(coeffq_u);
-  thor_free(coeffq_v);
+  scratch_release(scratch, mark);
 
   return nbits;
 }
@@ -1543,53 +1885,53 @@ void get_mv_cand(int ypos,int xpos,int width,int height,int size,int ref_idx,deb
     mvcand[3] = zerovec;
   }
   else if (U==1 && UR==0 && L==0 && DL==0){
-    mvcand[0] = deblock_data[up_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[up_index1].inter_pred.mv0;
-    mvcand[2] = deblock_data[up_index2].inter_pred.mv0;
-    mvcand[3] = deblock_data[up_index2].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[up_index0];
+    mvcand[1] = deblock_data->mv0[up_index1];
+    mvcand[2] = deblock_data->mv0[up_index2];
+    mvcand[3] = deblock_data->mv0[up_index2];
   }
   else if (U==1 && UR==1 && L==0 && DL==0){
-    mvcand[0] = deblock_data[up_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[up_index2].inter_pred.mv0;
-    mvcand[2] = deblock_data[upright_index].inter_pred.mv0;
-    mvcand[3] = deblock_data[upright_index].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[up_index0];
+    mvcand[1] = deblock_data->mv0[up_index2];
+    mvcand[2] = deblock_data->mv0[upright_index];
+    mvcand[3] = deblock_data->mv0[upright_index];
   }
   else if (U==0 && UR==0 && L==1 && DL==0){
-    mvcand[0] = deblock_data[left_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[left_index1].inter_pred.mv0;
-    mvcand[2] = deblock_data[left_index2].inter_pred.mv0;
-    mvcand[3] = deblock_data[left_index2].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[left_index0];
+    mvcand[1] = deblock_data->mv0[left_index1];
+    mvcand[2] = deblock_data->mv0[left_index2];
+    mvcand[3] = deblock_data->mv0[left_index2];
   }
   else if (U==1 && UR==0 && L==1 && DL==0){
-    mvcand[0] = deblock_data[upleft_index].inter_pred.mv0;
-    mvcand[1] = deblock_data[up_index2].inter_pred.mv0;
-    mvcand[2] = deblock_data[left_index2].inter_pred.mv0;
-    mvcand[3] = deblock_data[up_index0].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[upleft_index];
+    mvcand[1] = deblock_data->mv0[up_index2];
+    mvcand[2] = deblock_data->mv0[left_index2];
+    mvcand[3] = deblock_data->mv0[up_index0];
   }
  
   else if (U==1 && UR==1 && L==1 && DL==0){
-    mvcand[0] = deblock_data[up_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[upright_index].inter_pred.mv0;
-    mvcand[2] = deblock_data[left_index2].inter_pred.mv0;
-    mvcand[3] = deblock_data[left_index0].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[up_index0];
+    mvcand[1] = deblock_data->mv0[upright_index];
+    mvcand[2] = deblock_data->mv0[left_index2];
+    mvcand[3] = deblock_data->mv0[left_index0];
   }
   else if (U==0 && UR==0 && L==1 && DL==1){
-    mvcand[0] = deblock_data[left_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[left_index2].inter_pred.mv0;
-    mvcand[2] = deblock_data[downleft_index].inter_pred.mv0;
-    mvcand[3] = deblock_data[downleft_index].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[left_index0];
+    mvcand[1] = deblock_data->mv0[left_index2];
+    mvcand[2] = deblock_data->mv0[downleft_index];
+    mvcand[3] = deblock_data->mv0[downleft_index];
   }
   else if (U==1 && UR==0 && L==1 && DL==1){
-    mvcand[0] = deblock_data[up_index2].inter_pred.mv0;
-    mvcand[1] = deblock_data[left_index0].inter_pred.mv0;
-    mvcand[2] = deblock_data[downleft_index].inter_pred.mv0;
-    mvcand[3] = deblock_data[up_index0].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[up_index2];
+    mvcand[1] = deblock_data->mv0[left_index0];
+    mvcand[2] = deblock_data->mv0[downleft_index];
+    mvcand[3] = deblock_data->mv0[up_index0];
   }
   else if (U==1 && UR==1 && L==1 && DL==1){
-    mvcand[0] = deblock_data[up_index0].inter_pred.mv0;
-    mvcand[1] = deblock_data[upright_index].inter_pred.mv0;
-    mvcand[2] = deblock_data[left_index0].inter_pred.mv0;
-    mvcand[3] = deblock_data[downleft_index].inter_pred.mv0;
+    mvcand[0] = deblock_data->mv0[up_index0];
+    mvcand[1] = deblock_data->mv0[upright_index];
+    mvcand[2] = deblock_data->mv0[left_index0];
+    mvcand[3] = deblock_data->mv0[downleft_index];
   }
   else{
     printf("Error in ME candidate definition\n");
@@ -1609,7 +1951,8 @@ void copy_deblock_data(encoder_info_t *encoder_info, block_info_t *block_info){
   int size = block_info->block_pos.size;
   int block_posy = block_info->block_pos.ypos/MIN_PB_SIZE;
   int block_posx = block_info->block_pos.xpos/MIN_PB_SIZE;
-  int block_stride = encoder_info->width/MIN_PB_SIZE;
+  deblock_data_t *d = encoder_info->deblock_data;
+  int block_stride = d->stride;
   int block_index;
   int m,n,m0,n0,index;
   int div = size/(2*MIN_PB_SIZE);
@@ -1618,6 +1961,7 @@ void copy_deblock_data(encoder_info_t *encoder_info, block_info_t *block_info){
 
   uint8_t tb_split = max(0,block_info->block_param.tb_param);
   part_t pb_part = block_info->block_param.mode == MODE_INTER ? block_info->block_param.pb_part : PART_NONE; //TODO: Set pb_part properly for SKIP and BIPRED
+  uint8_t cbp = pack_cbp(block_info->block_param.cbp);
 
   for (m=0;m<bheight/MIN_PB_SIZE;m++){
     for (n=0;n<bwidth/MIN_PB_SIZE;n++){
@@ -1626,16 +1970,16 @@ void copy_deblock_data(encoder_info_t *encoder_info, block_info_t *block_info){
       n0 = div > 0 ? n/div : 0;
       index = 2*m0+n0;
       if (index > 3) printf("error: index=%4d\n",index);
-      encoder_info->deblock_data[block_index].cbp = block_info->block_param.cbp;
-      encoder_info->deblock_data[block_index].tb_split = tb_split;
-      encoder_info->deblock_data[block_index].pb_part = pb_part;
-      encoder_info->deblock_data[block_index].size = block_info->block_pos.size;
-      encoder_info->deblock_data[block_index].mode = block_info->block_param.mode;
-      encoder_info->deblock_data[block_index].inter_pred.mv0 = block_info->block_param.mv_arr0[index];
-      encoder_info->deblock_data[block_index].inter_pred.ref_idx0 = block_info->block_param.ref_idx0;
-      encoder_info->deblock_data[block_index].inter_pred.mv1 = block_info->block_param.mv_arr1[index];
-      encoder_info->deblock_data[block_index].inter_pred.ref_idx1 = block_info->block_param.ref_idx1;
-      encoder_info->deblock_data[block_index].inter_pred.bipred_flag = block_info->block_param.dir;
+      d->cbp[block_index] = cbp;
+      d->tb_split[block_index] = tb_split;
+      d->pb_part[block_index] = pb_part;
+      d->size[block_index] = block_info->block_pos.size;
+      d->mode[block_index] = block_info->block_param.mode;
+      d->mv0[block_index] = block_info->block_param.mv_arr0[index];
+      d->ref_idx0[block_index] = block_info->block_param.ref_idx0;
+      d->mv1[block_index] = block_info->block_param.mv_arr1[index];
+      d->ref_idx1[block_index] = block_info->block_param.ref_idx1;
+      d->bipred_flag[block_index] = block_info->block_param.dir;
     }
   }
 }
@@ -1716,10 +2060,12 @@ int search_bipred_prediction_params (encoder_info_t *encoder_info, block_info_t
   yuv_frame_t *ref;
   yuv_frame_t *rec = encoder_info->rec;
   yuv_block_t *org_block = block_info->org_block;
-  uint8_t *pblock_y = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock_u = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *pblock_v = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
-  uint8_t *org8 = thor_alloc(MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  uint8_t *pblock_y = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *pblock_u = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *pblock_v = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
+  uint8_t *org8 = scratch_alloc(scratch, MAX_BLOCK_SIZE*MAX_BLOCK_SIZE, 16);
 
   int width = encoder_info->width;
   int height = encoder_info->height;
@@ -1761,13 +2107,14 @@ int search_bipred_prediction_params (encoder_info_t *encoder_info, block_info_t
     uint8_t *ref0_y = ref0->y + ref_posY;
     uint8_t *ref1_y = ref1->y + ref_posY;
 
-    sad = motion_estimate_bi(org_block->y, ref0_y, ref1_y, ostride, rstride, size, size, &mv, &mv_center[r_idx0], mvp, sqrt(lambda), encoder_info->params, sign, encoder_info->width, encoder_info->height, xpos, ypos, frame_info->mvcand[r_idx0], frame_info->mvcand_num + r_idx0, 2);
+    sad = motion_estimate_bi(scratch, encoder_info->subpel_planes, org_block->y, ref0_y, ref1_y, ostride, rstride, size, size, &mv, &mv_center[r_idx0], mvp, sqrt(lambda), encoder_info->params, sign, encoder_info->width, encoder_info->height, xpos, ypos, frame_info->mvcand[r_idx0], frame_info->mvcand_num + r_idx0, 2);
 
     *ref_idx0 = r_idx0;
     *ref_idx1 = r_idx1;
     mv_arr0[0] = mv_arr0[1] = mv_arr0[2] = mv_arr0[3] = mv;
     memcpy(mv_arr1, mv_arr0, 4 * sizeof(mv_t));
 
+    scratch_release(scratch, mark);
     return sad;
   }
 
@@ -1804,7 +2151,7 @@ int search_bipred_prediction_params (encoder_info_t *encoder_info, block_info_t
       ref = r >= 0 ? encoder_info->ref[r] : encoder_info->interp_frames[0];
 
       int sign = ref->frame_num > rec->frame_num;
-      get_inter_prediction_yuv(ref, pblock_y, pblock_u, pblock_v, block_info, list ? min_mv_arr0 : min_mv_arr1, sign, encoder_info->width, encoder_info->height, enable_bipred, 1);
+      get_inter_prediction_yuv(encoder_info->subpel_planes, ref, pblock_y, pblock_u, pblock_v, block_info, list ? min_mv_arr0 : min_mv_arr1, sign, encoder_info->width, encoder_info->height, enable_bipred, 1);
       /* Modify the target block based on that predition */
       for (i = 0; i < size*size; i++) {
         org8[i] = (uint8_t)clip255(2 * (int16_t)org_block->y[i] - (int16_t)pblock_y[i]);
@@ -1831,7 +2178,7 @@ int search_bipred_prediction_params (encoder_info_t *encoder_info, block_info_t
         int sign = ref->frame_num > rec->frame_num;
         mv_t mvp2 = (frame_type == B_FRAME && list == 1) ? mv : *mvp;
         mvc = &mv_center[ref_idx];
-        sad = (uint32_t)search_inter_prediction_params(org8, ref, &block_info->block_pos, mvc, &mvp2, mv_all[part], part, sqrt(lambda), encoder_info->params, sign, width, height, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, enable_bipred);
+        sad = (uint32_t)search_inter_prediction_params(scratch, encoder_info->subpel_planes, encoder_info->me_cache, org8, ref, &block_info->block_pos, mvc, &mvp2, mv_all[part], part, sqrt(lambda), encoder_info->params, sign, width, height, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, enable_bipred);
         for (int i = 0; i < 4; i++)
           add_mvcandidate(mv_all[part] + i, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, frame_info->mvcand_mask + ref_idx);
         if (sad < min_sad) {
@@ -1854,13 +2201,20 @@ int search_bipred_prediction_params (encoder_info_t *encoder_info, block_info_t
   memcpy(mv_arr0, min_mv_arr0, 4 * sizeof(mv_t));
   memcpy(mv_arr1, min_mv_arr1, 4 * sizeof(mv_t));
 
-  thor_free(pblock_y);
-  thor_free(pblock_u);
-  thor_free(pblock_v);
-  thor_free(org8);
+  scratch_release(scratch, mark);
   return (min_sad/2); //Divide due to the way org8 is calculated
 }
 
+/* RD cost of the last encode_block(), using the transform domain distortion if it was estimated */
+static uint32_t candidate_cost(block_info_t *block_info, int size, int nbits, double lambda)
+{
+  if (block_info->tdomain_dist == MAX_UINT32)
+    return cost_calc(block_info->org_block, block_info->rec_block, size, size, size, nbits, lambda);
+  uint32_t cost = block_info->tdomain_dist + (int32_t)(lambda*nbits + 0.5);
+  if (cost > 1 << 30) cost = 1 << 30;
+  return cost;
+}
+
 int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
 {
   int size = block_info->block_pos.size;
@@ -1897,6 +2251,11 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
   int best_ref_idx = 0;
 
   int intra_inter_sad = encoder_info->params->encoder_speed > 0 && !encoder_info->params->sync;
+
+  /* At speed 3 and up only the modes suggested by the gradient histogram are searched */
+  uint32_t intra_modes = ALL_INTRA_MODES;
+  if (encoder_info->params->encoder_speed > 2 && !rectangular_flag)
+    intra_modes = gradient_intra_modes(org_block->y, size, frame_info->num_intra_modes);
   
   /* Initialize cost values */
   uint32_t min_cost = MAX_UINT32;
@@ -1909,6 +2268,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
   read_stream_pos(&stream_pos_ref,stream);
 
   /* FIND BEST MODE */
+  block_info->tdomain_rdo = encoder_info->params->tdomain_rdo;
 
   /* Evaluate skip candidates */
   if (frame_type != I_FRAME){
@@ -1921,6 +2281,9 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
     int bwidth = block_info->block_pos.bwidth;
     int bheight = block_info->block_pos.bheight;
     for (skip_idx=0;skip_idx<num_skip_vec;skip_idx++){
+      /* A later index with the same prediction costs at least as many bits */
+      if (duplicate_candidate(block_info->skip_candidates, skip_idx))
+        continue;
       tmp_block_param.skip_idx = skip_idx;
       tmp_block_param.ref_idx0 = block_info->skip_candidates[skip_idx].ref_idx0;
       tmp_block_param.ref_idx1 = block_info->skip_candidates[skip_idx].ref_idx1;
@@ -1947,6 +2310,8 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
       int merge_idx;
       int num_merge_vec = block_info->num_merge_vec;
       for (merge_idx=0;merge_idx<num_merge_vec;merge_idx++){
+        if (duplicate_candidate(block_info->merge_candidates, merge_idx))
+          continue;
         tmp_block_param.skip_idx = merge_idx;
         tmp_block_param.ref_idx0 = block_info->merge_candidates[merge_idx].ref_idx0;
         tmp_block_param.ref_idx1 = block_info->merge_candidates[merge_idx].ref_idx1;
@@ -1955,7 +2320,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
         tmp_block_param.dir = block_info->merge_candidates[merge_idx].bipred_flag;
         tmp_block_param.mode = mode;
         nbits = encode_block(encoder_info,stream,block_info,&tmp_block_param);
-        cost = cost_calc(org_block,rec_block,size,size,size,nbits,lambda);
+        cost = candidate_cost(block_info,size,nbits,lambda);
         if (cost < min_cost){
           min_cost = cost;
           copy_best_parameters(size, block_info, tmp_block_param);
@@ -1963,7 +2328,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
       }
 
       if (intra_inter_sad){
-        sad_intra = search_intra_prediction_params(org_block->y,rec,&block_info->block_pos,encoder_info->width,encoder_info->height,encoder_info->frame_info.num_intra_modes,&intra_mode);      
+        sad_intra = search_intra_prediction_params(encoder_info->scratch, org_block->y,rec,&block_info->block_pos,encoder_info->width,encoder_info->height,encoder_info->frame_info.num_intra_modes,&intra_mode,intra_modes);      
         nbits = 2;
         sad_intra += (int)(sqrt(lambda)*(double)nbits + 0.5);
       }
@@ -1995,7 +2360,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
         mv_center[ref_idx] = mvp; //Center integer ME search to mvp for uni-pred, part=PART_NONE;
         sad_inter = MAX_UINT32;
         for (part=0;part<block_info->max_num_pb_part;part++){
-          sad = (uint32_t)search_inter_prediction_params(org_block->y,ref,&block_info->block_pos,&mv_center[ref_idx],&mvp,mv_all[part],part,sqrt(lambda),encoder_info->params,sign,width,height,frame_info->mvcand[ref_idx],frame_info->mvcand_num + ref_idx,enable_bipred);
+          sad = (uint32_t)search_inter_prediction_params(encoder_info->scratch, encoder_info->subpel_planes, encoder_info->me_cache, org_block->y,ref,&block_info->block_pos,&mv_center[ref_idx],&mvp,mv_all[part],part,sqrt(lambda),encoder_info->params,sign,width,height,frame_info->mvcand[ref_idx],frame_info->mvcand_num + ref_idx,enable_bipred);
           for (int i = 0; i < 4; i++)
             add_mvcandidate(mv_all[part] + i, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, frame_info->mvcand_mask + ref_idx);
           mv_center[ref_idx] = mv_all[0][0];
@@ -2019,7 +2384,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
             for (tb_param=min_tb_param; tb_param<=max_tb_param; tb_param++){
               tmp_block_param.tb_param = tb_param;
               nbits = encode_block(encoder_info,stream,block_info,&tmp_block_param);
-              cost = cost_calc(org_block,rec_block,size,size,size,nbits,lambda);
+              cost = candidate_cost(block_info,size,nbits,lambda);
               worst_cost = max(worst_cost, cost);
               best_cost = min(best_cost, cost);
               if (cost < min_cost){
@@ -2058,7 +2423,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
           for (tb_param = min_tb_param; tb_param <= max_tb_param; tb_param++) {
             tmp_block_param.tb_param = tb_param;
             nbits = encode_block(encoder_info, stream, block_info, &tmp_block_param);
-            cost = cost_calc(org_block, rec_block, size, size, size, nbits, lambda);
+            cost = candidate_cost(block_info, size, nbits, lambda);
             if (cost < min_cost) {
               min_cost = cost;
               copy_best_parameters(size, block_info, tmp_block_param);
@@ -2077,7 +2442,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
           tmp_block_param.tb_param = 0;
           tmp_block_param.mode = mode;
           nbits = encode_block(encoder_info, stream, block_info, &tmp_block_param);
-          cost = cost_calc(org_block, rec_block, size, size, size, nbits, lambda);
+          cost = candidate_cost(block_info, size, nbits, lambda);
           if (cost < min_cost) {
             min_cost = cost;
             copy_best_parameters(size, block_info, tmp_block_param);
@@ -2097,7 +2462,13 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
         uint32_t min_intra_cost = MAX_UINT32;
         intra_mode_t best_intra_mode = MODE_DC;
         int num_intra_modes = frame_info->num_intra_modes;
+        uint32_t rdo_modes = intra_modes & ((1 << num_intra_modes) - 1);
+        int num_keep = encoder_info->params->intra_rdo_modes;
+        if (num_keep > 0 && num_keep < num_intra_modes && intra_modes == ALL_INTRA_MODES)
+          rdo_modes = prune_intra_modes(encoder_info->scratch, org_block->y, rec, &block_info->block_pos, encoder_info->width, encoder_info->height, num_intra_modes, num_keep);
         for (intra_mode = MODE_DC; intra_mode < num_intra_modes; intra_mode++) {
+          if (!(rdo_modes & (1 << intra_mode)))
+            continue;
           tmp_block_param.intra_mode = intra_mode;
           for (tb_param = 0; tb_param <= max_tb_param; tb_param++) {
             tmp_block_param.tb_param = tb_param;
@@ -2113,7 +2484,7 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
         intra_mode = best_intra_mode;
       }
       else {
-        search_intra_prediction_params(org_block->y, rec, &block_info->block_pos, encoder_info->width, encoder_info->height, frame_info->num_intra_modes, &intra_mode);
+        search_intra_prediction_params(encoder_info->scratch, org_block->y, rec, &block_info->block_pos, encoder_info->width, encoder_info->height, frame_info->num_intra_modes, &intra_mode, intra_modes);
       }
 
       /* Do final encoding with selected intra mode */
@@ -2131,6 +2502,16 @@ int mode_decision_rdo(encoder_info_t *encoder_info,block_info_t *block_info)
     } //if do_intra
   } //if !rectangular_flag
 
+  /* Reconstruct the best inter candidate if its distortion was estimated */
+  block_info->tdomain_rdo = 0;
+  mode = block_info->block_param.mode;
+  if (encoder_info->params->tdomain_rdo && (mode == MODE_MERGE || mode == MODE_INTER || mode == MODE_BIPRED) && block_info->block_param.tb_param >= 0) {
+    tmp_block_param = block_info->block_param;
+    nbits = encode_block(encoder_info, stream, block_info, &tmp_block_param);
+    min_cost = cost_calc(org_block, rec_block, size, size, size, nbits, lambda);
+    copy_best_parameters(size, block_info, tmp_block_param);
+  }
+
   /* Rewind bitstream to reference position */
   write_stream_pos(stream,&stream_pos_ref);
 
@@ -2164,14 +2545,16 @@ int check_early_skip_transform_coeff (int16_t *coeff, int qp, int size, double r
 int check_early_skip_sub_block (encoder_info_t *encoder_info, uint8_t *orig, int orig_stride, int size, int qp, uint8_t *pblock, float early_skip_threshold)
 {
   int cbp;
-  int16_t *block = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-  int16_t *coeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  int16_t *block = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  int16_t *coeff = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
 
   get_residual(block, pblock, orig, size, orig_stride);
 
   int fast = 0; //Core transform is never larger than 16x16 when EARLY_SKIP_BLOCK_SIZE=16
   if (size > 4){
-    int16_t *tmp = thor_alloc(2*EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE/4,16);
+    int16_t *tmp = scratch_alloc(scratch, 2*EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE/4,16);
     int i,j,i2,j2;
     int size2 = size/2;
     /* Instead of NxN transform, do a 2x2 average followed by (N/2)x(N/2) transform */
@@ -2184,15 +2567,13 @@ int check_early_skip_sub_block (encoder_info_t *encoder_info, uint8_t *orig, int
     }
     transform(tmp, coeff, size2, fast);
     cbp = check_early_skip_transform_coeff(coeff, qp, size2, 0.5*early_skip_threshold);
-    thor_free(tmp);
   }
   else{
     transform (block, coeff, size, fast);
     cbp = check_early_skip_transform_coeff(coeff, qp, size, early_skip_threshold);
   }
 
-  thor_free(block);
-  thor_free(coeff);
+  scratch_release(scratch, mark);
   return cbp;
 }
 
@@ -2203,8 +2584,9 @@ int check_early_skip_sub_blockC (encoder_info_t *encoder_info, uint8_t *orig, in
   int shift2 = 21 - 5 + qp/6;
   double first_quantizer_level = (double)(1<<shift2)/(double)scale;
   int threshold = (int)(early_skip_threshold * first_quantizer_level);
-  int16_t *block = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
-  int16_t *coeff = thor_alloc(2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  int16_t *block = scratch_alloc(scratch, 2*MAX_TR_SIZE*MAX_TR_SIZE, 16);
 
   get_residual(block, pblock, orig, size, orig_stride);
 
@@ -2264,8 +2646,7 @@ int check_early_skip_sub_blockC (encoder_info_t *encoder_info, uint8_t *orig, in
 #endif
   }
 
-  thor_free(block);
-  thor_free(coeff);
+  scratch_release(scratch, mark);
   return cbp;
 }
 
@@ -2279,9 +2660,11 @@ int check_early_skip_block(encoder_info_t *encoder_info,block_info_t *block_info
   int size0 = min(size,EARLY_SKIP_BLOCK_SIZE);
   int qpY = block_info->qp;
   int qpC = chroma_qp[qpY];
-  uint8_t *pblock = thor_alloc(EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
-  uint8_t *pblock0 = thor_alloc(EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
-  uint8_t *pblock1 = thor_alloc(EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  uint8_t *pblock = scratch_alloc(scratch, EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
+  uint8_t *pblock0 = scratch_alloc(scratch, EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
+  uint8_t *pblock1 = scratch_alloc(scratch, EARLY_SKIP_BLOCK_SIZE*EARLY_SKIP_BLOCK_SIZE, 16);
   mv_t mv = block_param->mv_arr0[0];
   int ref_idx = block_param->ref_idx0;
   int r = encoder_info->frame_info.ref_array[ref_idx];
@@ -2393,9 +2776,7 @@ int check_early_skip_block(encoder_info_t *encoder_info,block_info_t *block_info
     }
   }
 
-  thor_free(pblock);
-  thor_free(pblock0);
-  thor_free(pblock1);
+  scratch_release(scratch, mark);
   return (!significant_flag);
 }
 
@@ -2443,6 +2824,68 @@ int search_early_skip_candidates(encoder_info_t *encoder_info,block_info_t *bloc
 
 
 
+/* Guess from cheap statistics whether a block will be split.
+   Returns 1 for unsplit, -1 for split and 0 when there is no clear indication.
+   A block stays unsplit only where the previous frame coded the same area with blocks
+   at least as large and coherent motion, and the block is either flat or that area was
+   skipped. Flatness alone is a poor guide, since at high QP nearly every block is flat
+   relative to the quantizer. Busy blocks where the previous frame used much smaller
+   blocks are split. */
+static int predict_partition(encoder_info_t *encoder_info, int size, int ypos, int xpos, int qp)
+{
+  yuv_frame_t *orig = encoder_info->orig;
+  uint8_t *org = orig->y + ypos*orig->stride_y + xpos;
+  deblock_data_t *prev = encoder_info->prev_deblock_data;
+  double qstep2 = pow(2.0, (qp - 4)/3.0);
+  unsigned int hist[MAX_NUM_INTRA_MODES];
+  int64_t sum = 0, sum2 = 0;
+  int i, j, n = size*size;
+
+  if (!prev)
+    return 0;
+
+  for (i = 0; i < size; i++) {
+    for (j = 0; j < size; j++) {
+      int p = org[i*orig->stride_y + j];
+      sum += p;
+      sum2 += p*p;
+    }
+  }
+  double var = (double)(sum2 - sum*sum/n)/n;
+
+  /* Block sizes and motion used for the co-located area in the previous frame */
+  int block_stride = prev->stride;
+  int min_size = MAX_BLOCK_SIZE, max_size = 0, coded = 0;
+  int min_x = INT16_MAX, max_x = INT16_MIN, min_y = INT16_MAX, max_y = INT16_MIN;
+  for (i = ypos/MIN_PB_SIZE; i < (ypos + size)/MIN_PB_SIZE; i++) {
+    for (j = xpos/MIN_PB_SIZE; j < (xpos + size)/MIN_PB_SIZE; j++) {
+      int index = i*block_stride + j;
+      min_size = min(min_size, prev->size[index]);
+      max_size = max(max_size, prev->size[index]);
+      coded |= prev->mode[index] != MODE_SKIP;
+      min_x = min(min_x, prev->mv0[index].x);
+      max_x = max(max_x, prev->mv0[index].x);
+      min_y = min(min_y, prev->mv0[index].y);
+      max_y = max(max_y, prev->mv0[index].y);
+    }
+  }
+
+  if (min_size >= size && max_x - min_x < 4 && max_y - min_y < 4 && (16*var < qstep2 || !coded)) {
+    /* Unless the block has more texture than the quantizer removes */
+    unsigned int grad = 0;
+    gradient_histogram(org, orig->stride_y, size, hist);
+    for (i = 0; i < MAX_NUM_INTRA_MODES; i++)
+      grad += hist[i];
+    if ((double)grad*grad < qstep2*n*n)
+      return 1;
+  }
+
+  if (max_size <= size/4 && var > 4*qstep2)
+    return -1;
+
+  return 0;
+}
+
 int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp){
 
   int height = encoder_info->height;
@@ -2471,9 +2914,12 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
 
   /* Initialize some block-level parameters */
   block_info_t block_info;
-  yuv_block_t *org_block = thor_alloc(sizeof(yuv_block_t),16);
-  yuv_block_t *rec_block = thor_alloc(sizeof(yuv_block_t),16);
-  yuv_block_t *rec_block_best = thor_alloc(sizeof(yuv_block_t),16);
+  scratch_arena_t *scratch = encoder_info->scratch;
+  size_t mark = scratch_mark(scratch);
+  yuv_block_t *org_block = scratch_alloc(scratch, sizeof(yuv_block_t),16);
+  yuv_block_t *rec_block = scratch_alloc(scratch, sizeof(yuv_block_t),16);
+  yuv_block_t *rec_block_best = scratch_alloc(scratch, sizeof(yuv_block_t),16);
+  pred_cache_t *pred_cache = scratch_alloc(scratch, sizeof(pred_cache_t),16);
   block_context_t block_context;
   find_block_contexts(ypos, xpos, height, width, size, encoder_info->deblock_data, &block_context,encoder_info->params->use_block_contexts);
 
@@ -2509,6 +2955,9 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
     block_info.org_block = org_block;
     block_info.rec_block = rec_block;
     block_info.rec_block_best = rec_block_best;
+    block_info.pred_cache = pred_cache;
+    pred_cache->num = pred_cache->next = 0;
+    block_info.tdomain_rdo = 0;
     block_info.block_pos.size = size;
     block_info.block_pos.bwidth = min(size,width-xpos);
     block_info.block_pos.bheight = min(size,height-ypos);
@@ -2547,6 +2996,51 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
     YPOS = ypos;
     XPOS = xpos;
 
+    /* Code a superblock that matches the zero vector reference as one skip block, without the early skip or any other search */
+    int num_sb_hor = (width + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE;
+    if (size == MAX_BLOCK_SIZE && encoder_info->static_map && encoder_info->static_map[(ypos/MAX_BLOCK_SIZE)*num_sb_hor + xpos/MAX_BLOCK_SIZE]){
+      int skip_idx;
+      for (skip_idx=0;skip_idx<block_info.num_skip_vec;skip_idx++){
+        inter_pred_t *cand = &block_info.skip_candidates[skip_idx];
+        if (cand->ref_idx0 == 0 && !cand->bipred_flag && cand->mv0.x == 0 && cand->mv0.y == 0)
+          break;
+      }
+      if (skip_idx < block_info.num_skip_vec){
+        block_param_t tmp_block_param;
+        tmp_block_param.mode = MODE_SKIP;
+        tmp_block_param.tb_param = 0;
+        tmp_block_param.skip_idx = skip_idx;
+        tmp_block_param.ref_idx0 = block_info.skip_candidates[skip_idx].ref_idx0;
+        tmp_block_param.ref_idx1 = block_info.skip_candidates[skip_idx].ref_idx1;
+        tmp_block_param.mv_arr0[0] = block_info.skip_candidates[skip_idx].mv0;
+        tmp_block_param.mv_arr1[0] = block_info.skip_candidates[skip_idx].mv1;
+        tmp_block_param.dir = block_info.skip_candidates[skip_idx].bipred_flag;
+
+        block_info.final_encode = 2;
+        nbit = encode_block(encoder_info,stream,&block_info,&tmp_block_param);
+        copy_best_parameters(size,&block_info,tmp_block_param);
+
+        cost = cost_calc(org_block,rec_block,size,size,size,nbit,lambda);
+
+        /* Copy reconstructed data from smaller compact block to frame array */
+        copy_block_to_frame(encoder_info->rec,rec_block,&block_info.block_pos);
+
+        /* Store deblock information for this block to frame array */
+        copy_deblock_data(encoder_info,&block_info);
+
+#if TEST_AVAILABILITY
+        for (k=by;k<by+bs;k++){
+          for (l=bx;l<bx+bs;l++){
+            frame_info->ur[k+1][l] = 1;
+            frame_info->dl[k][l+1] = 1;
+          }
+        }
+#endif
+        scratch_release(scratch, mark);
+        return cost;
+      }
+    }
+
     if (encoder_info->frame_info.frame_type != I_FRAME && encoder_info->params->early_skip_thr > 0.0){
 
       /* Search through all skip candidates for early skip */
@@ -2581,14 +3075,32 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
           }
         }        
 #endif
-        thor_free(org_block);
-        thor_free(rec_block);
-        thor_free(rec_block_best);
+        scratch_release(scratch, mark);
         return cost;
       }
     }
   }
 
+  /* Predict the partition from block statistics when both sizes are allowed */
+  int early_out = encoder_info->params->partition_early_out;
+  int partition_pred = 0;
+  int skip_this_size = 0;
+  partition_stats_t *ps = &encoder_info->partition_stats;
+  if (early_out && encode_this_size && encode_smaller_size) {
+    partition_pred = predict_partition(encoder_info, size, ypos, xpos, qp);
+    ps->blocks++;
+    ps->pred_unsplit += partition_pred > 0;
+    ps->pred_split += partition_pred < 0;
+    if (early_out == 1) {
+      /* An unsplit prediction still splits top-down if the cost is high */
+      if (partition_pred > 0) {
+        encode_smaller_size = 0;
+        top_down = 1;
+      }
+      skip_this_size = partition_pred < 0;
+    }
+  }
+
   if (encode_smaller_size){
     int new_size = size/2;
     if (encode_this_size){
@@ -2609,7 +3121,7 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
     cost_small += process_block(encoder_info,new_size,ypos+1*new_size,xpos+1*new_size,qp);
   }
 
-  if (encode_this_size){
+  if (encode_this_size && !skip_this_size){
     YPOS = ypos;
     XPOS = xpos;
 #if TEST_AVAILABILITY
@@ -2641,6 +3153,9 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
       int split_flag = 1;
       block_param_t block_param;
       write_super_mode(stream, encoder_info, &block_info, &block_param, split_flag);
+      if (size == MAX_BLOCK_SIZE && (encoder_info->params->max_delta_qp || encoder_info->params->bitrate)) {
+        write_delta_qp(stream,block_info.delta_qp);
+      }
       cost_small = 0; //TODO: Why not nbit * lambda?
       cost_small += process_block(encoder_info,new_size,ypos+0*new_size,xpos+0*new_size,qp);
       cost_small += process_block(encoder_info,new_size,ypos+1*new_size,xpos+0*new_size,qp);
@@ -2663,6 +3178,11 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
       /* Store deblock information for this block to frame array */
       copy_deblock_data(encoder_info,&block_info);
     }    
+
+    if (partition_pred > 0 && cost > cost_small)
+      ps->miss_unsplit++;
+    if (partition_pred < 0 && cost <= cost_small)
+      ps->miss_split++;
   }
   else if (encode_rectangular_size){
 
@@ -2695,9 +3215,7 @@ int process_block(encoder_info_t *encoder_info,int size,int ypos,int xpos,int qp
     }
   }
 
-  thor_free(org_block);
-  thor_free(rec_block);
-  thor_free(rec_block_best);
+  scratch_release(scratch, mark);
 
   return min(cost,cost_small);
 }
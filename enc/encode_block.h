@@ -27,7 +27,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #if !defined(_ENCODE_BLOCK_H_)
 #define _ENCODE_BLOCK_H_
 
+static inline uint64_t mv_mask_hash(const mv_t *mv) { return (uint64_t)1 << (((mv->y << 3) ^ mv->x) & 63); }
+
+static inline void add_mvcandidate(const mv_t *mv, mv_t *list, int *list_len, uint64_t *mask)
+{
+  mv_t imv;
+  imv.x = (mv->x + 2) >> 2;
+  imv.y = (mv->y + 2) >> 2;
+  uint64_t m = mv_mask_hash(&imv);
+  if (!(m & *mask)) {
+    list[*list_len] = imv;
+    *list_len += 1;
+  }
+  *mask |= m;
+}
+
+int quantize(int16_t *coeff, int16_t *coeffq, int qp, int size, int coeff_block_type, qmtx_t *wmatrix, int ws);
 int process_block(encoder_info_t *encoder_info,int size,int yposY,int xposY, int qp);
 void detect_clpf(const uint8_t *rec,const uint8_t *org,int x0, int y0,int width, int height, int so,int stride, int *sum0, int *sum1);
+unsigned int sad_calc(uint8_t *a, uint8_t *b, int astride, int bstride, int width, int height);
+void alloc_me_cache(encoder_info_t *encoder_info);
+void free_me_cache(encoder_info_t *encoder_info);
+void reset_me_cache(me_cache_t *mc);
+void sad_calc_batch(uint8_t *a, uint8_t **b, int n, int astride, int bstride, int width, int height, unsigned int *sad);
 
 #endif
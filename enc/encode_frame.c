@@ -33,6 +33,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "common_frame.h"
 #include "wt_matrix.h"
 #include "enc_kernels.h"
+#include "motion_pyramid.h"
+#include "hash_me.h"
 
 extern int chroma_qp[52];
 const double squared_lambda_QP [52] = {
@@ -55,7 +57,7 @@ static int clpf_decision(int k, int l, yuv_frame_t *rec, yuv_frame_t *org, const
       int xpos = l*MAX_BLOCK_SIZE + n*block_size;
       int ypos = k*MAX_BLOCK_SIZE + m*block_size;
       int index = (ypos/MIN_PB_SIZE)*(rec->width/MIN_PB_SIZE) + (xpos/MIN_PB_SIZE);
-      if (deblock_data[index].cbp.y && deblock_data[index].mode != MODE_BIPRED)
+      if ((deblock_data->cbp[index] & CBP_Y) && deblock_data->mode[index] != MODE_BIPRED)
         (use_simd ? detect_clpf_simd : detect_clpf)(rec->y,org->y,xpos,ypos,rec->width,rec->height,org->stride_y,rec->stride_y,&sum0,&sum1);
     }
   }
@@ -63,6 +65,35 @@ static int clpf_decision(int k, int l, yuv_frame_t *rec, yuv_frame_t *org, const
   return sum1 < sum0;
 }
 
+/* Mark the superblocks whose mean absolute difference from the zero vector skip reference is at most static_thr */
+static void find_static_superblocks(encoder_info_t *encoder_info, int num_sb_ver, int num_sb_hor)
+{
+  yuv_frame_t *orig = encoder_info->orig;
+  int r = encoder_info->frame_info.ref_array[0];
+  yuv_frame_t *ref = r >= 0 ? encoder_info->ref[r] : encoder_info->interp_frames[0];
+  int max_sad = (int)(encoder_info->params->static_thr * MAX_BLOCK_SIZE*MAX_BLOCK_SIZE*3/2);
+  int k,l;
+
+  for (k=0;k<num_sb_ver;k++){
+    for (l=0;l<num_sb_hor;l++){
+      int yposY = k*MAX_BLOCK_SIZE;
+      int xposY = l*MAX_BLOCK_SIZE;
+      int yposC = yposY/2;
+      int xposC = xposY/2;
+      int sad = max_sad + 1;
+      /* Only whole superblocks can be coded as one skip block */
+      if (yposY + MAX_BLOCK_SIZE <= encoder_info->height && xposY + MAX_BLOCK_SIZE <= encoder_info->width) {
+        sad = sad_calc(orig->y + yposY*orig->stride_y + xposY, ref->y + yposY*ref->stride_y + xposY, orig->stride_y, ref->stride_y, MAX_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        if (sad <= max_sad)
+          sad += sad_calc(orig->u + yposC*orig->stride_c + xposC, ref->u + yposC*ref->stride_c + xposC, orig->stride_c, ref->stride_c, MAX_BLOCK_SIZE/2, MAX_BLOCK_SIZE/2);
+        if (sad <= max_sad)
+          sad += sad_calc(orig->v + yposC*orig->stride_c + xposC, ref->v + yposC*ref->stride_c + xposC, orig->stride_c, ref->stride_c, MAX_BLOCK_SIZE/2, MAX_BLOCK_SIZE/2);
+      }
+      encoder_info->static_map[k*num_sb_hor + l] = sad <= max_sad;
+    }
+  }
+}
+
 void encode_frame(encoder_info_t *encoder_info)
 {
   int k,l;
@@ -72,9 +103,17 @@ void encode_frame(encoder_info_t *encoder_info)
   int num_sb_ver = (height + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE;
   stream_t *stream = encoder_info->stream;
 
-  memset(encoder_info->deblock_data, 0, ((height/MIN_PB_SIZE) * (width/MIN_PB_SIZE) * sizeof(deblock_data_t)) );
+  clear_deblock_data(encoder_info->deblock_data);
+  if (encoder_info->me_cache)
+    reset_me_cache(encoder_info->me_cache);
 
   frame_info_t *frame_info = &(encoder_info->frame_info);
+  if (encoder_info->static_map) {
+    memset(encoder_info->static_map, 0, num_sb_ver*num_sb_hor);
+    if (frame_info->frame_type != I_FRAME)
+      find_static_superblocks(encoder_info, num_sb_ver, num_sb_hor);
+  }
+
   uint8_t qp = frame_info->qp;
 
   double lambda_coeff;
@@ -135,6 +174,10 @@ void encode_frame(encoder_info_t *encoder_info)
         frame_info->mvcand_mask[ref_idx] = 0;
       }
       frame_info->best_ref = -1;
+      if (encoder_info->me_pyramid && frame_info->frame_type != I_FRAME)
+        pyramid_mv_candidates(encoder_info, yposY, xposY);
+      if (encoder_info->me_hash && frame_info->frame_type != I_FRAME)
+        hash_mv_candidates(encoder_info, yposY, xposY);
 
       int max_delta_qp = encoder_info->params->max_delta_qp;
       if (max_delta_qp){
@@ -177,6 +220,15 @@ void encode_frame(encoder_info_t *encoder_info)
 
   qp = encoder_info->frame_info.qp = encoder_info->frame_info.prev_qp; //TODO: Consider using average QP instead
 
+  /* Keep the block decisions of this frame for partition prediction in the next */
+  if (encoder_info->params->partition_early_out) {
+    if (!encoder_info->prev_deblock_data) {
+      encoder_info->prev_deblock_data = (deblock_data_t *)malloc(sizeof(deblock_data_t));
+      create_deblock_data(encoder_info->prev_deblock_data, width, height);
+    }
+    clone_deblock_data(encoder_info->prev_deblock_data, encoder_info->deblock_data);
+  }
+
   if (encoder_info->params->deblocking){
     //TODO: Use QP per SB or average QP
     deblock_frame_y(encoder_info->rec, encoder_info->deblock_data, width, height, qp);
@@ -199,19 +251,15 @@ void encode_frame(encoder_info_t *encoder_info)
     update_rate_control_per_frame(encoder_info->rc, num_bits_frame);
   }
 
-  /* Sliding window operation for reference frame buffer by circular buffer */
-
-  /* Store pointer to reference frame that is shifted out of reference buffer */
-  yuv_frame_t *tmp = encoder_info->ref[MAX_REF_FRAMES-1];
-
-  /* Update remaining pointers to implement sliding window reference buffer operation */
-  memmove(encoder_info->ref+1, encoder_info->ref, sizeof(yuv_frame_t*)*(MAX_REF_FRAMES-1));
+  /* The reconstructed frame becomes ref[0] in place; only its border needs padding */
+  pad_yuv_frame(encoder_info->rec);
 
-  /* Set ref[0] to the memory slot where the new current reconstructed frame wil replace reference frame being shifted out */
-  encoder_info->ref[0] = tmp;
+  /* Sliding window operation for reference frame buffer; the frame shifted out is returned to the pool */
+  shift_reference_window(encoder_info->ref_pool, encoder_info->ref, encoder_info->num_ref_frames, encoder_info->rec);
 
-  /* Pad the reconstructed frame and write into ref[0] */
-  create_reference_frame(encoder_info->ref[0],encoder_info->rec);
+  /* Hash the source of the new reference frame for finding exact copies of its blocks */
+  if (encoder_info->me_hash)
+    add_me_hash_frame(encoder_info,encoder_info->orig);
 
 #if 0
   /* To test sliding window operation */
@@ -221,7 +269,7 @@ void encode_frame(encoder_info_t *encoder_info)
   int offset_ref = offsety * encoder_info->ref[0]->stride_y +  offsetx;
   printf("rec: %3d ",encoder_info->rec->y[offset_rec]);
   printf("ref: ");
-  for (r=0;r<MAX_REF_FRAMES;r++){
+  for (r=0;r<encoder_info->num_ref_frames;r++){
     printf("%3d ",encoder_info->ref[r]->y[offset_ref]);
   }
 #endif
@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "mainenc.h"
+#include "encode_block.h"
+#include "hash_me.h"
+
+#define HASH_MUL_X 0x01000193u  //Multiplier of the rolling hash along a row
+#define HASH_MUL_Y 0x9e3779b1u  //Multiplier of the rolling hash down a column
+#define HASH_MAX_CHAIN 16       //Colliding bucket entries (other keys) examined per lookup
+
+static uint32_t power(uint32_t b, int n)
+{
+  uint32_t p = 1;
+  while (n--)
+    p *= b;
+  return p;
+}
+
+/* Hash of a constant block with sample value 1; a flat block with value v hashes to v times this */
+static uint32_t flat_hash(void)
+{
+  uint32_t sx = 0, sy = 0;
+  for (int i = 0; i < ME_HASH_BLOCK; i++) {
+    sx = sx*HASH_MUL_X + 1;
+    sy = sy*HASH_MUL_Y + 1;
+  }
+  return sx*sy;
+}
+
+static uint32_t block_hash(const uint8_t *p, int stride)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < ME_HASH_BLOCK; i++) {
+    uint32_t h = 0;
+    for (int j = 0; j < ME_HASH_BLOCK; j++)
+      h = h*HASH_MUL_X + p[i*stride + j];
+    v = v*HASH_MUL_Y + h;
+  }
+  return v;
+}
+
+void alloc_me_hashes(encoder_info_t *encoder_info)
+{
+  int size = encoder_info->width * encoder_info->height;
+
+  encoder_info->me_hash = (me_hash_t *)calloc(ME_HASH_FRAMES, sizeof(me_hash_t));
+  if (encoder_info->me_hash == NULL)
+    fatalerror("Memory allocation failed for ME hash tables\n");
+  for (int i = 0; i < ME_HASH_FRAMES; i++) {
+    me_hash_t *h = &encoder_info->me_hash[i];
+    h->frame_num = -1;
+    h->head = (int32_t *)malloc((1 << ME_HASH_BITS) * sizeof(int32_t));
+    h->next = (int32_t *)malloc(size * sizeof(int32_t));
+    h->key = (uint32_t *)malloc(size * sizeof(uint32_t));
+    if (h->head == NULL || h->next == NULL || h->key == NULL)
+      fatalerror("Memory allocation failed for ME hash tables\n");
+  }
+}
+
+void free_me_hashes(encoder_info_t *encoder_info)
+{
+  me_hash_t *h = encoder_info->me_hash;
+  if (h == NULL)
+    return;
+  for (int i = 0; i < ME_HASH_FRAMES; i++) {
+    free(h[i].head);
+    free(h[i].next);
+    free(h[i].key);
+  }
+  free(h);
+  encoder_info->me_hash = NULL;
+}
+
+/* Hash every block position of the source of a frame entering the reference buffer.
+   The slots slide along with the reference buffer, so the oldest table is reused. */
+void add_me_hash_frame(encoder_info_t *encoder_info, yuv_frame_t *frame)
+{
+  me_hash_t *hashes = encoder_info->me_hash;
+  me_hash_t h = hashes[ME_HASH_FRAMES-1];
+  int width = encoder_info->width;
+  int height = encoder_info->height;
+  int stride = frame->stride_y;
+  uint32_t px = power(HASH_MUL_X, ME_HASH_BLOCK);
+  uint32_t py = power(HASH_MUL_Y, ME_HASH_BLOCK);
+  uint32_t flat = flat_hash();
+
+  memmove(hashes+1, hashes, sizeof(me_hash_t)*(ME_HASH_FRAMES-1));
+  h.frame_num = frame->frame_num;
+  memset(h.head, -1, (1 << ME_HASH_BITS) * sizeof(int32_t));
+  if (width < ME_HASH_BLOCK || height < ME_HASH_BLOCK) {
+    hashes[0] = h;
+    return;
+  }
+
+  /* Rolling row hashes of ME_HASH_BLOCK samples, stored in key before the column pass */
+  for (int y = 0; y < height; y++) {
+    uint8_t *p = frame->y + y*stride;
+    uint32_t r = 0;
+    for (int x = 0; x < ME_HASH_BLOCK; x++)
+      r = r*HASH_MUL_X + p[x];
+    h.key[y*width] = r;
+    for (int x = 1; x + ME_HASH_BLOCK <= width; x++) {
+      r = r*HASH_MUL_X + p[x+ME_HASH_BLOCK-1] - px*p[x-1];
+      h.key[y*width + x] = r;
+    }
+  }
+
+  /* Rolling column pass over the row hashes, in place from the top */
+  for (int x = 0; x + ME_HASH_BLOCK <= width; x++) {
+    uint32_t v = 0;
+    for (int y = 0; y < ME_HASH_BLOCK; y++)
+      v = v*HASH_MUL_Y + h.key[y*width + x];
+    for (int y = 0; y + ME_HASH_BLOCK <= height; y++) {
+      uint32_t top = h.key[y*width + x];
+      h.key[y*width + x] = v;
+      if (y + ME_HASH_BLOCK < height)
+        v = v*HASH_MUL_Y + h.key[(y+ME_HASH_BLOCK)*width + x] - py*top;
+    }
+  }
+
+  /* Chain the positions per bucket; flat blocks are left out since the zero vector covers them */
+  for (int y = 0; y + ME_HASH_BLOCK <= height; y++) {
+    for (int x = 0; x + ME_HASH_BLOCK <= width; x++) {
+      int pos = y*width + x;
+      uint32_t key = h.key[pos];
+      if (key == flat*frame->y[y*stride + x])
+        continue;
+      int bucket = key >> (32 - ME_HASH_BITS);
+      h.next[pos] = h.head[bucket];
+      h.head[bucket] = pos;
+    }
+  }
+  hashes[0] = h;
+}
+
+/* Add the nearest exact copy of each ME_HASH_BLOCK block of a superblock as a motion vector candidate */
+void hash_mv_candidates(encoder_info_t *encoder_info, int ypos, int xpos)
+{
+  frame_info_t *frame_info = &encoder_info->frame_info;
+  yuv_frame_t *orig = encoder_info->orig;
+  int width = encoder_info->width;
+  int height = encoder_info->height;
+  uint32_t flat = flat_hash();
+
+  for (int ref_idx = 0; ref_idx < frame_info->num_ref; ref_idx++) {
+    int r = frame_info->ref_array[ref_idx];
+    int i;
+    if (r < 0)
+      continue; //The interpolated frame has no source
+    yuv_frame_t *ref = encoder_info->ref[r];
+    for (i = 0; i < ME_HASH_FRAMES && encoder_info->me_hash[i].frame_num != ref->frame_num; i++);
+    if (i == ME_HASH_FRAMES)
+      continue;
+    me_hash_t *h = &encoder_info->me_hash[i];
+    int s = ref->frame_num > encoder_info->rec->frame_num ? -1 : 1;
+
+    for (int by = ypos; by < ypos + MAX_BLOCK_SIZE && by + ME_HASH_BLOCK <= height; by += ME_HASH_BLOCK) {
+      for (int bx = xpos; bx < xpos + MAX_BLOCK_SIZE && bx + ME_HASH_BLOCK <= width; bx += ME_HASH_BLOCK) {
+        uint8_t *p = orig->y + by*orig->stride_y + bx;
+        uint32_t key = block_hash(p, orig->stride_y);
+        if (key == flat*p[0])
+          continue;
+        int best = -1, best_dist = 1 << 30;
+        int n = 0;
+        /* Chains run up from the bottom of the picture, so the walk ends once the rows
+           are further above than the best copy. Exact copies don't count towards the limit. */
+        for (int pos = h->head[key >> (32 - ME_HASH_BITS)]; pos >= 0 && n < HASH_MAX_CHAIN; pos = h->next[pos]) {
+          if (by - pos / width >= best_dist)
+            break;
+          if (h->key[pos] != key) {
+            n++;
+            continue;
+          }
+          int dist = abs(pos / width - by) + abs(pos % width - bx);
+          if (dist < best_dist) {
+            best = pos;
+            best_dist = dist;
+          }
+        }
+        if (best >= 0) {
+          mv_t mv;
+          mv.x = s*(best % width - bx)*4;
+          mv.y = s*(best / width - by)*4;
+          add_mvcandidate(&mv, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, frame_info->mvcand_mask + ref_idx);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,418 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "input_file.h"
+#include "common_frame.h"
+#include "simd.h"
+#include "enc_kernels.h"
+
+#if defined(_WIN32)
+#define fseeko _fseeki64
+#endif
+
+/* Parse a YUV4MPEG2 stream header line.  Returns its length including the
+   newline, 0 if buf is not a Y4M header and -1 if it is not supported. */
+static int parse_y4m_header(const char *buf, int len, int *width, int *height, double *frame_rate)
+{
+  int pos = 10;
+  int num, den;
+  char *end;
+
+  if (len < 10 || strncmp(buf, "YUV4MPEG2 ", 10))
+    return 0;
+
+  while (pos < len && buf[pos] != '\n') {
+    switch (buf[pos++]) {
+    case 'W':
+      *width = strtol(buf+pos, &end, 10);
+      pos = end-buf+1;
+      break;
+    case 'H':
+      *height = strtol(buf+pos, &end, 10);
+      pos = end-buf+1;
+      break;
+    case 'F':
+      den = strtol(buf+pos, &end, 10);
+      pos = end-buf+1;
+      num = strtol(buf+pos, &end, 10);
+      pos = end-buf+1;
+      *frame_rate = (double)den/num;
+      break;
+    case 'I':
+      if (buf[pos] != 'p') {
+        fprintf(stderr, "Only progressive input supported\n");
+        return -1;
+      }
+      break;
+    case 'C':
+      if (strncmp(buf+pos, "420", 3)) {
+        fprintf(stderr, "Only 4:2:0 input supported\n");
+        return -1;
+      }
+      while (buf[pos] != ' ' && buf[pos] != '\n' && pos < len)
+        pos++;
+      break;
+    case 'A': /* Ignored */
+    case 'X':
+    default:
+      while (buf[pos] != ' ' && buf[pos] != '\n' && pos < len)
+        pos++;
+      break;
+    }
+  }
+  if (pos >= len) {
+    fprintf(stderr, "Corrupt Y4M file\n");
+    return -1;
+  }
+  return pos + 1;
+}
+
+static int is_regular_file(const char *name)
+{
+#if defined(_WIN32)
+  return 1;
+#else
+  struct stat st;
+  return stat(name, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+/* Read from a stream, starting with any bytes consumed while probing for a header */
+static size_t read_stream(input_file_t *in, uint8_t *dst, size_t n)
+{
+  size_t k = min(n, (size_t)in->num_pending);
+  memcpy(dst, in->pending, k);
+  memmove(in->pending, in->pending + k, in->num_pending - k);
+  in->num_pending -= k;
+  return k + (n > k ? fread(dst + k, 1, n - k, in->file) : 0);
+}
+
+/* Frame size in the file for the input format */
+static void set_geometry(input_file_t *in, int width, int height)
+{
+  in->width = width;
+  in->height = height;
+  in->frame_size = in->format == INPUT_YUY2 ? width*height*2 : width*height*3/2;
+}
+
+static void open_stream(input_file_t *in, int lookahead)
+{
+  in->stream = 1;
+  in->num_frames = -1;
+  in->next_frame = 0;
+
+  /* A Y4M header sets the geometry of the stream */
+  in->num_pending = fread(in->pending, 1, 10, in->file);
+  if (in->num_pending == 10 && !strncmp((char *)in->pending, "YUV4MPEG2 ", 10)) {
+    char buf[256];
+    int c = 0, len, w = 0, h = 0;
+    double frame_rate = 0;
+    memcpy(buf, in->pending, 10);
+    for (len = 10; len < sizeof(buf) && c != '\n' && (c = getc(in->file)) != EOF; len++)
+      buf[len] = c;
+    if (parse_y4m_header(buf, len, &w, &h, &frame_rate) <= 0)
+      fatalerror("Error reading Y4M stream header");
+    if (in->format != INPUT_I420)
+      fatalerror("Y4M input is always planar 4:2:0");
+    set_geometry(in, w, h);
+    in->frame_rate = frame_rate;
+    in->num_pending = 0;
+    in->y4m = 1;
+  }
+
+  in->num_slots = lookahead;
+  in->slots = (yuv_frame_t *)malloc(lookahead * sizeof(yuv_frame_t));
+  for (int i = 0; i < lookahead; i++)
+    create_yuv_frame(&in->slots[i], in->width, in->height, 0, 0, 0, 0);
+}
+
+/* Take geometry and header lengths from a Y4M file */
+static void probe_y4m_file(input_file_t *in)
+{
+  char buf[256];
+  int len = fread(buf, 1, sizeof(buf), in->file);
+  int w = in->width, h = in->height;
+  double frame_rate = 0;
+  int pos = parse_y4m_header(buf, len, &w, &h, &frame_rate);
+  if (pos < 0)
+    fatalerror("Error reading Y4M file header");
+  if (pos > 0) {
+    if (len < pos + 6 || strncmp(buf+pos, "FRAME\n", 6))
+      fatalerror("Corrupt Y4M file");
+    if (in->format != INPUT_I420)
+      fatalerror("Y4M input is always planar 4:2:0");
+    set_geometry(in, w, h);
+    in->frame_rate = frame_rate;
+    in->file_headerlen = pos;
+    in->frame_headerlen = 6;
+  }
+}
+
+/* Open the input.  Y4M files and streams override width, height and the header lengths;
+   the values in use are left in in. */
+void open_input_file(input_file_t *in, const char *name, int width, int height, int format, int file_headerlen, int frame_headerlen, int lookahead)
+{
+  memset(in, 0, sizeof(input_file_t));
+  in->format = format;
+  set_geometry(in, width, height);
+  in->file_headerlen = file_headerlen;
+  in->frame_headerlen = frame_headerlen;
+
+  if (format < INPUT_I420 || format > INPUT_YUY2)
+    fatalerror("Unknown input format");
+  if (name == NULL || !(in->file = fopen(name, "rb")))
+    fatalerror("Could not open in-file for reading.");
+
+  if (!is_regular_file(name))
+    open_stream(in, lookahead);
+  else {
+    probe_y4m_file(in);
+    fseeko(in->file, 0, SEEK_END);
+    in->size = ftello(in->file);
+    fseeko(in->file, 0, SEEK_SET);
+    in->num_frames = in->size >= in->file_headerlen && in->frame_size > 0 ?
+      (in->size - in->file_headerlen) / (in->frame_size + in->frame_headerlen) : 0;
+    create_yuv_frame(&in->frame, in->width, in->height, 0, 0, 0, 0);
+
+#if !defined(_WIN32)
+    if (in->size > 0 && (uint64_t)in->size <= SIZE_MAX) {
+      void *map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fileno(in->file), 0);
+      if (map != MAP_FAILED)
+        in->map = map;
+    }
+#endif
+  }
+
+  if (format != INPUT_I420 && !in->map) {
+    in->raw = (uint8_t *)malloc(in->frame_size);
+    if (in->raw == NULL)
+      fatalerror("Memory allocation failed for input frame\n");
+  }
+}
+
+void close_input_file(input_file_t *in)
+{
+#if !defined(_WIN32)
+  if (in->map)
+    munmap(in->map, in->size);
+#endif
+  if (in->stream) {
+    for (int i = 0; i < in->num_slots; i++)
+      close_yuv_frame(&in->slots[i]);
+    free(in->slots);
+  }
+  else
+    close_yuv_frame(&in->frame);
+  free(in->raw);
+  fclose(in->file);
+}
+
+static void copy_plane(uint8_t *dst, int dstride, const uint8_t *src, int sstride, int width, int height)
+{
+  if (dstride == sstride)
+    memcpy(dst, src, height*sstride);
+  else
+    for (int i = 0; i < height; i++)
+      memcpy(dst + i*dstride, src + i*sstride, width);
+}
+
+static void deinterleave_uv(uint8_t *u, uint8_t *v, const uint8_t *uv, int len)
+{
+  if (use_simd) {
+    deinterleave_uv_simd(u, v, uv, len);
+    return;
+  }
+  for (int j = 0; j < len; j++) {
+    u[j] = uv[2*j];
+    v[j] = uv[2*j+1];
+  }
+}
+
+/* Two rows of YUY2 to two luma rows and one row of each chroma plane,
+   averaging the chroma of the rows */
+static void yuy2_rows(uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, const uint8_t *src0, const uint8_t *src1, int width)
+{
+  if (use_simd) {
+    yuy2_rows_simd(y0, y1, u, v, src0, src1, width);
+    return;
+  }
+  for (int j = 0; j < width/2; j++) {
+    y0[2*j] = src0[4*j];
+    y0[2*j+1] = src0[4*j+2];
+    y1[2*j] = src1[4*j];
+    y1[2*j+1] = src1[4*j+2];
+    u[j] = (src0[4*j+1] + src1[4*j+1] + 1) >> 1;
+    v[j] = (src0[4*j+3] + src1[4*j+3] + 1) >> 1;
+  }
+}
+
+/* Convert a frame of the input format at src to planar 4:2:0 */
+static void convert_input_frame(input_file_t *in, const uint8_t *src, yuv_frame_t *frame)
+{
+  int width = in->width;
+  int height = in->height;
+  int sy = frame->stride_y;
+  int sc = frame->stride_c;
+  int i;
+
+  switch (in->format) {
+  case INPUT_I420:
+    copy_plane(frame->y, sy, src, width, width, height);
+    copy_plane(frame->u, sc, src + width*height, width/2, width/2, height/2);
+    copy_plane(frame->v, sc, src + width*height*5/4, width/2, width/2, height/2);
+    break;
+  case INPUT_NV12:
+  case INPUT_NV21: {
+    uint8_t *u = in->format == INPUT_NV12 ? frame->u : frame->v;
+    uint8_t *v = in->format == INPUT_NV12 ? frame->v : frame->u;
+    copy_plane(frame->y, sy, src, width, width, height);
+    for (i = 0; i < height/2; i++)
+      deinterleave_uv(u + i*sc, v + i*sc, src + width*height + i*width, width/2);
+    break;
+  }
+  case INPUT_YUY2:
+    for (i = 0; i < height; i += 2)
+      yuy2_rows(frame->y + i*sy, frame->y + (i+1)*sy, frame->u + i/2*sc, frame->v + i/2*sc,
+                src + i*2*width, src + (i+1)*2*width, width);
+    break;
+  }
+}
+
+/* Read the next frame of a stream into its slot.  Returns 0 at the end of the stream. */
+static int read_stream_frame(input_file_t *in)
+{
+  yuv_frame_t *frame = &in->slots[in->next_frame % in->num_slots];
+  uint8_t buf[256];
+  int i;
+
+  if (in->y4m) {
+    int c = 0;
+    for (i = 0; i < 5 && (c = getc(in->file)) != EOF; i++)
+      buf[i] = c;
+    if (c == EOF)
+      return 0;
+    if (strncmp((char *)buf, "FRAME", 5))
+      fatalerror("Corrupt Y4M frame header");
+    while ((c = getc(in->file)) != '\n' && c != EOF);
+  }
+  else {
+    for (i = 0; i < in->frame_headerlen + (in->next_frame ? 0 : in->file_headerlen); i++)
+      if (read_stream(in, buf, 1) != 1)
+        return 0;
+  }
+
+  if (in->format != INPUT_I420) {
+    if (read_stream(in, in->raw, in->frame_size) != in->frame_size)
+      return 0;
+    convert_input_frame(in, in->raw, frame);
+    in->next_frame++;
+    return 1;
+  }
+
+  for (i = 0; i < in->height; i++)
+    if (read_stream(in, frame->y + i*frame->stride_y, in->width) != in->width)
+      return 0;
+  for (i = 0; i < in->height/2; i++)
+    if (read_stream(in, frame->u + i*frame->stride_c, in->width/2) != in->width/2)
+      return 0;
+  for (i = 0; i < in->height/2; i++)
+    if (read_stream(in, frame->v + i*frame->stride_c, in->width/2) != in->width/2)
+      return 0;
+  in->next_frame++;
+  return 1;
+}
+
+int input_frame_available(input_file_t *in, int64_t frame_num)
+{
+  if (!in->stream)
+    return frame_num < in->num_frames;
+
+  if (frame_num < in->next_frame - in->num_slots)
+    fatalerror("Input frame is no longer buffered");
+  while (in->num_frames < 0 && in->next_frame <= frame_num) {
+    if (!read_stream_frame(in))
+      in->num_frames = in->next_frame;
+  }
+  return frame_num < in->next_frame;
+}
+
+/* Point frame at the planes of frame_num.  They stay valid until the next
+   call, and must not be written. */
+void read_input_frame(input_file_t *in, int64_t frame_num, yuv_frame_t *frame)
+{
+  int width = in->width;
+  int height = in->height;
+
+  if (!input_frame_available(in, frame_num))
+    fatalerror("Error reading frame from file");
+
+  if (in->stream) {
+    *frame = in->slots[frame_num % in->num_slots];
+    return;
+  }
+
+  int64_t pos = in->file_headerlen + frame_num*(in->frame_size + in->frame_headerlen) + in->frame_headerlen;
+  *frame = in->frame;
+
+  if (in->map) {
+    const uint8_t *y = in->map + pos;
+    const uint8_t *u = y + width*height;
+    const uint8_t *v = u + width*height/4;
+    /* Use the file in place if it has the strides and alignment of a frame
+       buffer, and SIMD over-reads of the last row stay inside the file */
+    if (in->format == INPUT_I420 && frame->stride_y == width && frame->stride_c == width/2 &&
+        !(((uintptr_t)y | (uintptr_t)u | (uintptr_t)v) & 15) &&
+        pos + in->frame_size + 16 <= in->size) {
+      frame->y = (uint8_t *)y;
+      frame->u = (uint8_t *)u;
+      frame->v = (uint8_t *)v;
+      return;
+    }
+    convert_input_frame(in, y, frame);
+    return;
+  }
+
+  fseeko(in->file, pos, SEEK_SET);
+  if (in->format == INPUT_I420)
+    read_yuv_frame(frame, width, height, in->file);
+  else {
+    if (fread(in->raw, 1, in->frame_size, in->file) != in->frame_size)
+      fatalerror("Error reading frame from file");
+    convert_input_frame(in, in->raw, frame);
+  }
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if !defined(_INPUT_FILE_H_)
+#define _INPUT_FILE_H_
+
+#include <stdio.h>
+#include "types.h"
+
+/* Pixel layouts of raw input, converted to planar 4:2:0 when read */
+enum {
+  INPUT_I420 = 0,
+  INPUT_NV12 = 1,           //Y plane followed by interleaved U,V
+  INPUT_NV21 = 2,           //Y plane followed by interleaved V,U
+  INPUT_YUY2 = 3            //Packed 4:2:2 Y,U,Y,V
+};
+
+/* Source frames from a memory mapped file, a seekable file or a stream */
+typedef struct
+{
+  FILE *file;
+  uint8_t *map;             //Whole file when memory mapped
+  int64_t size;             //File size in bytes, -1 for streams
+  int64_t num_frames;       //Frames in the file, -1 while unknown for streams
+  int64_t file_headerlen;
+  int64_t frame_headerlen;
+  int width;
+  int height;
+  double frame_rate;        //From a Y4M header, 0 if unknown
+  int format;
+  int frame_size;           //Bytes per frame in the file, excluding headers
+  int stream;               //Not seekable, frames are read in order
+  int y4m;                  //Stream with Y4M frame headers
+  yuv_frame_t frame;        //Buffer for frames that are copied
+  uint8_t *raw;             //Frame as read, before conversion to 4:2:0
+  /* Frames read ahead from a stream */
+  int num_slots;
+  yuv_frame_t *slots;
+  int64_t next_frame;
+  uint8_t pending[16];      //Bytes read while probing the stream header
+  int num_pending;
+} input_file_t;
+
+void open_input_file(input_file_t *in, const char *name, int width, int height, int format, int file_headerlen, int frame_headerlen, int lookahead);
+void close_input_file(input_file_t *in);
+int input_frame_available(input_file_t *in, int64_t frame_num);
+void read_input_frame(input_file_t *in, int64_t frame_num, yuv_frame_t *frame);
+
+#endif
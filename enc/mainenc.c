@@ -37,7 +37,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "snr.h"
 #include "mainenc.h"
 #include "common_frame.h"
+#include "common_block.h"
 #include "encode_frame.h"
+#include "encode_block.h"
 #include "putbits.h"
 #include "putvlc.h"
 #include "transform.h"
@@ -45,6 +47,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../common/simd.h"
 #include "rc.h"
 #include "wt_matrix.h"
+#include "motion_pyramid.h"
+#include "hash_me.h"
+#include "subpel_planes.h"
+#include "scratch.h"
+#include "input_file.h"
 
 // Coding order to display order
 static const int cd1[1] = {0};
@@ -72,21 +79,34 @@ static int reorder_frame_offset(int idx, int sub_gop, int dyadic)
   }
 }
 
-int main(int argc, char **argv)
+/* Number of frames in the reference window, covering the deepest reference of the GOP structure */
+static int reference_window_size(enc_params *params)
 {
-  FILE *infile, *strfile, *reconfile;
+  int sub_gop = max(1,params->num_reorder_pics+1);
+  int size = params->max_num_ref + 1;
+  if (params->num_reorder_pics > 0)
+    size = max(size, 2*sub_gop + 1);
+  else
+    size = max(size, params->HQperiod + 1);
+  return min(size, MAX_REF_FRAMES);
+}
 
-  uint32_t input_file_size; //TODO: Support file size values larger than 32 bits 
-  yuv_frame_t orig,ref[MAX_REF_FRAMES];
-  yuv_frame_t rec[MAX_REORDER_BUFFER];
-  int rec_available[MAX_REORDER_BUFFER] = {0};
+int main(int argc, char **argv)
+{
+  FILE *strfile, *reconfile;
+
+  input_file_t input;
+  yuv_frame_t orig;
+  scratch_arena_t scratch;
+  yuv_frame_t *rec[MAX_REORDER_BUFFER] = {NULL};
+  frame_pool_t ref_pool;
+  int num_ref_frames,num_rec_frames;
   int last_frame_output=-1;
   int num_encoded_frames,num_bits,start_bits,end_bits;
   int sub_gop=1;
   int rec_buffer_idx;
   int frame_num,frame_num0,k,r;
   int frame_offset;
-  int ysize,csize,frame_size;
   int width,height;
   int min_interp_depth;
   int last_intra_frame_num = 0;
@@ -114,13 +134,18 @@ int main(int argc, char **argv)
   {
     fatalerror("Error while reading encoder paramaters.");
   }
+
+  /* Open the input first, since Y4M files and streams carry their own geometry and frame rate.
+     Frames are read ahead up to the end of the next subgroup when the input is a stream. */
+  open_input_file(&input,params->infilestr,params->width,params->height,params->input_format,
+                  params->file_headerlen,params->frame_headerlen,max(1,params->num_reorder_pics+1)+1);
+  params->width = input.width;
+  params->height = input.height;
+  if (input.frame_rate > 0)
+    params->frame_rate = input.frame_rate;
   check_parameters(params);
 
   /* Open files */
-  if (!(infile = fopen(params->infilestr,"rb")))
-  {
-    fatalerror("Could not open in-file for reading.");
-  }
   if (!(strfile = fopen(params->outfilestr,"wb")))
   {
     fatalerror("Could not open out-file for writing.");
@@ -136,11 +161,6 @@ int main(int argc, char **argv)
     p = strrchr(params->reconfilestr,'.');
     y4m_output = p != NULL && strcmp(p,".y4m") == 0;
   }
-  
-  fseek(infile, 0, SEEK_END);
-  input_file_size = ftell(infile);
-  fseek(infile, 0, SEEK_SET);
-
 
   if (y4m_output) {
     fprintf(reconfile,
@@ -155,23 +175,19 @@ int main(int argc, char **argv)
 
   height = params->height;
   width = params->width;
-  ysize = height * width;
-  csize = ysize / 4;
-  frame_size = ysize + 2*csize;
-
-  /* Create frames*/
-  create_yuv_frame(&orig,width,height,0,0,0,0);
-  for (r=0;r<MAX_REORDER_BUFFER;r++){
-    create_yuv_frame(&rec[r],width,height,0,0,0,0);
-  }
-  for (r=0;r<MAX_REF_FRAMES;r++){ //TODO: Use Long-term frame instead of a large sliding window
-    create_yuv_frame(&ref[r],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
+
+  /* Create frames, with the reorder buffer no deeper than the reference window */
+  num_ref_frames = reference_window_size(params);
+  num_rec_frames = min(num_ref_frames,MAX_REORDER_BUFFER);
+  /* Reconstructed frames are used for output and as references without copying, so one pool covers both */
+  create_frame_pool(&ref_pool,num_ref_frames+1,width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2,NULL);
+  for (r=0;r<MAX_SKIP_FRAMES;r++){
+    encoder_info.interp_frames[r] = NULL;
   }
   if (params->interp_ref) {
-    for (r=0;r<MAX_SKIP_FRAMES;r++){
-      encoder_info.interp_frames[r] = malloc(sizeof(yuv_frame_t));
-      create_yuv_frame(encoder_info.interp_frames[r],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
-    }
+    /* Only one interpolated frame is used at a time */
+    encoder_info.interp_frames[0] = malloc(sizeof(yuv_frame_t));
+    create_yuv_frame(encoder_info.interp_frames[0],width,height,PADDING_Y,PADDING_Y,PADDING_Y/2,PADDING_Y/2);
   }
 
   /* Initialize main bit stream */
@@ -186,18 +202,50 @@ int main(int argc, char **argv)
   encoder_info.params = params;
   encoder_info.orig = &orig;
   for (r=0;r<MAX_REF_FRAMES;r++){
-    encoder_info.ref[r] = &ref[r];
+    encoder_info.ref[r] = NULL;
   }
+  encoder_info.ref_pool = &ref_pool;
+  encoder_info.num_ref_frames = num_ref_frames;
   encoder_info.stream = &stream;
   encoder_info.width = width;
   encoder_info.height = height;
 
-  encoder_info.deblock_data = (deblock_data_t *)malloc((height/MIN_PB_SIZE) * (width/MIN_PB_SIZE) * sizeof(deblock_data_t));
+  encoder_info.deblock_data = (deblock_data_t *)malloc(sizeof(deblock_data_t));
+  create_deblock_data(encoder_info.deblock_data, width, height);
 
-  alloc_wmatrices(encoder_info.wmatrix);
-  alloc_wmatrices(encoder_info.iwmatrix);
+  create_scratch_arena(&scratch, SCRATCH_ARENA_SIZE);
+  encoder_info.scratch = &scratch;
 
-  make_wmatrices(encoder_info.wmatrix, encoder_info.iwmatrix);
+  encoder_info.prev_deblock_data = NULL;
+  encoder_info.static_map = NULL;
+  if (params->static_bypass) {
+    encoder_info.static_map = (uint8_t *)malloc(((height + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE) * ((width + MAX_BLOCK_SIZE - 1)/MAX_BLOCK_SIZE));
+    if (encoder_info.static_map == NULL)
+      fatalerror("Memory allocation failed for static superblock map\n");
+  }
+  memset(&encoder_info.partition_stats, 0, sizeof(partition_stats_t));
+
+  encoder_info.me_pyramid = NULL;
+  if (params->pyramid_me)
+    alloc_me_pyramids(&encoder_info);
+
+  encoder_info.me_hash = NULL;
+  if (params->hash_me)
+    alloc_me_hashes(&encoder_info);
+
+  encoder_info.me_cache = NULL;
+  if (params->me_cache)
+    alloc_me_cache(&encoder_info);
+
+  encoder_info.subpel_planes = NULL;
+  if (params->subpel_cache) {
+    /* One set of planes per reference and filter type, plus the interpolated frame */
+    alloc_subpel_planes(&encoder_info, 2*(params->max_num_ref+1));
+    for (r=0;r<ref_pool.num_frames;r++)
+      register_subpel_frame(encoder_info.subpel_planes, &ref_pool.frames[r]);
+    if (params->interp_ref)
+      register_subpel_frame(encoder_info.subpel_planes, encoder_info.interp_frames[0]);
+  }
 
   /* Write sequence header */ //TODO: Separate function for sequence header
   start_bits = get_bit_pos(&stream);
@@ -236,7 +284,7 @@ int main(int argc, char **argv)
     init_rate_control_per_sequence(&rc, target_bits, num_sb);
   }
 
-  for (frame_num0 = params->skip; frame_num0 < (params->skip + params->num_frames) && (frame_num0+1)*frame_size <= input_file_size; frame_num0+=sub_gop)
+  for (frame_num0 = params->skip; frame_num0 < (params->skip + params->num_frames) && input_frame_available(&input,frame_num0); frame_num0+=sub_gop)
   {
     for (k=0; k<sub_gop; k++) {
       int r,r1,r2,r3;
@@ -247,8 +295,10 @@ int main(int argc, char **argv)
       if (frame_num<params->skip) continue;
 
       encoder_info.frame_info.frame_num = frame_num - params->skip;
-      rec_buffer_idx = encoder_info.frame_info.frame_num%MAX_REORDER_BUFFER;
-      encoder_info.rec = &rec[rec_buffer_idx];
+      rec_buffer_idx = encoder_info.frame_info.frame_num%num_rec_frames;
+      if (rec[rec_buffer_idx])
+        fatalerror("Reorder buffer overflow\n");
+      encoder_info.rec = acquire_pool_frame(&ref_pool);
       encoder_info.rec->frame_num = encoder_info.frame_info.frame_num;
       if (params->num_reorder_pics==0) {
         if (params->intra_period > 0)
@@ -486,6 +536,11 @@ int main(int argc, char **argv)
         }
       }
 
+      for (r=0; r<encoder_info.frame_info.num_ref; r++){
+        if (encoder_info.frame_info.ref_array[r] >= num_ref_frames)
+          fatalerror("Reference index outside the reference window\n");
+      }
+
       // Remove reference frames which break random access
       if (encoder_info.frame_info.frame_num > last_intra_frame_num) {
         for (r=encoder_info.frame_info.num_ref-1; r>=0; --r){
@@ -524,26 +579,37 @@ int main(int argc, char **argv)
 #endif
 
       /* Read input frame */
-      fseek(infile, frame_num*(frame_size+params->frame_headerlen)+params->file_headerlen+params->frame_headerlen, SEEK_SET);
-      read_yuv_frame(&orig,width,height,infile);
+      read_input_frame(&input,frame_num,&orig);
       orig.frame_num = encoder_info.frame_info.frame_num;
 
+      /* Frame numbers of the references, since the window slides when the frame is encoded */
+      int ref_frame_num[MAX_REF_FRAMES];
+      for (r=0; r<encoder_info.frame_info.num_ref; r++){
+        int idx = encoder_info.frame_info.ref_array[r];
+        ref_frame_num[r] = idx >= 0 ? encoder_info.ref[idx]->frame_num : -1;
+      }
+
       /* Encode frame */
       start_bits = get_bit_pos(&stream);
       encode_frame(&encoder_info);
 
-      rec_available[rec_buffer_idx]=1;
       end_bits =  get_bit_pos(&stream);
       num_bits = end_bits-start_bits;
       num_encoded_frames++;
 
       /* Compute SNR */
       if (params->snrcalc){
-        snr_yuv(&psnr,&orig,&rec[rec_buffer_idx],height,width);
+        snr_yuv(&psnr,&orig,encoder_info.rec,height,width);
       }
       else{
         psnr.y =  psnr.u = psnr.v = 0.0;
       }
+
+      /* Hold on to the frame until it has been output */
+      if (reconfile)
+        rec[rec_buffer_idx] = encoder_info.rec;
+      else
+        release_pool_frame(&ref_pool,encoder_info.rec);
       accsnr.y += psnr.y;
       accsnr.u += psnr.u;
       accsnr.v += psnr.v;
@@ -569,9 +635,7 @@ int main(int argc, char **argv)
       fprintf(stdout, " | ");
       for (ref_idx = 0; ref_idx<encoder_info.frame_info.num_ref; ref_idx++) {
         int r0 = encoder_info.frame_info.ref_array[ref_idx+0];
-        int r1 = encoder_info.frame_info.ref_array[ref_idx+1];
-        int r2 = encoder_info.frame_info.ref_array[ref_idx+2];
-        r0 == -1 ? fprintf(stdout, "I(%d,%d)", encoder_info.ref[r1 + 1]->frame_num, encoder_info.ref[r2 + 1]->frame_num) : fprintf(stdout, "%3d", encoder_info.ref[r0 + 1]->frame_num);
+        r0 == -1 ? fprintf(stdout, "I(%d,%d)", ref_frame_num[ref_idx+1], ref_frame_num[ref_idx+2]) : fprintf(stdout, "%3d", ref_frame_num[ref_idx]);
       }
       fprintf(stdout,"\n");
       fflush(stdout);
@@ -581,15 +645,16 @@ int main(int argc, char **argv)
 
       if (reconfile){
         /* Write output frame */
-        rec_buffer_idx = (last_frame_output+1) % MAX_REORDER_BUFFER;
-        if (rec_available[rec_buffer_idx]) {
+        rec_buffer_idx = (last_frame_output+1) % num_rec_frames;
+        if (rec[rec_buffer_idx]) {
           last_frame_output++;
           if (y4m_output)
           {
             fprintf(reconfile, "FRAME\x0a");
           }
-          write_yuv_frame(&rec[rec_buffer_idx],width,height,reconfile);
-          rec_available[rec_buffer_idx]=0;
+          write_yuv_frame(rec[rec_buffer_idx],width,height,reconfile);
+          release_pool_frame(&ref_pool,rec[rec_buffer_idx]);
+          rec[rec_buffer_idx] = NULL;
         }
       }
 
@@ -601,7 +666,7 @@ int main(int argc, char **argv)
        should mean that the first reference is correct when we do, although subsequent references
        may not be ideal.
      */
-    if (((frame_num0+sub_gop+1)*frame_size > input_file_size || frame_num0+sub_gop >= params->skip+params->num_frames )&& sub_gop>=2) {
+    if ((!input_frame_available(&input,frame_num0+sub_gop) || frame_num0+sub_gop >= params->skip+params->num_frames )&& sub_gop>=2) {
       params->HQperiod = sub_gop;
       sub_gop = 1;
       params->num_reorder_pics = 0;
@@ -610,11 +675,14 @@ int main(int argc, char **argv)
   // Write out the tail
   int i;
   if (reconfile) {
-    for (i=1; i<=MAX_REORDER_BUFFER; ++i) {
-      rec_buffer_idx=(last_frame_output+i) % MAX_REORDER_BUFFER;
-      if (rec_available[rec_buffer_idx]) {
-        write_yuv_frame(&rec[rec_buffer_idx],width,height,reconfile);
-        rec_available[rec_buffer_idx]=0;
+    for (i=1; i<=num_rec_frames; ++i) {
+      rec_buffer_idx=(last_frame_output+i) % num_rec_frames;
+      if (rec[rec_buffer_idx]) {
+        if (y4m_output)
+          fprintf(reconfile, "FRAME\x0a");
+        write_yuv_frame(rec[rec_buffer_idx],width,height,reconfile);
+        release_pool_frame(&ref_pool,rec[rec_buffer_idx]);
+        rec[rec_buffer_idx] = NULL;
       }
       else
         break;
@@ -632,6 +700,18 @@ int main(int argc, char **argv)
   fprintf(stdout,"PSNR V          : %12.3f\n",accsnr.v/num_encoded_frames);
   fprintf(stdout,"------------------------------------------------------------------------------\n");
 
+  if (params->partition_early_out) {
+    partition_stats_t *ps = &encoder_info.partition_stats;
+    /* With early-out enabled, a split chosen for a block predicted unsplit comes from the top-down
+       fallback, so the prediction was overruled rather than costly */
+    fprintf(stdout,"Partition early-out: %d blocks, %d predicted unsplit (%d %s), %d predicted split",
+            ps->blocks, ps->pred_unsplit, ps->miss_unsplit,
+            params->partition_early_out == 1 ? "split top-down" : "missed", ps->pred_split);
+    if (params->partition_early_out == 2)
+      fprintf(stdout," (%d missed)",ps->miss_split);
+    fprintf(stdout,"\n");
+  }
+
   /* Append one line of statistics to a file */
   if (params->statfilestr) {
     FILE *cumu_fp;
@@ -652,30 +732,31 @@ int main(int argc, char **argv)
     }
   }
 
-  free_wmatrices(encoder_info.wmatrix);
-  free_wmatrices(encoder_info.iwmatrix);
+  free_me_pyramids(&encoder_info);
+  free_me_hashes(&encoder_info);
+  free_subpel_planes(&encoder_info);
+  free_me_cache(&encoder_info);
 
-  close_yuv_frame(&orig);
-  for (int i=0; i<MAX_REORDER_BUFFER; ++i) {
-    close_yuv_frame(&rec[i]);
-  }
-  for (r=0;r<MAX_REF_FRAMES;r++){
-    close_yuv_frame(&ref[r]);
-  }
+  close_frame_pool(&ref_pool);
   if (params->interp_ref) {
-    for (r=0;r<MAX_SKIP_FRAMES;r++){
-      close_yuv_frame(encoder_info.interp_frames[r]);
-      free(encoder_info.interp_frames[r]);
-    }
+    close_yuv_frame(encoder_info.interp_frames[0]);
+    free(encoder_info.interp_frames[0]);
   }
-  fclose(infile);
+  close_input_file(&input);
   fclose(strfile);
   if (reconfile)
   {
     fclose(reconfile);
   }
   free(stream.bitstream);
+  close_deblock_data(encoder_info.deblock_data);
   free(encoder_info.deblock_data);
+  if (encoder_info.prev_deblock_data) {
+    close_deblock_data(encoder_info.prev_deblock_data);
+    free(encoder_info.prev_deblock_data);
+  }
+  free(encoder_info.static_map);
+  close_scratch_arena(&scratch);
 
   if (params->bitrate > 0) {
     delete_rate_control_per_sequence(&rc);
@@ -43,6 +43,7 @@ typedef struct
   char *statfilestr;
   unsigned int file_headerlen;
   unsigned int frame_headerlen;
+  int input_format;           //0: I420, 1: NV12, 2: NV21, 3: YUY2
   unsigned int num_frames;
   int skip;
   float frame_rate;
@@ -92,6 +93,16 @@ typedef struct
   int max_qpI;
   int min_qpI;
   int qmtx;
+  int hadamard_me;
+  int intra_rdo_modes;
+  int pyramid_me;
+  int subpel_cache;
+  int me_cache;
+  int tdomain_rdo;
+  int partition_early_out;
+  int static_bypass;
+  float static_thr;
+  int hash_me;
 } enc_params;
 
 typedef struct
@@ -101,6 +112,27 @@ typedef struct
   uint8_t v[MAX_BLOCK_SIZE/2*MAX_BLOCK_SIZE/2];
 } yuv_block_t;
 
+#define PRED_CACHE_SIZE 8        //Inter predictions kept per block during mode decision
+
+/* Identifies an inter prediction of the current block */
+typedef struct
+{
+  int bipred;
+  int split;
+  int ref_idx0;
+  int ref_idx1;
+  mv_t mv0[4];
+  mv_t mv1[4];
+} pred_key_t;
+
+typedef struct
+{
+  int num;
+  int next;
+  pred_key_t key[PRED_CACHE_SIZE];
+  yuv_block_t pred[PRED_CACHE_SIZE];
+} pred_cache_t;
+
 typedef struct
 {
   block_pos_t block_pos;
@@ -122,6 +154,9 @@ typedef struct
   yuv_block_t *rec_block_best;
   double lambda;
   int qp;
+  pred_cache_t *pred_cache;
+  int tdomain_rdo;        //Estimate inter distortion from the quantization error
+  uint32_t tdomain_dist;  //Estimated distortion of the last encode_block(), MAX_UINT32 if reconstructed
 } block_info_t; //TODO: Consider merging with block_pos_t
 
 
@@ -149,6 +184,90 @@ typedef struct
   int min_ref_dist;
 } frame_info_t;
 
+#define ME_PYRAMID_LEVELS 2      //Number of downscaled levels (1/2 and 1/4) used by pyramid ME
+#define ME_PYRAMID_FRAMES (MAX_REF_FRAMES+3) //Reference slots, the frame being coded, the interpolated frame and the original
+
+/* Downscaled copies of a frame for hierarchical motion search */
+typedef struct
+{
+  const yuv_frame_t *src;
+  int frame_num;
+  yuv_frame_t level[ME_PYRAMID_LEVELS];
+} me_pyramid_t;
+
+#define ME_HASH_FRAMES 4         //Most recent reference frames with a block hash table
+#define ME_HASH_BLOCK 16         //Size of the hashed blocks
+#define ME_HASH_BITS 18          //Number of hash table buckets, log2
+
+/* Hashes of all ME_HASH_BLOCK x ME_HASH_BLOCK luma blocks of a source frame, for finding exact copies */
+typedef struct
+{
+  int frame_num;
+  int32_t *head;        //First block position per bucket, -1 if empty
+  int32_t *next;        //Next block position in the same bucket
+  uint32_t *key;        //Hash of the block at each position
+} me_hash_t;
+
+#define ME_CACHE_BITS 14         //Number of ME cache entries, log2
+
+/* Motion search result of a block, keyed by reference position and block size */
+typedef struct
+{
+  const uint8_t *ref;
+  int16_t width;
+  int16_t height;
+  int bipred;
+  unsigned int gen;
+  mv_t mv;
+  mv_t mv_int;
+  unsigned int dist;
+} me_cache_entry_t;
+
+/* Motion search results of the current frame, entries of older generations are stale */
+typedef struct
+{
+  me_cache_entry_t *entry;
+  unsigned int gen;
+} me_cache_t;
+
+#define SUBPEL_FRAMES (MAX_REF_FRAMES+MAX_SKIP_FRAMES) //Frames whose luma may be read through the sub-pel planes
+
+/* The 15 fractional phases of one reference frame, for one filter set */
+typedef struct
+{
+  const yuv_frame_t *frame;
+  int frame_num;
+  int bipred;
+  unsigned int last_use;
+  int width;
+  int height;
+  int stride;
+  uint8_t *buf;
+  uint8_t *plane[16];
+} subpel_planeset_t;
+
+/* Least recently used plane sets of the registered frames */
+typedef struct
+{
+  subpel_planeset_t *planesets;
+  int num_planesets;
+  unsigned int use_count;
+  yuv_frame_t *frames[SUBPEL_FRAMES];
+  int num_frames;
+} subpel_planes_t;
+
+/* Outcome of the partition early-out predictor, for tuning its miss rate */
+typedef struct
+{
+  int blocks;           //Blocks where both sizes were allowed
+  int pred_unsplit;     //Predicted to stay unsplit
+  int pred_split;       //Predicted to split
+  int miss_unsplit;     //Predicted unsplit but split was chosen, through the top-down fallback with -partition_early_out 1
+  int miss_split;       //Predicted split but unsplit was chosen (only known with -partition_early_out 2)
+} partition_stats_t;
+
+#define SCRATCH_ARENA_SIZE (1<<20) //Bytes of temporary buffers for the block coder, peak use is about 350 KB
+
 typedef struct 
 {
   block_info_t *block_info;
@@ -156,16 +275,24 @@ typedef struct
   enc_params *params;
   yuv_frame_t *orig;
   yuv_frame_t *rec;
-  yuv_frame_t *ref[MAX_REF_FRAMES];
+  yuv_frame_t *ref[MAX_REF_FRAMES];     //Sliding window, the first num_ref_frames entries are used
   yuv_frame_t *interp_frames[MAX_SKIP_FRAMES];
+  frame_pool_t *ref_pool;
+  int num_ref_frames;
   stream_t *stream;
   deblock_data_t *deblock_data;
   rate_control_t *rc;
   int width;
   int height;
   int depth;
-  qmtx_t *wmatrix[52][3][2][TR_SIZE_RANGE];
-  qmtx_t *iwmatrix[52][3][2][TR_SIZE_RANGE];
+  me_pyramid_t *me_pyramid;
+  me_hash_t *me_hash;
+  subpel_planes_t *subpel_planes;       //NULL unless -subpel_cache is set
+  me_cache_t *me_cache;                 //NULL unless -me_cache is set
+  deblock_data_t *prev_deblock_data;    //Block data of the previous frame in coding order
+  partition_stats_t partition_stats;
+  uint8_t *static_map;                  //Superblocks matching the zero vector skip reference, per frame
+  scratch_arena_t *scratch;             //Temporary buffers of the block coder
 } encoder_info_t;
 
 #endif
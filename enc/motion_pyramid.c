@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "mainenc.h"
+#include "common_frame.h"
+#include "temporal_interp.h"
+#include "simd.h"
+#include "encode_block.h"
+#include "motion_pyramid.h"
+
+#define PYRAMID_PAD 32    //Luma padding of the downscaled frames
+#define PYRAMID_RANGE 12  //Search range at the coarsest level, +/-48 full-pel positions
+
+void alloc_me_pyramids(encoder_info_t *encoder_info)
+{
+  /* Levels are created on first use of each slot */
+  encoder_info->me_pyramid = (me_pyramid_t *)calloc(ME_PYRAMID_FRAMES, sizeof(me_pyramid_t));
+  if (encoder_info->me_pyramid == NULL)
+    fatalerror("Memory allocation failed for ME pyramid\n");
+}
+
+void free_me_pyramids(encoder_info_t *encoder_info)
+{
+  me_pyramid_t *p = encoder_info->me_pyramid;
+  if (p == NULL)
+    return;
+  for (int i = 0; i < ME_PYRAMID_FRAMES; i++) {
+    if (p[i].src == NULL)
+      continue;
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++)
+      close_yuv_frame(&p[i].level[l]);
+  }
+  free(p);
+  encoder_info->me_pyramid = NULL;
+}
+
+/* Return the pyramid of a frame, downscaling it again if its content has changed */
+static me_pyramid_t *get_me_pyramid(encoder_info_t *encoder_info, yuv_frame_t *frame)
+{
+  me_pyramid_t *p = encoder_info->me_pyramid;
+  int i;
+
+  for (i = 0; i < ME_PYRAMID_FRAMES && p[i].src != NULL && p[i].src != frame; i++);
+  if (i == ME_PYRAMID_FRAMES)
+    fatalerror("Too many frames in ME pyramid\n");
+
+  if (p[i].src == NULL) {
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++)
+      create_yuv_frame(&p[i].level[l], frame->width >> (l+1), frame->height >> (l+1), PYRAMID_PAD, PYRAMID_PAD, PYRAMID_PAD/2, PYRAMID_PAD/2);
+    p[i].src = frame;
+    p[i].frame_num = frame->frame_num - 1;
+  }
+
+  if (p[i].frame_num != frame->frame_num) {
+    yuv_frame_t *src = frame;
+    for (int l = 0; l < ME_PYRAMID_LEVELS; l++) {
+      (use_simd ? scale_frame_down2x2_simd : scale_frame_down2x2)(src, &p[i].level[l]);
+      src = &p[i].level[l];
+    }
+    p[i].frame_num = frame->frame_num;
+  }
+  return &p[i];
+}
+
+/* Exhaustive search of a size x size block within +/-range around (cx,cy) */
+static void pyramid_search(yuv_frame_t *org, yuv_frame_t *ref, int xpos, int ypos, int size, int cx, int cy, int range, int *dx, int *dy)
+{
+  uint8_t *refs[2*PYRAMID_RANGE+1];
+  unsigned int sad[2*PYRAMID_RANGE+1];
+  int xmin = -PYRAMID_PAD - xpos;
+  int ymin = -PYRAMID_PAD - ypos;
+  int xmax = ref->width + PYRAMID_PAD - size - xpos;
+  int ymax = ref->height + PYRAMID_PAD - size - ypos;
+  unsigned int min_cost = MAX_UINT32;
+  int bestx = cx, besty = cy;
+
+  for (int k = -range; k <= range; k++) {
+    int y = clip(cy + k, ymin, ymax);
+    for (int l = -range; l <= range; l++) {
+      int x = clip(cx + l, xmin, xmax);
+      refs[l + range] = ref->y + (ypos + y)*ref->stride_y + xpos + x;
+    }
+    sad_calc_batch(org->y + ypos*org->stride_y + xpos, refs, 2*range+1, org->stride_y, ref->stride_y, size, size, sad);
+    for (int l = -range; l <= range; l++) {
+      int x = clip(cx + l, xmin, xmax);
+      /* Bias towards short vectors to stay on the true motion in flat areas */
+      unsigned int cost = sad[l + range] + abs(x) + abs(y);
+      if (cost < min_cost) {
+        min_cost = cost;
+        bestx = x;
+        besty = y;
+      }
+    }
+  }
+  *dx = bestx;
+  *dy = besty;
+}
+
+/* Seed the full resolution search of a superblock with coarse-to-fine motion vectors */
+void pyramid_mv_candidates(encoder_info_t *encoder_info, int ypos, int xpos)
+{
+  frame_info_t *frame_info = &encoder_info->frame_info;
+  me_pyramid_t *org = get_me_pyramid(encoder_info, encoder_info->orig);
+  int top = ME_PYRAMID_LEVELS - 1;
+
+  for (int ref_idx = 0; ref_idx < frame_info->num_ref; ref_idx++) {
+    int r = frame_info->ref_array[ref_idx];
+    yuv_frame_t *ref = r >= 0 ? encoder_info->ref[r] : encoder_info->interp_frames[0];
+    me_pyramid_t *pr = get_me_pyramid(encoder_info, ref);
+    int s = ref->frame_num > encoder_info->rec->frame_num ? -1 : 1;
+    int dx = 0, dy = 0;
+    mv_t mv;
+
+    pyramid_search(&org->level[top], &pr->level[top], xpos >> (top+1), ypos >> (top+1), MAX_BLOCK_SIZE >> (top+1), 0, 0, PYRAMID_RANGE, &dx, &dy);
+    for (int l = top - 1; l >= 0; l--)
+      pyramid_search(&org->level[l], &pr->level[l], xpos >> (l+1), ypos >> (l+1), MAX_BLOCK_SIZE >> (l+1), 2*dx, 2*dy, 2, &dx, &dy);
+
+    /* Level 0 is half resolution; candidates are in quarter-pel units */
+    mv.x = s*dx*8;
+    mv.y = s*dy*8;
+    add_mvcandidate(&mv, frame_info->mvcand[ref_idx], frame_info->mvcand_num + ref_idx, frame_info->mvcand_mask + ref_idx);
+  }
+}
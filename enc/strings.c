@@ -266,7 +266,6 @@ static int parse_params(int argc, char **argv, enc_params *params, param_list *l
 
 enc_params *parse_config_params(int argc, char **argv)
 {
-  FILE *infile;
   param_list list;
   enc_params *params;
   char *default_argv[MAX_PARAMS*2];
@@ -287,6 +286,7 @@ enc_params *parse_config_params(int argc, char **argv)
   add_param_to_list(&list, "-if",                   NULL, ARG_FILENAME, &params->infilestr);
   add_param_to_list(&list, "-ph",                    "0", ARG_INTEGER,  &params->file_headerlen);
   add_param_to_list(&list, "-fh",                    "0", ARG_INTEGER,  &params->frame_headerlen);
+  add_param_to_list(&list, "-input_format",          "0", ARG_INTEGER,  &params->input_format);
   add_param_to_list(&list, "-of",                   NULL, ARG_FILENAME, &params->outfilestr);
   add_param_to_list(&list, "-rf",                   NULL, ARG_FILENAME, &params->reconfilestr);
   add_param_to_list(&list, "-stat",                 NULL, ARG_FILENAME, &params->statfilestr);
@@ -342,6 +342,16 @@ enc_params *parse_config_params(int argc, char **argv)
   add_param_to_list(&list, "-max_qpI",              "32", ARG_INTEGER,  &params->max_qpI);
   add_param_to_list(&list, "-min_qpI",              "32", ARG_INTEGER,  &params->min_qpI);
   add_param_to_list(&list, "-qmtx",                  "0", ARG_INTEGER,  &params->qmtx);
+  add_param_to_list(&list, "-hadamard_me",           "0", ARG_INTEGER,  &params->hadamard_me);
+  add_param_to_list(&list, "-intra_rdo_modes",       "0", ARG_INTEGER,  &params->intra_rdo_modes);
+  add_param_to_list(&list, "-pyramid_me",            "0", ARG_INTEGER,  &params->pyramid_me);
+  add_param_to_list(&list, "-subpel_cache",          "0", ARG_INTEGER,  &params->subpel_cache);
+  add_param_to_list(&list, "-me_cache",              "0", ARG_INTEGER,  &params->me_cache);
+  add_param_to_list(&list, "-tdomain_rdo",           "0", ARG_INTEGER,  &params->tdomain_rdo);
+  add_param_to_list(&list, "-partition_early_out",   "0", ARG_INTEGER,  &params->partition_early_out);
+  add_param_to_list(&list, "-static_bypass",         "0", ARG_INTEGER,  &params->static_bypass);
+  add_param_to_list(&list, "-static_thr",            "0", ARG_FLOAT,    &params->static_thr);
+  add_param_to_list(&list, "-hash_me",               "0", ARG_INTEGER,  &params->hash_me);
 
   /* Generate "argv" and "argc" for default parameters */
   default_argc = 1;
@@ -361,59 +371,6 @@ enc_params *parse_config_params(int argc, char **argv)
   if (parse_params(argc, argv, params, &list) < 0)
     return NULL;
 
-  /* Check if input file is y4m and if so use its geometry */
-  if ((infile = fopen(params->infilestr, "rb"))) {
-    char buf[256];
-    int len = fread(buf, 1, sizeof(buf), infile);
-    int pos = 10;
-    int num, den;
-    buf[255] = 0;
-    if (!strncmp(buf, "YUV4MPEG2 ", 10)) {
-      char *end;
-      while (pos < len && buf[pos] != '\n') {
-          switch (buf[pos++]) {
-          case 'W':
-            params->width = strtol(buf+pos, &end, 10);
-            pos = end-buf+1;
-            break;
-          case 'H':
-            params->height = strtol(buf+pos, &end, 10);
-            pos = end-buf+1;
-            break;
-          case 'F':
-            den = strtol(buf+pos, &end, 10);
-            pos = end-buf+1;
-            num = strtol(buf+pos, &end, 10);
-            pos = end-buf+1;
-            params->frame_rate = (double)den/num;
-            break;
-          case 'I':
-            if (buf[pos] != 'p') {
-              fprintf(stderr, "Only progressive input supported\n");
-              return NULL;
-            }
-            break;
-          case 'C':
-            if (strcmp(buf+pos, "C420")) {
-            }
-            /* Fallthrough */
-          case 'A': /* Ignored */
-          case 'X':
-          default:
-            while (buf[pos] != ' ' && buf[pos] != '\n' && pos < len)
-              pos++;
-            break;
-          }
-        }
-        if (strncmp(buf+pos, "\nFRAME\n", 7)) {
-          fprintf(stderr, "Corrupt Y4M file\n");
-          return NULL;
-        }
-        params->file_headerlen = pos + 1;
-        params->frame_headerlen = 6;
-    }
-    fclose(infile);
-  }
   return params;
 }
 
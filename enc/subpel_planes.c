@@ -0,0 +1,179 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "simd.h"
+#include "inter_prediction.h"
+#include "subpel_planes.h"
+
+#define SUBPEL_MARGIN (MAX_BLOCK_SIZE + 8) //Luma positions covered outside the frame, within PADDING_Y
+#define SUBPEL_TILE 64
+
+void alloc_subpel_planes(encoder_info_t *encoder_info, int num)
+{
+  subpel_planes_t *sp = (subpel_planes_t *)calloc(1, sizeof(subpel_planes_t));
+  if (sp == NULL)
+    fatalerror("Memory allocation failed for sub-pel planes\n");
+  sp->planesets = (subpel_planeset_t *)calloc(num, sizeof(subpel_planeset_t));
+  if (sp->planesets == NULL)
+    fatalerror("Memory allocation failed for sub-pel planes\n");
+  sp->num_planesets = num;
+  encoder_info->subpel_planes = sp;
+}
+
+void free_subpel_planes(encoder_info_t *encoder_info)
+{
+  subpel_planes_t *sp = encoder_info->subpel_planes;
+  if (sp == NULL)
+    return;
+  for (int i = 0; i < sp->num_planesets; i++)
+    free(sp->planesets[i].buf);
+  free(sp->planesets);
+  free(sp);
+  encoder_info->subpel_planes = NULL;
+}
+
+/* Frames whose pointers may be passed to get_subpel_block() */
+void register_subpel_frame(subpel_planes_t *sp, yuv_frame_t *frame)
+{
+  if (sp->num_frames == SUBPEL_FRAMES)
+    fatalerror("Too many frames for sub-pel planes\n");
+  sp->frames[sp->num_frames++] = frame;
+}
+
+static void build_planeset(subpel_planeset_t *p, const yuv_frame_t *frame, int bipred)
+{
+  int width = frame->width + 2*SUBPEL_MARGIN;
+  int height = frame->height + 2*SUBPEL_MARGIN;
+  int stride = (width + 15) & ~15;
+
+  /* Not thor_alloc(), which may allocate on the stack */
+  if (!p->buf || p->width != width || p->height != height) {
+    free(p->buf);
+    p->buf = (uint8_t *)malloc(15*stride*height + 15);
+    if (p->buf == NULL)
+      fatalerror("Memory allocation failed for sub-pel planes\n");
+    p->width = width;
+    p->height = height;
+    p->stride = stride;
+  }
+  uint8_t *base = p->buf + ((16 - (uintptr_t)p->buf) & 15);
+
+  for (int phase = 1; phase < 16; phase++) {
+    mv_t mv;
+    mv.x = phase & 3;
+    mv.y = phase >> 2;
+    p->plane[phase] = base + (phase-1)*stride*height + SUBPEL_MARGIN*stride + SUBPEL_MARGIN;
+    /* Filter in tiles with the normal prediction so that the result is bit exact */
+    for (int i = -SUBPEL_MARGIN; i < frame->height + SUBPEL_MARGIN; i += SUBPEL_TILE) {
+      int th = min(SUBPEL_TILE, frame->height + SUBPEL_MARGIN - i);
+      for (int j = -SUBPEL_MARGIN; j < frame->width + SUBPEL_MARGIN; j += SUBPEL_TILE) {
+        int tw = min(SUBPEL_TILE, frame->width + SUBPEL_MARGIN - j);
+        get_inter_prediction_luma(p->plane[phase] + i*stride + j, frame->y + i*frame->stride_y + j, tw, th, frame->stride_y, stride, &mv, 0, bipred, 0, 0, 0, 0);
+      }
+    }
+  }
+  p->frame = frame;
+  p->frame_num = frame->frame_num;
+  p->bipred = bipred;
+}
+
+/* Return a pointer to the prediction of a luma block, or NULL if it isn't cached */
+uint8_t *get_subpel_block(subpel_planes_t *sp, uint8_t *ref, int width, int height, const mv_t *mv, int sign, int bipred, int pic_width, int pic_height, int xpos, int ypos, int *pstride)
+{
+  const yuv_frame_t *frame = NULL;
+  int i;
+
+  if (sp == NULL)
+    return NULL;
+
+  for (i = 0; i < sp->num_frames; i++) {
+    uint8_t *base = sp->frames[i]->y - sp->frames[i]->offset_y;
+    if (ref >= base && ref < base + sp->frames[i]->area_y) {
+      frame = sp->frames[i];
+      break;
+    }
+  }
+  if (frame == NULL)
+    return NULL;
+
+  /* Same integer clipping as get_inter_prediction_luma() */
+  int mvx = sign ? -mv->x : mv->x;
+  int mvy = sign ? -mv->y : mv->y;
+  int ver_int = mvy >> 2;
+  int hor_int = mvx >> 2;
+  ver_int = min(ver_int,pic_height-ypos);
+  ver_int = max(ver_int,-xpos-height);
+  hor_int = min(hor_int,pic_width-xpos);
+  hor_int = max(hor_int,-xpos-width);
+
+  int rel = (int)(ref - (frame->y - frame->offset_y));
+  int y0 = rel / frame->stride_y - frame->offset_y / frame->stride_y + ver_int;
+  int x0 = rel % frame->stride_y - frame->offset_y % frame->stride_y + hor_int;
+  int phase = ((mvy & 3) << 2) | (mvx & 3);
+
+  if (!phase) {
+    *pstride = frame->stride_y;
+    return frame->y + y0*frame->stride_y + x0;
+  }
+  if (x0 < -SUBPEL_MARGIN || y0 < -SUBPEL_MARGIN || x0 + width > frame->width + SUBPEL_MARGIN || y0 + height > frame->height + SUBPEL_MARGIN)
+    return NULL;
+
+  /* Find the plane set, replacing the least recently used one if needed */
+  bipred = bipred != 0;
+  subpel_planeset_t *p = NULL;
+  for (i = 0; i < sp->num_planesets; i++) {
+    subpel_planeset_t *q = &sp->planesets[i];
+    if (q->frame == frame && q->frame_num == frame->frame_num && q->bipred == bipred) {
+      p = q;
+      break;
+    }
+    if (p == NULL || q->last_use < p->last_use)
+      p = q;
+  }
+  if (i == sp->num_planesets)
+    build_planeset(p, frame, bipred);
+  p->last_use = ++sp->use_count;
+
+  *pstride = p->stride;
+  return p->plane[phase] + y0*p->stride + x0;
+}
+
+void get_inter_prediction_luma_cached(subpel_planes_t *sp, uint8_t *pblock, uint8_t *ref, int width, int height, int stride, int pstride, mv_t *mv, int sign, int bipred, int pic_width, int pic_height, int xpos, int ypos)
+{
+  int cstride;
+  uint8_t *p = get_subpel_block(sp, ref, width, height, mv, sign, bipred, pic_width, pic_height, xpos, ypos, &cstride);
+
+  if (p == NULL) {
+    get_inter_prediction_luma(pblock, ref, width, height, stride, pstride, mv, sign, bipred, pic_width, pic_height, xpos, ypos);
+    return;
+  }
+  for (int i = 0; i < height; i++)
+    memcpy(pblock + i*pstride, p + i*cstride, width*sizeof(uint8_t));
+}
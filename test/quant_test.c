@@ -0,0 +1,128 @@
+/*
+Copyright (c) 2015, Cisco Systems
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* -*- mode: c; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2; -*- */
+
+/* Compares the SIMD and C versions of quantize() and dequantize() for
+   every transform size, qp, block type and weight matrix on random
+   and extreme coefficients. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+#include "simd.h"
+#include "mainenc.h"
+#include "common_block.h"
+#include "wt_matrix.h"
+#include "encode_block.h"
+
+#define NUM_TRIALS 16
+
+static uint32_t seed = 1;
+
+static int rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) & 0xffff;
+}
+
+static void fill_coeffs(int16_t *coeff, int size, int trial)
+{
+  int i;
+  for (i = 0; i < size*size; i++) {
+    switch (trial % 4) {
+    case 0: coeff[i] = (int16_t)((rnd() & 0x3ff) - 0x200); break;  /* Small */
+    case 1: coeff[i] = (int16_t)rnd(); break;                      /* Full range */
+    case 2: coeff[i] = rnd() & 1 ? -32768 : 32767; break;          /* Extremes */
+    default: coeff[i] = rnd() & 15 ? 0 : (rnd() & 1 ? -32768 : 32767);  /* Sparse extremes */
+    }
+  }
+}
+
+static int compare(const char *name, const int16_t *a, const int16_t *b, int n, int size, int qp, int type, int c)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    if (a[i] != b[i]) {
+      printf("%s mismatch: size=%d qp=%d type=%d qmtx=%d pos=%d c=%d simd=%d\n", name, size, qp, type, c, i, a[i], b[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(void)
+{
+  static int16_t coeff[MAX_TR_SIZE*MAX_TR_SIZE];
+  static int16_t out_c[MAX_TR_SIZE*MAX_TR_SIZE];
+  static int16_t out_simd[MAX_TR_SIZE*MAX_TR_SIZE];
+  int size, qp, type, c, trial, cbp_c, cbp_simd;
+  int errors = 0, tests = 0;
+
+  for (size = 4; size <= MAX_TR_SIZE; size *= 2) {
+    for (qp = 0; qp < 52; qp++) {
+      for (type = 0; type < 4; type += 2) {
+        /* c = -1 is without weight matrix, otherwise the component */
+        for (c = -1; c < 3; c++) {
+          int intra = type >> 1;
+          qmtx_t *wmatrix = c < 0 ? NULL : get_wmatrix(qp, c, intra)[log2i(size/4)];
+          qmtx_t *iwmatrix = c < 0 ? NULL : get_iwmatrix(qp, c, intra)[log2i(size/4)];
+          for (trial = 0; trial < NUM_TRIALS; trial++) {
+            fill_coeffs(coeff, size, trial);
+
+            memset(out_c, 0x55, sizeof(out_c));
+            memset(out_simd, 0x55, sizeof(out_simd));
+            use_simd = 0;
+            cbp_c = quantize(coeff, out_c, qp, size, type, wmatrix, MAX_QUANT_SIZE);
+            use_simd = 1;
+            cbp_simd = quantize(coeff, out_simd, qp, size, type, wmatrix, MAX_QUANT_SIZE);
+            if (cbp_c != cbp_simd) {
+              printf("quantize cbp mismatch: size=%d qp=%d type=%d qmtx=%d c=%d simd=%d\n", size, qp, type, c, cbp_c, cbp_simd);
+              errors++;
+            }
+            errors += compare("quantize", out_c, out_simd, size*size, size, qp, type, c);
+
+            /* Dequantize both the quantizer output and the raw coefficients */
+            if (!(trial & 1))
+              memcpy(coeff, out_c, size*size*sizeof(int16_t));
+            use_simd = 0;
+            dequantize(coeff, out_c, qp, size, iwmatrix, MAX_QUANT_SIZE);
+            use_simd = 1;
+            dequantize(coeff, out_simd, qp, size, iwmatrix, MAX_QUANT_SIZE);
+            errors += compare("dequantize", out_c, out_simd, size*size, size, qp, type, c);
+            tests += 2;
+          }
+        }
+      }
+    }
+  }
+
+  printf("%d tests, %d errors\n", tests, errors);
+  return errors != 0;
+}